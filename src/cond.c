@@ -26,11 +26,16 @@ void cond_signal(struct condition_t* c)
 
     struct thread_t* t = thread_list_pop(&c->threads);
     struct cpu_desc_t* cpu = cpu_lock_id(t->cpu_id);
-    t->state = THREAD_STATE_RUNNING;
+    sched_wakeup_locked(cpu, t);
     cpu_unlock(cpu);
 }
 
 void cond_broadcast(struct condition_t* c)
 {
-    // TODO
+    struct thread_t* t;
+    while ((t = thread_list_pop(&c->threads)) != NULL) {
+        struct cpu_desc_t* cpu = cpu_lock_id(t->cpu_id);
+        sched_wakeup_locked(cpu, t);
+        cpu_unlock(cpu);
+    }
 }
@@ -7,10 +7,36 @@
 #include "local_apic.h"
 #include "sched.h"
 #include "vm_boot.h"
+#include "vm_page.h"
+#include "vm_hat.h"
+#include "fpu.h"
+#include "slab.h"
 
 struct cpu_desc_t cpus[MAX_CPUS];
 uint32_t num_cpus;
 
+// gs points at cpu descriptors, aps take no lock
+// and field no interrupt before setting up theirs
+static bool cpu_desc_ready;
+
+// mcs lock nodes come from the boot cpu's set until then
+static struct mcs_cpu_nodes_t mcs_boot_nodes;
+
+struct mcs_cpu_nodes_t* mcs_cpu_nodes()
+{
+    return cpu_desc_ready ? &get_cpu()->mcs : &mcs_boot_nodes;
+}
+
+// handlers run on the interrupted thread's stack and may switch
+// away, so the count goes with the thread, not the cpu
+bool cpu_in_interrupt()
+{
+    if (!cpu_desc_ready)
+        return false;
+    struct thread_t* t = get_cpu()->cur_thread;
+    return t && t->intr_depth > 0;
+}
+
 void cpu_init_ap(void);
 
 struct segment_desc_t {
@@ -45,6 +71,12 @@ static void idt_set(unsigned int index, uint16_t type, void(*handler)())
 #define IDT_INTERRUPT_GATE      0x8e00
 #define IDT_TRAP_GATE           0x8f00
 
+// interrupt stack table slot, low bits of the gate type. double
+// faults get a stack of their own, they are what a thread running
+// into its stack guard page ends up as
+#define IST_DOUBLE_FAULT        1
+#define IST_STACK_SIZE          0x1000
+
 static void idt_load()
 {
     struct segment_desc_t idt_desc = {
@@ -120,6 +152,7 @@ static void idt_init()
 
     for (unsigned int i = 0; i < 32; ++i)
         idt_set(i, IDT_TRAP_GATE, cpu_exceptions[i]);
+    idt_set(8, IDT_TRAP_GATE | IST_DOUBLE_FAULT, _trap_8);
 
     for (unsigned int i = 32; i < 256; ++i)
         idt_set(i, IDT_INTERRUPT_GATE, _isr_spurious);
@@ -144,6 +177,7 @@ void cpu_interrupt_unset(uint8_t vector)
 #define GDT_ACCESS_PRESENT  (1UL<<47)
 
 #define GDT_FLAGS_X86_64    (1UL<<53)
+#define GDT_TYPE_TSS        (9UL<<40)   // available 64 bit tss
 
 struct gdt_table_t {
     uint64_t unused;
@@ -151,15 +185,30 @@ struct gdt_table_t {
     uint64_t kernel_data;
     uint64_t user_code;
     uint64_t user_data;
+    uint64_t tss[MAX_CPUS][2];  // 16 byte system descriptors
 };
 
-extern uint8_t gdt;
+// 64 bit tss, only the ist stacks are used
+struct tss_t {
+    uint32_t reserved0;
+    uint64_t rsp[3];
+    uint64_t reserved1;
+    uint64_t ist[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t iomap_base;
+} PACKED;
+
+static struct tss_t cpu_tss[MAX_CPUS];
+static uint8_t ist_stacks[MAX_CPUS][IST_STACK_SIZE] __attribute__((aligned(16)));
+
+extern struct gdt_table_t gdt;
 
 static void gdt_load()
 {
-    struct gdt_table_t* gdt_table = (struct gdt_table_t*)&gdt;
+    struct gdt_table_t* gdt_table = &gdt;
     struct segment_desc_t gdt_desc = {
-        .limit = 5 * sizeof(uint64_t) - 1,
+        .limit = sizeof(struct gdt_table_t) - 1,
         .base = (uint64_t)gdt_table
     };
     asm volatile("lgdt %0" : : "m"(gdt_desc) : "memory");
@@ -167,7 +216,7 @@ static void gdt_load()
 
 static void gdt_init()
 {
-    struct gdt_table_t* gdt_table = (struct gdt_table_t*)&gdt;
+    struct gdt_table_t* gdt_table = &gdt;
 
     uint64_t base = GDT_ACCESS_RW
                   | GDT_ACCESS_SET
@@ -182,22 +231,81 @@ static void gdt_init()
     gdt_load();
 }
 
+// every cpu has its own descriptor, ltr marks it busy
+static void tss_load(uint32_t apic_id)
+{
+    struct tss_t* tss = &cpu_tss[apic_id];
+    tss->ist[IST_DOUBLE_FAULT - 1] = (uintptr_t)ist_stacks[apic_id] + IST_STACK_SIZE;
+    tss->iomap_base = sizeof(struct tss_t);
+
+    struct gdt_table_t* gdt_table = &gdt;
+    uint64_t base = (uint64_t)tss;
+    uint64_t limit = sizeof(struct tss_t) - 1;
+    gdt_table->tss[apic_id][0] = (limit & 0xffff)
+                               | ((base & 0xffffff) << 16)
+                               | GDT_TYPE_TSS
+                               | GDT_ACCESS_PRESENT
+                               | (((limit >> 16) & 0xf) << 48)
+                               | (((base >> 24) & 0xff) << 56);
+    gdt_table->tss[apic_id][1] = base >> 32;
+
+    uint16_t selector = (uint16_t)((uintptr_t)gdt_table->tss[apic_id] - (uintptr_t)gdt_table);
+    asm volatile("ltr %0" : : "r"(selector));
+}
+
 void cpu_boot_init()
 {
     gdt_init();
     idt_init();
 }
 
+// pit, drives boot clock until local apic timers take over
 static void timer_irq_handler(struct isr_frame_t* frame)
+{
+    struct cpu_desc_t* cpu = get_cpu();
+    cpu->ticks++;
+}
+
+static void local_timer_irq_handler(struct isr_frame_t* frame)
 {
     struct cpu_desc_t* cpu = cpu_lock();
-    
+
     cpu->ticks++;
     sched_tick(cpu);
-    
+
+    cpu_unlock(cpu);
+}
+
+static void resched_irq_handler(struct isr_frame_t* frame)
+{
+    struct cpu_desc_t* cpu = cpu_lock();
+    sched_resched(cpu);
     cpu_unlock(cpu);
 }
 
+static void tlb_shootdown_irq_handler(struct isr_frame_t* frame)
+{
+    vm_hat_tlb_process(get_cpu());
+}
+
+// idle loop, interrupts off right before hlt
+void cpu_idle()
+{
+    thread_reap_idle();
+    kernel_page_zero_idle();
+    vm_hat_tlb_idle(get_cpu());
+}
+
+// arm local apic timer for whatever the scheduler needs next
+static void cpu_timer_start()
+{
+    local_apic_timer_start(VECTOR_APIC_TIMER);
+
+    struct cpu_desc_t* cpu = cpu_lock_splhi();
+    sched_tick(cpu);
+    cpu_unlock_splx(cpu);
+}
+
 static void lapic_irq_handler(struct isr_frame_t* frame)
 {
     struct cpu_desc_t* cpu = get_cpu();
@@ -213,6 +321,8 @@ static void cpu_init_desc()
     struct cpu_desc_t* cpu = &cpus[apic_id];
     cpu->self = cpu;
     cpu->apic_id = apic_id;
+    cpu->hat = &kernel_hat;
+    tss_load(apic_id);
 
     asm volatile("movl %0,%%fs; movl %0,%%gs" :: "r"(0));
     wrmsr(MSR_GS_BASE, (uintptr_t)cpu);
@@ -224,9 +334,6 @@ void cpu_init_ap()
 {
     fetch_and_add_32(&num_cpus, 1);
 
-    // sync boot pages before tlb shootdown is ready
-    //vm_boot_flush();
-
     gdt_load();
     idt_load();
 
@@ -236,7 +343,14 @@ void cpu_init_ap()
     struct cpu_desc_t* cpu = get_cpu();
     cpu->flags = CPU_FLAGS_ACTIVE;
 
+    // shootdowns include us from here on, drop what was cached before
+    mfence();
+    tlb_flush();
+    vm_hat_init_cpu();
+    fpu_init_cpu();
+
     sched_init_cpu(cpu);
+    cpu_timer_start();
     cpu_enable_interrupts();
 
     asm volatile("int $3");
@@ -257,13 +371,10 @@ static void cpu_smp_init()
     uint32_t bsp_apic_id = local_apic_id();
 
     // issue init IPI to all except self
-    uint8_t cpu_mask = 1 << bsp_apic_id;
     for (uint32_t i = 0; i < local_apic.num_cpus; ++i) {
         uint32_t apic_id = local_apic.cpus[i].apic_id;
-        if (apic_id != bsp_apic_id) {
+        if (apic_id != bsp_apic_id)
             local_apic_ipi_init(apic_id);
-            cpu_mask |= 1 << apic_id;
-        }
     }
 
     // wait 10 ms
@@ -284,8 +395,8 @@ static void cpu_smp_init()
 
     printf("%d cpu(s) online\n", num_cpus);
 
-    // enable timer on all cpus
-    intr_irq_enable(IRQ_TIMER, cpu_mask);
+    // every cpu runs its own local apic timer now
+    intr_irq_disable(IRQ_TIMER);
 
     cpu_wait(10); // no reason whatsoever
 
@@ -304,11 +415,14 @@ void cpu_init()
     struct cpu_desc_t* cpu = get_cpu();
 
     cpu->flags = CPU_FLAGS_ACTIVE | CPU_FLAGS_BSP;
+    cpu_desc_ready = true;
     sched_init_cpu(cpu);
+    slab_enable_magazines();
+    vm_hat_init_cpu();
 
     intr_register_local_irq_handler(0, 0xf0, lapic_irq_handler);
 
-    // setup timer on bsp only for now
+    // pit on bsp only, just long enough to calibrate local apic timer
     intr_register_irq_handler(IRQ_TIMER, timer_irq_handler);
     intr_irq_enable(IRQ_TIMER, 1 << cpu->apic_id);
     cpu_enable_interrupts();
@@ -317,12 +431,28 @@ void cpu_init()
     //local_apic_ipi_self(0xf0);
     local_apic_timer_init();
 
+    intr_register_local_irq_handler(LINT_APIC_TIMER, VECTOR_APIC_TIMER,
+                                    local_timer_irq_handler);
+    intr_register_local_irq_handler(LINT_RESCHED, VECTOR_RESCHED,
+                                    resched_irq_handler);
+    intr_register_local_irq_handler(LINT_TLB_SHOOTDOWN, VECTOR_TLB_SHOOTDOWN,
+                                    tlb_shootdown_irq_handler);
+    cpu_timer_start();
+
     cpu_smp_init();
 }
 
 // TEMP: used during boot only
 void __attribute__((optimize("O0"))) cpu_wait(uint32_t ms)
 {
+    // pit ticks until timer clock is calibrated
+    uint64_t clock = timer_clock();
+    if (clock) {
+        while (timer_clock() - clock < ms)
+            cpu_pause();
+        return;
+    }
+
     struct cpu_desc_t* cpu = get_cpu();
     volatile uint64_t ticks = cpu->ticks;
     while (1) {
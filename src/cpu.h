@@ -1,9 +1,12 @@
 #ifndef KERNEL_CPU_H
 #define KERNEL_CPU_H
 
+#include "cpu_limits.h"
 #include "io.h"
 #include "spinlock.h"
 #include "thread.h"
+#include "sched.h"
+#include "timer.h"
 
 struct isr_frame_t {
     uint64_t r11, r10, r9, r8;
@@ -33,15 +36,22 @@ struct cpu_desc_t {
     struct thread_t* threads;
     struct thread_t* cur_thread;
     struct thread_t idle_thread;
+    struct thread_list_t zombies;   // exited, stack not released yet
+    struct vm_hat_t* hat;       // address space loaded
+    struct thread_t* fpu_owner; // whose fpu section state is loaded
+    struct run_queue_t rq;
+    struct timer_wheel_t timers;
     volatile uint64_t ticks;
     struct spinlock_t lock;
     uint32_t apic_id;
     uint32_t flags;
     uint32_t id_cnt;
+    volatile uint32_t need_resched;
+    volatile uint32_t tlb_lazy;    // halted in idle, skipped by shootdowns
+    struct mcs_cpu_nodes_t mcs;
     int spl;
 };
 
-#define MAX_CPUS 16
 extern struct cpu_desc_t cpus[MAX_CPUS];
 extern uint32_t num_cpus;
 
@@ -107,6 +117,8 @@ void cpu_init(void);
 void cpu_interrupt_set(uint8_t vector, irq_handler_fn handler);
 void cpu_interrupt_unset(uint8_t vector);
 void cpu_wait(uint32_t ms);
+void cpu_idle(void);
+bool cpu_in_interrupt(void);
 void cpu_show_cmd(int argc, const char* argv[]);
 
 #endif // KERNEL_CPU_H
@@ -1,4 +1,6 @@
 #include "cpu_exception.h"
+#include "vm_mmap.h"
+#include "fpu.h"
 #include "stdio.h"
 
 #define EXCEPTION_DIVIDE_BY_ZERO            0x0
@@ -22,15 +24,20 @@
 #define EXCEPTION_VIRTUALIZATION_EXCEPTION  0x14
 #define EXCEPTION_SECURITY_EXCEPTION        0x1E
 
-static void handle_page_fault(struct isr_frame_t* frame)
+// missing pages of mapped areas, filled from their cache. exceptions
+// come in through trap gates, interrupts are as the fault left them
+static bool handle_page_fault(struct isr_frame_t* frame)
 {
-    printf("pf: %016lx\n", get_cr2());
-    cpu_disable_interrupts();
-    cpu_halt();
+    return vm_mmap_fault(&kernel_mmap, get_cr2(), (uint32_t)frame->trap_err);
 }
 
 void cpu_exception(struct isr_frame_t frame)
 {
+    if (frame.trap_num == EXCEPTION_PAGE_FAULT && handle_page_fault(&frame))
+        return;
+    if (frame.trap_num == EXCEPTION_DEVICE_NOT_AVAILABLE && fpu_trap())
+        return;
+
     //if (frame.rflags & RFLAGS_IF)
     //    cpu_enable_interrupts();
 
@@ -43,8 +50,16 @@ void cpu_exception(struct isr_frame_t frame)
     switch (frame.trap_num) {
         case EXCEPTION_BREAKPOINT:
             break;
+        case EXCEPTION_DOUBLE_FAULT:
+            if (thread_stack_fault(get_cr2()))
+                printf("stack overflow: %016lx\n", get_cr2());
+            cpu_disable_interrupts();
+            cpu_halt();
+            break;
         case EXCEPTION_PAGE_FAULT:
-            handle_page_fault(&frame);
+            printf("pf: %016lx\n", get_cr2());
+            cpu_disable_interrupts();
+            cpu_halt();
             break;
         default:
             printf("unhandled\n");
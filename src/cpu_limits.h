@@ -0,0 +1,7 @@
+#ifndef KERNEL_CPU_LIMITS_H
+#define KERNEL_CPU_LIMITS_H
+
+// defines only, boot.S sizes the gdt with it
+#define MAX_CPUS 16
+
+#endif // KERNEL_CPU_LIMITS_H
@@ -0,0 +1,259 @@
+#include "fpu.h"
+#include "kernel.h"
+#include "kmalloc.h"
+#include "cpu.h"
+#include "thread.h"
+#include "semaphore.h"
+#include "stdio.h"
+#include "string.h"
+#include "x86.h"
+
+// kernel fpu sections
+//
+// a thread gets a save area the first time it enters a section and
+// only threads inside one have their registers switched. eager mode
+// saves on the way out and restores on the way in, with xsaveopt
+// that is cheap enough for every switch. otherwise restores are
+// lazy: the thread comes back with cr0.ts set and the first fpu
+// instruction traps (#NM) to load its state. saves always happen on
+// switch out, so a thread never leaves its registers behind on
+// another cpu. a section starts from the init state, nothing is
+// kept from one to the next
+
+static struct {
+    bool xsave;
+    bool xsaveopt;
+    bool eager;
+    uint64_t xcr0;
+    uint32_t size;          // save area, power of two so it stays aligned
+    void* init_state;
+    uint32_t num_saves;
+    uint32_t num_restores;
+    uint32_t num_traps;
+} fpu;
+
+static inline void fpu_save(void* area)
+{
+    uint32_t lo = (uint32_t)fpu.xcr0;
+    uint32_t hi = (uint32_t)(fpu.xcr0 >> 32);
+    if (fpu.xsaveopt)
+        asm volatile("xsaveopt64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else if (fpu.xsave)
+        asm volatile("xsave64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else
+        asm volatile("fxsave64 (%0)" :: "r"(area) : "memory");
+    fpu.num_saves++;
+}
+
+static inline void fpu_restore(void* area)
+{
+    uint32_t lo = (uint32_t)fpu.xcr0;
+    uint32_t hi = (uint32_t)(fpu.xcr0 >> 32);
+    if (fpu.xsave)
+        asm volatile("xrstor64 (%0)" :: "r"(area), "a"(lo), "d"(hi) : "memory");
+    else
+        asm volatile("fxrstor64 (%0)" :: "r"(area) : "memory");
+}
+
+// per cpu, before any section runs there
+void fpu_init_cpu()
+{
+    uint64_t cr0 = get_cr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    set_cr0(cr0);
+
+    uint64_t cr4 = get_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (fpu.xsave)
+        cr4 |= CR4_OSXSAVE;
+    set_cr4(cr4);
+
+    if (fpu.xsave)
+        xsetbv(0, fpu.xcr0);
+    asm volatile("fninit");
+}
+
+void fpu_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    check(edx & CPUID_1_EDX_FXSR);
+    fpu.xsave = (ecx & CPUID_1_ECX_XSAVE) != 0;
+
+    if (fpu.xsave) {
+        cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        uint64_t supported = eax | ((uint64_t)edx << 32);
+        fpu.xcr0 = supported & (XCR0_X87 | XCR0_SSE | XCR0_AVX);
+        cpuid(0xd, 1, &eax, &ebx, &ecx, &edx);
+        fpu.xsaveopt = (eax & CPUID_D_1_EAX_XSAVEOPT) != 0;
+    }
+    fpu.eager = fpu.xsaveopt;
+
+    fpu_init_cpu();
+
+    uint32_t size = 512;
+    if (fpu.xsave) {
+        // for the features just turned on in xcr0
+        cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        size = ebx;
+    }
+    fpu.size = 512;
+    while (fpu.size < size)
+        fpu.size <<= 1;
+
+    // fcw and mxcsr defaults, an all zero xsave header inits the rest
+    fpu.init_state = kmalloc(fpu.size, KMALLOC_ZERO);
+    check(fpu.init_state);
+    *(uint16_t*)fpu.init_state = 0x37f;
+    *(uint32_t*)((uintptr_t)fpu.init_state + 24) = 0x1f80;
+
+    printf("fpu_init(): %s xcr0 %lx area %d %s\n",
+        fpu.xsaveopt ? "xsaveopt" : fpu.xsave ? "xsave" : "fxsave",
+        fpu.xcr0, size, fpu.eager ? "eager" : "lazy");
+}
+
+static struct thread_t* fpu_cur_thread()
+{
+    struct cpu_desc_t* cpu = cpu_lock_splhi();
+    struct thread_t* t = cpu->cur_thread;
+    cpu_unlock_splx(cpu);
+    return t;
+}
+
+// scheduler, cpu locked, right before switching to next
+void fpu_switch(struct cpu_desc_t* cpu, struct thread_t* prev, struct thread_t* next)
+{
+    if (prev->fpu_depth && cpu->fpu_owner == prev) {
+        fpu_save(prev->fpu_state);
+        cpu->fpu_owner = NULL;
+    }
+
+    if (!next->fpu_depth)
+        return;
+
+    if (fpu.eager) {
+        fpu_restore(next->fpu_state);
+        fpu.num_restores++;
+        cpu->fpu_owner = next;
+    } else {
+        stts();
+    }
+}
+
+// #NM, a thread back in its section touched the fpu
+bool fpu_trap()
+{
+    int s = cpu_splhi();
+    struct cpu_desc_t* cpu = get_cpu();
+    struct thread_t* t = cpu->cur_thread;
+    bool ours = t->fpu_depth > 0;
+    if (ours) {
+        clts();
+        fpu_restore(t->fpu_state);
+        cpu->fpu_owner = t;
+        fpu.num_traps++;
+    }
+    cpu_splx(s);
+    return ours;
+}
+
+void kernel_fpu_begin()
+{
+    struct thread_t* t = fpu_cur_thread();
+    if (!t->fpu_state) {
+        t->fpu_state = kmalloc(fpu.size, KMALLOC_ZERO);
+        check(t->fpu_state && !((uintptr_t)t->fpu_state & 63));
+    }
+
+    int s = cpu_splhi();
+    if (!t->fpu_depth++) {
+        clts();
+        fpu_restore(fpu.init_state);
+        get_cpu()->fpu_owner = t;
+    }
+    cpu_splx(s);
+}
+
+void kernel_fpu_end()
+{
+    struct thread_t* t = fpu_cur_thread();
+    check(t->fpu_depth);
+
+    int s = cpu_splhi();
+    if (!--t->fpu_depth) {
+        struct cpu_desc_t* cpu = get_cpu();
+        if (cpu->fpu_owner == t)
+            cpu->fpu_owner = NULL;
+    }
+    cpu_splx(s);
+}
+
+// two threads on this cpu keep values in xmm registers across yields
+
+#define FPU_TEST_THREADS    2
+#define FPU_TEST_ROUNDS     1000
+
+static struct {
+    struct semaphore_t start[FPU_TEST_THREADS];
+    struct semaphore_t done;
+    uint32_t next;
+    uint32_t errors;
+    uint32_t num_threads;
+} fpu_test;
+
+static void fpu_test_thread()
+{
+    uint32_t index = fetch_and_add_32(&fpu_test.next, 1);
+    uint64_t v = 0x0101010101010101UL * (index + 1);
+
+    while (1) {
+        sema_wait(&fpu_test.start[index]);
+
+        kernel_fpu_begin();
+        asm volatile("movq %0, %%xmm0; movq %0, %%xmm7" :: "r"(v));
+        for (uint32_t i = 0; i < FPU_TEST_ROUNDS; ++i) {
+            sched_relinquish();
+            uint64_t a, b;
+            asm volatile("movq %%xmm0, %0; movq %%xmm7, %1" : "=r"(a), "=r"(b));
+            if (a != v || b != v)
+                fetch_and_add_32(&fpu_test.errors, 1);
+        }
+        kernel_fpu_end();
+
+        sema_signal(&fpu_test.done);
+    }
+}
+
+// -t: section switching test
+void fpu_cmd(int argc, const char* argv[])
+{
+    printf("fpu: %s xcr0 %lx area %d saves %d restores %d traps %d\n",
+        fpu.eager ? "eager" : "lazy", fpu.xcr0, fpu.size,
+        fpu.num_saves, fpu.num_restores, fpu.num_traps);
+
+    if (argc < 2 || strcmp(argv[1], "-t"))
+        return;
+
+    // threads left over from a failed try are kept
+    if (!fpu_test.num_threads)
+        sema_init(&fpu_test.done, 0);
+    while (fpu_test.num_threads < FPU_TEST_THREADS) {
+        sema_init(&fpu_test.start[fpu_test.num_threads], 0);
+        struct thread_t* t = thread_create(fpu_test_thread, 0x1000, get_cpu_id());
+        if (!t) {
+            printf("fpu: no memory\n");
+            return;
+        }
+        thread_set_affinity(t, 1U << get_cpu_id());
+        fpu_test.num_threads++;
+    }
+
+    fpu_test.errors = 0;
+    for (uint32_t i = 0; i < FPU_TEST_THREADS; ++i)
+        sema_signal(&fpu_test.start[i]);
+    for (uint32_t i = 0; i < FPU_TEST_THREADS; ++i)
+        sema_wait(&fpu_test.done);
+
+    printf("fpu: %d threads %d rounds, %d errors\n",
+        FPU_TEST_THREADS, FPU_TEST_ROUNDS, fpu_test.errors);
+}
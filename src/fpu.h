@@ -0,0 +1,23 @@
+#ifndef KERNEL_FPU_H
+#define KERNEL_FPU_H
+
+#include "types.h"
+
+struct cpu_desc_t;
+struct thread_t;
+
+// fpu/simd registers are off limits to kernel code (it is built with
+// -mno-sse) except between kernel_fpu_begin and kernel_fpu_end. those
+// sections may sleep and be preempted, not run from interrupt handlers
+
+void fpu_init(void);
+void fpu_init_cpu(void);
+void fpu_switch(struct cpu_desc_t* cpu, struct thread_t* prev, struct thread_t* next);
+bool fpu_trap(void);
+
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+void fpu_cmd(int argc, const char* argv[]);
+
+#endif // KERNEL_FPU_H
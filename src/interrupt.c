@@ -4,6 +4,7 @@
 #include "local_apic.h"
 #include "spinlock.h"
 #include "stdio.h"
+#include "vm_hat.h"
 
 #define IRQ_BASE        0x40
 
@@ -85,8 +86,24 @@ void intr_init()
 {
 }
 
+// a cpu halted in idle may have skipped shootdowns
+static inline void intr_enter()
+{
+    struct cpu_desc_t* cpu = get_cpu();
+    cpu->cur_thread->intr_depth++;
+    if (cpu->tlb_lazy)
+        vm_hat_tlb_wake(cpu);
+}
+
+// possibly on another cpu, the thread is the same
+static inline void intr_exit()
+{
+    get_cpu()->cur_thread->intr_depth--;
+}
+
 void cpu_interrupt(struct isr_frame_t frame)
 {
+    intr_enter();
     local_apic_eoi();
     // TODO: consider enabling irqs here
     //          and letting each handler guard its critical paths
@@ -94,14 +111,17 @@ void cpu_interrupt(struct isr_frame_t frame)
     uint32_t irq_num = (uint32_t)frame.trap_num;
     if (irq_handlers[irq_num].handler)
         irq_handlers[irq_num].handler(&frame);
+    intr_exit();
 }
 
 void cpu_local_interrupt(struct isr_frame_t frame)
 {
+    intr_enter();
     local_apic_eoi();
     uint32_t irq_num = (uint32_t)frame.trap_num;
     if (lint_handlers[irq_num].handler)
         lint_handlers[irq_num].handler(&frame);
+    intr_exit();
 }
 
 void intr_register_irq_handler(uint8_t irq, interrupt_handler_fn handler)
@@ -6,6 +6,15 @@
 #define IRQ_TIMER       0x00
 #define IRQ_KEYBOARD    0x01
 
+// local interrupts: lint stub, vector
+#define LINT_APIC_TIMER     0x01
+#define LINT_RESCHED        0x02
+#define LINT_TLB_SHOOTDOWN  0x03
+
+#define VECTOR_APIC_TIMER   0xe0
+#define VECTOR_RESCHED      0xe1
+#define VECTOR_TLB_SHOOTDOWN 0xe2
+
 struct isr_frame_t;
 typedef void (*interrupt_handler_fn)(struct isr_frame_t* frame);
 
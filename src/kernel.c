@@ -3,6 +3,10 @@
 #include "cpu.h"
 #include "vm_boot.h"
 #include "vm_page.h"
+#include "vm_buddy.h"
+#include "thread.h"
+#include "semaphore.h"
+#include "vm_reclaim.h"
 
 void kernel_panic(const char* msg)
 {
@@ -41,3 +45,293 @@ uintptr_t kernel_slack_alloc(uint64_t size, uint64_t align)
 
     return KERNEL_VADDR(slack);
 }
+
+// mapped 2M pages for the kernel heap
+//
+// a small reserve sits between the heap and the page db, callers
+// (slab lists, often at splhi) pop from it and a refill thread
+// tops it back up to the high watermark, page db work and mapping
+// stays out of interrupt context unless the reserve runs dry
+
+#define KERNEL_PAGE_RESERVE_LOW     2
+#define KERNEL_PAGE_RESERVE_HIGH    4
+
+static struct {
+    uintptr_t pages[KERNEL_PAGE_RESERVE_HIGH];
+    uint32_t num_pages;
+    uint32_t refill_pending;
+    uint32_t num_sync;      // had to go to page db directly
+    bool started;
+    struct spinlock_t lock;
+    struct semaphore_t refill;
+} page_reserve;
+
+// direct map is never torn down, so a page is mapped once
+// and keeps its window across alloc/free
+static uintptr_t kernel_page_map()
+{
+    uintptr_t paddr = page_db_alloc_addr(page_db);
+    vm_reclaim_check();
+    if (!paddr)
+        return 0;
+
+    uintptr_t vaddr = PHYS_VADDR(paddr);
+    struct page_desc_t* page = page_db_desc(page_db, page_db_addr2index(page_db, paddr));
+    if (page->vaddr != vaddr) {
+        vm_boot_map_range(vaddr, paddr, PAGE_2M_SIZE);
+        page->vaddr = vaddr;
+    }
+
+    return vaddr;
+}
+
+// back to page db, the window stays mapped for the next user
+static void kernel_page_release(uintptr_t vaddr)
+{
+    page_db_free_addr(page_db, VADDR_PHYS(vaddr));
+}
+
+static void kernel_page_refill()
+{
+    while (1) {
+        sema_wait(&page_reserve.refill);
+
+        // pending is cleared under the lock that sees the reserve full,
+        // allocations after that signal again, ones before it are
+        // covered by the next look
+        while (1) {
+            int s = spinlock_lock_splhi(&page_reserve.lock);
+            bool full = page_reserve.num_pages >= KERNEL_PAGE_RESERVE_HIGH;
+            if (full)
+                page_reserve.refill_pending = 0;
+            spinlock_unlock_splx(&page_reserve.lock, s);
+            if (full)
+                break;
+
+            uintptr_t vaddr = kernel_page_map();
+            if (!vaddr) {
+                s = spinlock_lock_splhi(&page_reserve.lock);
+                page_reserve.refill_pending = 0;
+                spinlock_unlock_splx(&page_reserve.lock, s);
+                break;
+            }
+
+            s = spinlock_lock_splhi(&page_reserve.lock);
+            if (page_reserve.num_pages < KERNEL_PAGE_RESERVE_HIGH) {
+                page_reserve.pages[page_reserve.num_pages++] = vaddr;
+                vaddr = 0;
+            }
+            spinlock_unlock_splx(&page_reserve.lock, s);
+
+            if (vaddr)
+                kernel_page_release(vaddr);
+        }
+    }
+}
+
+uintptr_t kernel_page_alloc()
+{
+    uintptr_t vaddr = 0;
+    bool refill = false;
+
+    int s = spinlock_lock_splhi(&page_reserve.lock);
+    if (page_reserve.num_pages > 0)
+        vaddr = page_reserve.pages[--page_reserve.num_pages];
+
+    if (page_reserve.started
+            && page_reserve.num_pages < KERNEL_PAGE_RESERVE_LOW
+            && !page_reserve.refill_pending) {
+        page_reserve.refill_pending = 1;
+        refill = true;
+    }
+    spinlock_unlock_splx(&page_reserve.lock, s);
+
+    if (refill)
+        sema_signal(&page_reserve.refill);
+
+    // interrupt handlers get nothing rather than doing page db
+    // work and mapping, the refill thread catches up
+    if (!vaddr && !cpu_in_interrupt()) {
+        fetch_and_add_32(&page_reserve.num_sync, 1);
+        vaddr = kernel_page_map();
+    }
+
+    return vaddr;
+}
+
+void kernel_page_free(uintptr_t vaddr)
+{
+    int s = spinlock_lock_splhi(&page_reserve.lock);
+    if (page_reserve.num_pages < KERNEL_PAGE_RESERVE_HIGH) {
+        page_reserve.pages[page_reserve.num_pages++] = vaddr;
+        vaddr = 0;
+    }
+    spinlock_unlock_splx(&page_reserve.lock, s);
+
+    if (vaddr)
+        kernel_page_release(vaddr);
+}
+
+// physically contiguous run, bypasses the reserve
+uintptr_t kernel_pages_alloc(uint32_t num_pages)
+{
+    if (num_pages == 1)
+        return kernel_page_alloc();
+
+    uint32_t index = page_db_alloc_range(page_db, num_pages, 1);
+    if (!index)
+        return 0;
+
+    uintptr_t paddr = page_db_index2addr(page_db, index);
+    uintptr_t vaddr = PHYS_VADDR(paddr);
+    vm_boot_map_range(vaddr, paddr, (uint64_t)num_pages << PAGE_2M_SHIFT);
+    for (uint32_t i = 0; i < num_pages; ++i)
+        page_db_desc(page_db, index + i)->vaddr = vaddr + ((uintptr_t)i << PAGE_2M_SHIFT);
+
+    return vaddr;
+}
+
+void kernel_pages_free(uintptr_t vaddr, uint32_t num_pages)
+{
+    if (num_pages == 1) {
+        kernel_page_free(vaddr);
+        return;
+    }
+
+    uint32_t index = page_db_addr2index(page_db, VADDR_PHYS(vaddr));
+    page_db_free_range(page_db, index, num_pages);
+}
+
+// pre-zeroed pages
+//
+// idle cpus keep small pools of zeroed 2M pages and 4K buddy blocks
+// topped up, clearing them with non-temporal stores so whatever runs
+// next still finds its data cached. allocations that want zeroed
+// memory take from the pools and only clear a page themselves when
+// they are empty. the last few free page db pages are left alone
+
+#define KERNEL_ZERO_POOL_2M     4
+#define KERNEL_ZERO_POOL_4K     64
+#define KERNEL_ZERO_MIN_FREE    16
+
+static struct {
+    uintptr_t pages_2m[KERNEL_ZERO_POOL_2M];
+    uintptr_t pages_4k[KERNEL_ZERO_POOL_4K];
+    volatile uint32_t num_2m;
+    volatile uint32_t num_4k;
+    uint32_t num_hits;
+    uint32_t num_misses;
+    uint32_t num_zeroed;
+    bool started;
+    struct spinlock_t lock;
+} page_zero;
+
+uintptr_t kernel_page_alloc_zero()
+{
+    uintptr_t vaddr = 0;
+    int s = spinlock_lock_splhi(&page_zero.lock);
+    if (page_zero.num_2m > 0)
+        vaddr = page_zero.pages_2m[--page_zero.num_2m];
+    spinlock_unlock_splx(&page_zero.lock, s);
+
+    if (vaddr) {
+        fetch_and_add_32(&page_zero.num_hits, 1);
+        return vaddr;
+    }
+
+    fetch_and_add_32(&page_zero.num_misses, 1);
+    vaddr = kernel_page_alloc();
+    if (vaddr)
+        zero_page_2m(vaddr);
+    return vaddr;
+}
+
+uintptr_t kernel_page_alloc_zero_4k()
+{
+    uintptr_t vaddr = 0;
+    int s = spinlock_lock_splhi(&page_zero.lock);
+    if (page_zero.num_4k > 0)
+        vaddr = page_zero.pages_4k[--page_zero.num_4k];
+    spinlock_unlock_splx(&page_zero.lock, s);
+
+    if (vaddr) {
+        fetch_and_add_32(&page_zero.num_hits, 1);
+        return vaddr;
+    }
+
+    fetch_and_add_32(&page_zero.num_misses, 1);
+    vaddr = buddy_alloc(0);
+    if (vaddr)
+        zero_page_4k(vaddr);
+    return vaddr;
+}
+
+// from the idle loop with interrupts off, they are back on while a
+// page is cleared, whatever wakes up preempts us there
+void kernel_page_zero_idle()
+{
+    if (!page_zero.started)
+        return;
+
+    while (page_zero.num_2m < KERNEL_ZERO_POOL_2M || page_zero.num_4k < KERNEL_ZERO_POOL_4K) {
+        if (page_db->num_free <= KERNEL_ZERO_MIN_FREE)
+            return;
+
+        bool big = page_zero.num_2m < KERNEL_ZERO_POOL_2M;
+        uintptr_t vaddr = big ? kernel_page_map() : buddy_alloc(0);
+        if (!vaddr)
+            return;
+
+        cpu_enable_interrupts();
+        if (big)
+            zero_page_2m_nt(vaddr);
+        else
+            zero_page_4k_nt(vaddr);
+        cpu_disable_interrupts();
+
+        spinlock_lock(&page_zero.lock);
+        if (big && page_zero.num_2m < KERNEL_ZERO_POOL_2M) {
+            page_zero.pages_2m[page_zero.num_2m++] = vaddr;
+            vaddr = 0;
+        } else if (!big && page_zero.num_4k < KERNEL_ZERO_POOL_4K) {
+            page_zero.pages_4k[page_zero.num_4k++] = vaddr;
+            vaddr = 0;
+        }
+        page_zero.num_zeroed++;
+        spinlock_unlock(&page_zero.lock);
+
+        // another idle cpu filled it first
+        if (vaddr && big)
+            kernel_page_release(vaddr);
+        else if (vaddr)
+            buddy_free(vaddr);
+    }
+}
+
+void kernel_page_dump()
+{
+    printf("reserve: %d pages, %d sync\n", page_reserve.num_pages, page_reserve.num_sync);
+    printf("zero: %d 2M %d 4K, %d hits %d misses %d zeroed\n",
+        page_zero.num_2m, page_zero.num_4k,
+        page_zero.num_hits, page_zero.num_misses, page_zero.num_zeroed);
+}
+
+// needs page db synced with boot mappings and the scheduler up
+void kernel_page_reserve_start()
+{
+    sema_init(&page_reserve.refill, 0);
+
+    while (page_reserve.num_pages < KERNEL_PAGE_RESERVE_HIGH) {
+        uintptr_t vaddr = kernel_page_map();
+        if (!vaddr)
+            break;
+        page_reserve.pages[page_reserve.num_pages++] = vaddr;
+    }
+
+    struct thread_t* t = thread_create(kernel_page_refill, 0x1000, get_cpu_id());
+    check(t);
+    page_reserve.started = true;
+    page_zero.started = true;
+
+    printf("kernel_page_reserve_start(): %d pages\n", page_reserve.num_pages);
+}
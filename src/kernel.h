@@ -11,6 +11,17 @@
 #define KERNEL_BASE         (0xFFFFFFFF80000000)
 #define KERNEL_VADDR(x)     ((uintptr_t)(x)|KERNEL_BASE)
 
+// physical memory window, filled in on demand by kernel_page_alloc
+#define KERNEL_PHYS_BASE    (0xFFFF800000000000)
+#define PHYS_VADDR(x)       ((uintptr_t)(x)+KERNEL_PHYS_BASE)
+#define VADDR_PHYS(x)       ((uintptr_t)(x)-KERNEL_PHYS_BASE)
+
+// physical address of kernel heap memory, either window
+static inline uintptr_t kernel_vaddr_phys(uintptr_t vaddr)
+{
+    return vaddr >= KERNEL_BASE ? vaddr - KERNEL_BASE : VADDR_PHYS(vaddr);
+}
+
 struct boot_info_mmap_t {
     uint64_t addr;
     uint64_t size;
@@ -55,5 +66,14 @@ void kernel_panic(const char* msg);
 
 void kernel_init(void);
 uintptr_t kernel_slack_alloc(uint64_t size, uint64_t align);
+uintptr_t kernel_page_alloc(void);
+void kernel_page_free(uintptr_t vaddr);
+uintptr_t kernel_pages_alloc(uint32_t num_pages);
+void kernel_pages_free(uintptr_t vaddr, uint32_t num_pages);
+void kernel_page_reserve_start(void);
+uintptr_t kernel_page_alloc_zero(void);
+uintptr_t kernel_page_alloc_zero_4k(void);
+void kernel_page_zero_idle(void);
+void kernel_page_dump(void);
 
 #endif // KERNEL_KERNEL_H
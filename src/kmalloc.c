@@ -2,6 +2,9 @@
 #include "vm_page.h"
 #include "spinlock.h"
 #include "stdio.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "vm_buddy.h"
 
 // 16, 32, 64, 128, 256, 512
 //  4,  5,  6,   7,   8,   9
@@ -11,12 +14,92 @@
 
 static struct spinlock_t sl_lock;
 static struct slab_list_t sl_root;
+static struct slab_list_t sl_mag;
 static struct slab_list_t sl_table[MAX_SL_TABLE];
 
+// kmalloc size classes
+//
+// 8 byte steps up to 64, then quarter power of two steps
+// (80, 96, 112, 128, 160, ...) up to 128K, buddy blocks up
+// to 1M, anything bigger takes whole 2M pages. classes up to
+// 1K are carved from 16K chunks of sl_root, the rest from
+// their own 2M slabs
+
+#define KMALLOC_NUM_SMALL   8
+#define KMALLOC_MIN_SHIFT   6
+#define KMALLOC_MAX_SHIFT   17
+#define KMALLOC_NUM_CLASSES \
+    (KMALLOC_NUM_SMALL + (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT) * 4)
+#define KMALLOC_MAX_SLAB    (1UL << KMALLOC_MAX_SHIFT)
+#define KMALLOC_MAX_NESTED  1024
+
+struct kmalloc_stat_t {
+    uint64_t num_allocs;
+    uint64_t num_frees;
+    uint64_t req_bytes;     // total requested, against class size * allocs
+};
+
+static struct slab_list_t kmalloc_classes[KMALLOC_NUM_CLASSES];
+
+// one row per cpu, updated at splhi, summed on dump
+static struct kmalloc_stat_t kmalloc_stats[MAX_CPUS][KMALLOC_NUM_CLASSES + 1];
+#define KMALLOC_STAT_LARGE  KMALLOC_NUM_CLASSES
+
+static inline uint32_t kmalloc_class(size_t size)
+{
+    if (size <= 64)
+        return size ? (uint32_t)((size - 1) >> 3) : 0;
+
+    uint32_t shift = 63 - __builtin_clzl(size - 1);
+    uint32_t step = (uint32_t)((size - 1) >> (shift - 2));
+    return KMALLOC_NUM_SMALL + (shift - KMALLOC_MIN_SHIFT) * 4 + (step - 4);
+}
+
+static inline uint32_t kmalloc_class_size(uint32_t index)
+{
+    if (index < KMALLOC_NUM_SMALL)
+        return (index + 1) << 3;
+
+    index -= KMALLOC_NUM_SMALL;
+    uint32_t shift = KMALLOC_MIN_SHIFT + (index >> 2);
+    return (5 + (index & 3)) << (shift - 2);
+}
+
+static void kmalloc_init_classes()
+{
+    for (uint32_t i = 0; i < KMALLOC_NUM_CLASSES; ++i) {
+        struct slab_list_t* sl = &kmalloc_classes[i];
+        uint32_t size = kmalloc_class_size(i);
+        // big objects would pin too much memory in magazines
+        if (size <= KMALLOC_MAX_NESTED) {
+            slab_list_init(sl, &sl_root, KMALLOC_CHUNK_SIZE, size);
+            slab_list_set_magazines(sl, &sl_mag);
+        } else {
+            slab_list_init(sl, NULL, PAGE_2M_SIZE, size);
+        }
+    }
+}
+
+// size 0 counts a free
+static inline void kmalloc_stat(uint32_t index, size_t size)
+{
+    int s = cpu_splhi();
+    struct kmalloc_stat_t* st = &kmalloc_stats[get_cpu_id()][index];
+    if (size) {
+        st->num_allocs++;
+        st->req_bytes += size;
+    } else {
+        st->num_frees++;
+    }
+    cpu_splx(s);
+}
+
 void kmalloc_init()
 {
     slab_list_init(&sl_root, NULL, PAGE_2M_SIZE, KMALLOC_CHUNK_SIZE);
     slab_list_reserve_on_slack(&sl_root);
+    slab_list_init(&sl_mag, &sl_root, KMALLOC_CHUNK_SIZE, sizeof(struct slab_mag_t));
+    kmalloc_init_classes();
 }
 
 void* kmalloc_alloc()
@@ -43,10 +126,158 @@ struct slab_list_t* kmalloc_get_slab(uint32_t elem_size)
 
     spinlock_lock(&sl_lock);
     struct slab_list_t* sl = &sl_table[index];
-    if (!sl->sl_owner)
+    if (!sl->sl_owner) {
         slab_list_init(sl, &sl_root, KMALLOC_CHUNK_SIZE, 1 << elem_shift);
+        slab_list_set_magazines(sl, &sl_mag);
+    }
     
     spinlock_unlock(&sl_lock);
     return sl;
 }
 
+
+static inline struct page_desc_t* kmalloc_page_desc(void* ptr)
+{
+    uintptr_t paddr = kernel_vaddr_phys((uintptr_t)ptr);
+    return page_db_desc(page_db, page_db_addr2index(page_db, paddr));
+}
+
+static void* kmalloc_large(size_t size, uint32_t flags)
+{
+    uint32_t num_pages = (uint32_t)PAGE_2M_NUM(size);
+    bool zeroed = num_pages == 1 && (flags & KMALLOC_ZERO);
+    uintptr_t vaddr = zeroed ? kernel_page_alloc_zero() : kernel_pages_alloc(num_pages);
+    if (!vaddr)
+        return NULL;
+
+    struct page_desc_t* desc = kmalloc_page_desc((void*)vaddr);
+    desc->flags |= PGF_KMEM_LARGE;
+    desc->num_pages = num_pages;
+
+    if ((flags & KMALLOC_ZERO) && !zeroed) {
+        for (uint32_t i = 0; i < num_pages; ++i)
+            zero_page_2m(vaddr + ((uintptr_t)i << PAGE_2M_SHIFT));
+    }
+
+    kmalloc_stat(KMALLOC_STAT_LARGE, size);
+    return (void*)vaddr;
+}
+
+void* kmalloc(size_t size, uint32_t flags)
+{
+    if (size > KMALLOC_MAX_SLAB) {
+        uint32_t order = buddy_order(size);
+        if (order > BUDDY_MAX_ORDER)
+            return kmalloc_large(size, flags);
+
+        uintptr_t vaddr = buddy_alloc(order);
+        if (vaddr && (flags & KMALLOC_ZERO)) {
+            for (uint32_t i = 0; i < (1U << order); ++i)
+                zero_page_4k(vaddr + ((uintptr_t)i << PAGE_4K_SHIFT));
+        }
+        if (vaddr)
+            kmalloc_stat(KMALLOC_STAT_LARGE, size);
+        return (void*)vaddr;
+    }
+
+    uint32_t index = kmalloc_class(size);
+    struct slab_list_t* sl = &kmalloc_classes[index];
+    void* ptr = slab_list_alloc(sl);
+    if (!ptr)
+        return NULL;
+
+    if (flags & KMALLOC_ZERO) {
+        uint64_t* p = (uint64_t*)ptr;
+        uint32_t n = sl->chunk_size / 8;
+        while (n--)
+            *p++ = 0UL;
+    }
+
+    kmalloc_stat(index, size ? size : 1);
+    return ptr;
+}
+
+// usable size, from the page descriptor and slab header
+size_t kmalloc_size(void* ptr)
+{
+    struct page_desc_t* desc = kmalloc_page_desc(ptr);
+    if (desc->flags & PGF_KMEM_LARGE)
+        return desc->num_pages << PAGE_2M_SHIFT;
+    if (desc->flags & PGF_KMEM_BUDDY)
+        return buddy_size((uintptr_t)ptr);
+
+    struct slab_list_t* sl = slab_list_find(ptr);
+    return sl ? sl->chunk_size : 0;
+}
+
+void kfree(void* ptr)
+{
+    if (!ptr)
+        return;
+
+    struct page_desc_t* desc = kmalloc_page_desc(ptr);
+    if (desc->flags & PGF_KMEM_LARGE) {
+        uint32_t num_pages = (uint32_t)desc->num_pages;
+        desc->flags &= ~PGF_KMEM_LARGE;
+        desc->num_pages = 0;
+        kmalloc_stat(KMALLOC_STAT_LARGE, 0);
+        kernel_pages_free((uintptr_t)ptr, num_pages);
+        return;
+    }
+
+    if (desc->flags & PGF_KMEM_BUDDY) {
+        kmalloc_stat(KMALLOC_STAT_LARGE, 0);
+        buddy_free((uintptr_t)ptr);
+        return;
+    }
+
+    struct slab_list_t* sl = slab_list_find(ptr);
+    check(sl >= kmalloc_classes && sl < kmalloc_classes + KMALLOC_NUM_CLASSES);
+
+    kmalloc_stat((uint32_t)(sl - kmalloc_classes), 0);
+    slab_list_free(sl, ptr);
+}
+
+static void kmalloc_sum_stat(uint32_t index, struct kmalloc_stat_t* sum)
+{
+    sum->num_allocs = 0;
+    sum->num_frees = 0;
+    sum->req_bytes = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        struct kmalloc_stat_t* st = &kmalloc_stats[i][index];
+        sum->num_allocs += st->num_allocs;
+        sum->num_frees += st->num_frees;
+        sum->req_bytes += st->req_bytes;
+    }
+}
+
+// internal fragmentation, share of handed out bytes nobody asked for
+static uint32_t kmalloc_waste(struct kmalloc_stat_t* st, uint64_t granted)
+{
+    return granted > st->req_bytes
+        ? (uint32_t)((granted - st->req_bytes) * 100 / granted)
+        : 0;
+}
+
+void kmalloc_dump_cmd(int argc, const char* argv[])
+{
+    printf("  class    live   allocs waste\n");
+    for (uint32_t i = 0; i < KMALLOC_NUM_CLASSES; ++i) {
+        struct kmalloc_stat_t st;
+        kmalloc_sum_stat(i, &st);
+        if (!st.num_allocs)
+            continue;
+
+        uint32_t size = kmalloc_classes[i].chunk_size;
+        printf("%7d %7ld %8ld %4d%%\n", size,
+            st.num_allocs - st.num_frees, st.num_allocs,
+            kmalloc_waste(&st, st.num_allocs * size));
+    }
+
+    struct kmalloc_stat_t st;
+    kmalloc_sum_stat(KMALLOC_STAT_LARGE, &st);
+    if (st.num_allocs) {
+        printf("  large %7ld %8ld\n",
+            st.num_allocs - st.num_frees, st.num_allocs);
+    }
+}
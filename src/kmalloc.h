@@ -5,9 +5,17 @@
 
 #define KMALLOC_CHUNK_SIZE  0x4000
 
+// kmalloc flags
+#define KMALLOC_ZERO        0x1
+
 void kmalloc_init(void);
 void* kmalloc_alloc(void);
 void kmalloc_free(void* ptr);
 struct slab_list_t* kmalloc_get_slab(uint32_t elem_size);
 
+void* kmalloc(size_t size, uint32_t flags);
+void kfree(void* ptr);
+size_t kmalloc_size(void* ptr);
+void kmalloc_dump_cmd(int argc, const char* argv[]);
+
 #endif // KERNEL_KMALLOC_H
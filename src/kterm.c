@@ -10,7 +10,16 @@
 #include "local_apic.h"
 #include "imps.h"
 #include "vm_boot.h"
+#include "vm_hat.h"
 #include "vm_page.h"
+#include "vm_buddy.h"
+#include "vm_cache.h"
+#include "vm_mmap.h"
+#include "vm_reclaim.h"
+#include "lock_bench.h"
+#include "mem_bench.h"
+#include "fpu.h"
+#include "kmalloc.h"
 
 typedef void (*kterm_cmd_fn)(int argc, const char* argv[]);
 
@@ -99,7 +108,10 @@ static void ipi_test_cmd(int argc, const char* argv[])
 
 static void vm_boot_dump_cmd(int argc, const char* argv[])
 {
-    vm_boot_dump();
+    if (argc > 1 && !strcmp(argv[1], "-h"))
+        vm_hat_dump(&kernel_hat);
+    else
+        vm_boot_dump();
 }
 
 static void vm_page_dump_cmd(int argc, const char* argv[])
@@ -109,6 +121,16 @@ static void vm_page_dump_cmd(int argc, const char* argv[])
             page_db_dump_ranges(page_db);
         else if (!strcmp(argv[1], "-f"))
             page_db_dump_free_list(page_db);
+        else if (!strcmp(argv[1], "-b"))
+            buddy_dump();
+        else if (!strcmp(argv[1], "-h"))
+            page_hash_dump();
+        else if (!strcmp(argv[1], "-l"))
+            vm_reclaim_dump();
+        else if (!strcmp(argv[1], "-a"))
+            page_cache_ra_dump();
+        else if (!strcmp(argv[1], "-z"))
+            kernel_page_dump();
     }
 }
 
@@ -135,8 +157,15 @@ void kterm_start()
     kterm_add_cmd("vm_boot", vm_boot_dump_cmd);
     kterm_add_cmd("vm_page", vm_page_dump_cmd);
     kterm_add_cmd("fb_info", fb_info_cmd);
-
-    thread_create(kterm_run, 0x4000, 1);
+    kterm_add_cmd("lockbench", lock_bench_cmd);
+    kterm_add_cmd("membench", mem_bench_cmd);
+    kterm_add_cmd("fpu", fpu_cmd);
+    kterm_add_cmd("thread", thread_cmd);
+    kterm_add_cmd("kmalloc", kmalloc_dump_cmd);
+    kterm_add_cmd("mmap", vm_mmap_cmd);
+
+    struct thread_t* t = thread_create(kterm_run, 0x4000, 1);
+    check(t);
 }
 
 #define MAX_CMD_LINE    256
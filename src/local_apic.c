@@ -2,6 +2,7 @@
 #include "kernel.h"
 #include "cpu.h"
 #include "vm_boot.h"
+#include "timer.h"
 #include "stdio.h"
 
 #define LAPIC_ID                    0x0020  // (rw) local apic id
@@ -209,24 +210,86 @@ void local_apic_init()
     //local_apic_lvt_enable(LAPIC_LVT_ERROR, 0xf2);
 }
 
+// calibrate timer and tsc against the boot clock, BSP only
 void local_apic_timer_init()
 {
-    // measure time using perf counter
     int spl = cpu_splhi();
     local_apic_write(LAPIC_TIMER_DIVIDE_CONFIG, TIMER_DIVIER_CONF_16);
     local_apic_write(LAPIC_LVT_TIMER, LVT_TIMER_ONE_SHOT | LVT_INTERRUPT_OFF);
     local_apic_write(LAPIC_TIMER_INITIAL_COUNT, 0xffffffff);
+    uint64_t tsc = rdtsc();
     cpu_splx(spl);
 
     cpu_wait(64);
 
     spl = cpu_splhi();
     uint32_t count = local_apic_read(LAPIC_TIMER_CURRENT_COUNT);
+    tsc = rdtsc() - tsc;
+    local_apic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
     cpu_splx(spl);
 
     uint32_t ticks = 0xffffffff - count;
+    local_apic.timer_ticks_per_ms = ticks / 64;
+    local_apic.tsc_ticks_per_ms = tsc / 64;
 
-    printf("apic_timer: %u ticks\n", (ticks*16)/64);
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (ecx & CPUID_1_ECX_TSC_DEADLINE)
+        local_apic.flags |= LOCAL_APIC_TSC_DEADLINE;
+
+    printf("apic_timer: %u ticks/ms, tsc: %lu ticks/ms%s\n",
+            local_apic.timer_ticks_per_ms, local_apic.tsc_ticks_per_ms,
+            (local_apic.flags & LOCAL_APIC_TSC_DEADLINE) ? " (deadline)" : "");
+
+    timer_clock_init(local_apic.tsc_ticks_per_ms);
+}
+
+// one shot (or tsc deadline) timer on this cpu, disarmed
+void local_apic_timer_start(uint32_t vector)
+{
+    int spl = cpu_splhi();
+    if (local_apic.flags & LOCAL_APIC_TSC_DEADLINE) {
+        local_apic_write(LAPIC_LVT_TIMER, (vector & LVT_VECTOR_MASK)
+                         | LVT_TIMER_TSC_DEADLINE | LVT_INTERRUPT_ON);
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    } else {
+        local_apic_write(LAPIC_TIMER_DIVIDE_CONFIG, TIMER_DIVIER_CONF_16);
+        local_apic_write(LAPIC_LVT_TIMER, (vector & LVT_VECTOR_MASK)
+                         | LVT_TIMER_ONE_SHOT | LVT_INTERRUPT_ON);
+        local_apic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
+    }
+    cpu_splx(spl);
+}
+
+// fire once at tsc, at splhi
+void local_apic_timer_arm(uint64_t tsc)
+{
+    if (local_apic.flags & LOCAL_APIC_TSC_DEADLINE) {
+        wrmsr(MSR_TSC_DEADLINE, tsc);
+        return;
+    }
+
+    // too far out is capped, we'll just get an early interrupt
+    uint64_t now = rdtsc();
+    uint64_t delta = tsc > now ? tsc - now : 0;
+    uint64_t max_delta = (0xffffffffUL / local_apic.timer_ticks_per_ms)
+                       * local_apic.tsc_ticks_per_ms;
+    uint64_t count = delta < max_delta
+                   ? (delta * local_apic.timer_ticks_per_ms) / local_apic.tsc_ticks_per_ms
+                   : 0xffffffffUL;
+    if (!count)
+        count = 1;
+
+    local_apic_write(LAPIC_TIMER_INITIAL_COUNT, (uint32_t)count);
+}
+
+// at splhi
+void local_apic_timer_stop()
+{
+    if (local_apic.flags & LOCAL_APIC_TSC_DEADLINE)
+        wrmsr(MSR_TSC_DEADLINE, 0);
+    else
+        local_apic_write(LAPIC_TIMER_INITIAL_COUNT, 0);
 }
 
 uint32_t local_apic_id()
@@ -275,6 +338,20 @@ void local_apic_ipi_start(uint32_t apic_id)
     cpu_splx(spl);
 }
 
+void local_apic_ipi(uint32_t apic_id, uint32_t vector)
+{
+    int spl = cpu_splhi();
+
+    local_apic_write(LAPIC_ICRHI, apic_id << ICR_DESTINATION_SHIFT);
+    local_apic_write(LAPIC_ICRLO, (vector & ICR_VECTOR_MASK)
+                        | ICR_FIXED | ICR_PHYSICAL | ICR_ASSERT | ICR_EDGE | ICR_NO_SHORTHAND);
+
+    while (local_apic_read(LAPIC_ICRLO) & ICR_SEND_PENDING)
+    {}
+
+    cpu_splx(spl);
+}
+
 static void local_apic_ipi_shorthand(uint32_t vector, uint32_t shorthand)
 {
     int spl = cpu_splhi();
@@ -8,9 +8,14 @@ struct local_apic_cpu_t {
     uint8_t flags;
 };
 
+#define LOCAL_APIC_TSC_DEADLINE     0x01
+
 struct local_apic_t {
     uint8_t* local_apic_addr;
     uint32_t num_cpus;
+    uint32_t flags;
+    uint32_t timer_ticks_per_ms;
+    uint64_t tsc_ticks_per_ms;
     struct local_apic_cpu_t cpus[MAX_CPUS];
 };
 
@@ -20,10 +25,14 @@ void local_apic_register(uintptr_t addr);
 void local_apic_add_cpu(uint8_t apic_id);
 void local_apic_init(void);
 void local_apic_timer_init(void);
+void local_apic_timer_start(uint32_t vector);
+void local_apic_timer_arm(uint64_t tsc);
+void local_apic_timer_stop(void);
 uint32_t local_apic_id(void);
 void local_apic_eoi(void);
 void local_apic_ipi_init(uint32_t apic_id);
 void local_apic_ipi_start(uint32_t apic_id);
+void local_apic_ipi(uint32_t apic_id, uint32_t vector);
 void local_apic_ipi_self(uint32_t vector);
 void local_apic_ipi_broadcast(uint32_t vector);
 void local_apic_ipi_all(uint32_t vector);
@@ -0,0 +1,192 @@
+#include "lock_bench.h"
+#include "kernel.h"
+#include "stdio.h"
+#include "string.h"
+#include "cpu.h"
+#include "thread.h"
+#include "semaphore.h"
+#include "spinlock.h"
+#include "local_apic.h"
+
+// lock throughput microbenchmark
+//
+// one worker thread pinned to every cpu, the first n of them
+// hammer a shared lock for LOCK_BENCH_MS and count how many
+// critical sections they get through
+
+#define LOCK_BENCH_MS       100
+#define LOCK_BENCH_DELAY    10
+
+enum {
+    LOCK_BENCH_TAS,
+    LOCK_BENCH_TICKET,
+    LOCK_BENCH_MCS,
+    LOCK_BENCH_NUM
+};
+
+static const char* lock_bench_names[LOCK_BENCH_NUM] = {
+    "tas", "ticket", "mcs"
+};
+
+struct lock_bench_worker_t {
+    struct semaphore_t start;
+    uint64_t ops;
+} __attribute__((aligned(64)));
+
+struct lock_bench_t {
+    volatile uint32_t tas;
+    struct spinlock_t ticket __attribute__((aligned(64)));
+    struct mcs_lock_t mcs __attribute__((aligned(64)));
+    // protected data, two cache lines
+    uint64_t data[16] __attribute__((aligned(64)));
+    struct semaphore_t done;
+    struct lock_bench_worker_t workers[MAX_CPUS];
+    uint32_t num_workers;
+    uint32_t next_worker;
+    uint32_t kind;
+    uint32_t num_running;
+    uint64_t start;
+    uint64_t end;
+};
+
+static struct lock_bench_t bench;
+
+// old style test-and-set lock, baseline only
+static inline void tas_lock(volatile uint32_t* lock)
+{
+    while (compare_and_swap_32(lock, 0, 1) != 0);
+}
+
+static inline void tas_unlock(volatile uint32_t* lock)
+{
+    compare_and_swap_32(lock, 1, 0);
+}
+
+static inline void lock_bench_critical()
+{
+    for (uint32_t i = 0; i < 16; i += 4)
+        bench.data[i]++;
+}
+
+static uint64_t lock_bench_loop(uint32_t kind)
+{
+    uint64_t ops = 0;
+    while (timer_clock() < bench.end) {
+        int s = cpu_splhi();
+        switch (kind) {
+        case LOCK_BENCH_TAS:
+            tas_lock(&bench.tas);
+            lock_bench_critical();
+            tas_unlock(&bench.tas);
+            break;
+        case LOCK_BENCH_TICKET:
+            spinlock_lock(&bench.ticket);
+            lock_bench_critical();
+            spinlock_unlock(&bench.ticket);
+            break;
+        case LOCK_BENCH_MCS: {
+            int t = mcs_lock_splhi(&bench.mcs);
+            lock_bench_critical();
+            mcs_unlock_splx(&bench.mcs, t);
+            break;
+        }
+        }
+        cpu_splx(s);
+        ++ops;
+    }
+    return ops;
+}
+
+static void lock_bench_worker()
+{
+    uint32_t index = fetch_and_add_32(&bench.next_worker, 1);
+    struct lock_bench_worker_t* w = &bench.workers[index];
+
+    while (1) {
+        sema_wait(&w->start);
+
+        w->ops = 0;
+        if (index < bench.num_running) {
+            while (timer_clock() < bench.start)
+                cpu_pause();
+            w->ops = lock_bench_loop(bench.kind);
+        }
+
+        sema_signal(&bench.done);
+    }
+}
+
+static void lock_bench_init()
+{
+    spinlock_init(&bench.ticket);
+    mcs_lock_init(&bench.mcs);
+    sema_init(&bench.done, 0);
+
+    // workers pick their slot in start order, short of memory we run
+    // with the ones we got
+    for (uint32_t i = 0; i < local_apic.num_cpus; ++i) {
+        uint32_t apic_id = local_apic.cpus[i].apic_id;
+        sema_init(&bench.workers[i].start, 0);
+        struct thread_t* t = thread_create(lock_bench_worker, 0x1000, apic_id);
+        if (!t)
+            break;
+        thread_set_affinity(t, 1U << apic_id);
+        bench.num_workers++;
+    }
+}
+
+static void lock_bench_run(uint32_t kind, uint32_t num_running)
+{
+    for (uint32_t i = 0; i < 16; ++i)
+        bench.data[i] = 0;
+    bench.kind = kind;
+    bench.num_running = num_running;
+    bench.start = timer_clock() + LOCK_BENCH_DELAY;
+    bench.end = bench.start + LOCK_BENCH_MS;
+
+    for (uint32_t i = 0; i < bench.num_workers; ++i)
+        sema_signal(&bench.workers[i].start);
+    for (uint32_t i = 0; i < bench.num_workers; ++i)
+        sema_wait(&bench.done);
+
+    uint64_t total = 0;
+    uint64_t min_ops = ~0UL;
+    uint64_t max_ops = 0;
+    for (uint32_t i = 0; i < num_running; ++i) {
+        uint64_t ops = bench.workers[i].ops;
+        total += ops;
+        if (ops < min_ops)
+            min_ops = ops;
+        if (ops > max_ops)
+            max_ops = ops;
+    }
+
+    // every critical section bumps data[0] exactly once
+    check(bench.data[0] == total);
+
+    printf("%6s %2d: %8ld ops/ms min %ld max %ld\n",
+        lock_bench_names[kind], num_running,
+        total / LOCK_BENCH_MS, min_ops, max_ops);
+}
+
+void lock_bench_cmd(int argc, const char* argv[])
+{
+    if (!timer_clock()) {
+        printf("lockbench: timer not calibrated\n");
+        return;
+    }
+
+    if (!bench.num_workers)
+        lock_bench_init();
+    if (!bench.num_workers) {
+        printf("lockbench: no memory\n");
+        return;
+    }
+
+    for (uint32_t kind = 0; kind < LOCK_BENCH_NUM; ++kind) {
+        if (argc > 1 && strcmp(argv[1], lock_bench_names[kind]))
+            continue;
+        for (uint32_t n = 1; n <= bench.num_workers; ++n)
+            lock_bench_run(kind, n);
+    }
+}
@@ -0,0 +1,6 @@
+#ifndef KERNEL_LOCK_BENCH_H
+#define KERNEL_LOCK_BENCH_H
+
+void lock_bench_cmd(int argc, const char* argv[]);
+
+#endif // KERNEL_LOCK_BENCH_H
@@ -10,7 +10,10 @@
 #include "pci.h"
 #include "vm_boot.h"
 #include "vm_page.h"
+#include "vm_hat.h"
 #include "vm_cache.h"
+#include "vm_mmap.h"
+#include "vm_reclaim.h"
 #include "acpi.h"
 #include "imps.h"
 #include "kernel.h"
@@ -21,6 +24,8 @@
 #include "ata.h"
 #include "kterm.h"
 #include "kmalloc.h"
+#include "fpu.h"
+#include "string.h"
 
 extern uint8_t _end;
 
@@ -68,13 +73,12 @@ static void test_thread()
 
     //cpu_wait(500);
     //sched_yield();
-
-    while(1);
 }
 
 void kernel_main()
 {
     kernel_init();
+    mem_init();
     vm_boot_init();
 
     if (!multiboot_init())
@@ -84,7 +88,6 @@ void kernel_main()
     printf("booting kif...%016lx\n", (uint64_t)&_end);
 
     vm_page_init();
-    vm_hash_init();
 
     cpu_boot_init();
     pic_init();
@@ -93,9 +96,18 @@ void kernel_main()
 
     kmalloc_init();
     vm_boot_sync();
+    vm_boot_map_phys();
+    vm_hat_init();
+    vm_cache_init();
+    vm_mmap_init();
+    vm_reclaim_init();
 
+    fpu_init();
     sched_init();
     cpu_init();
+    kernel_page_reserve_start();
+    vm_reclaim_start();
+    vm_cache_start();
 
     kbd_8042_init();
     //ata_init();
@@ -105,7 +117,10 @@ void kernel_main()
     spinlock_init(&cond_lock);
     cond_init(&cond_test);
     struct thread_t* t = thread_create(test_thread, 0x1000, 1);
-    printf("created: %d\n", t->id);
+    if (t) {
+        printf("created: %d\n", t->id);
+        thread_detach(t);
+    }
     //for (uint32_t i = 0; i < num_cpus; ++i)
     //    printf("cpu[%d]: %d %d %d\n", i, cpus[i].flags, cpus[i].ticks, cpus[i].cur_thread->cnt);
 #endif
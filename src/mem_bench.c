@@ -0,0 +1,174 @@
+#include "mem_bench.h"
+#include "kernel.h"
+#include "kmalloc.h"
+#include "vm_page.h"
+#include "fpu.h"
+#include "stdio.h"
+#include "string.h"
+#include "x86.h"
+
+// memory op microbenchmark
+//
+// every copy and fill variant over the same buffers at a few sizes,
+// small ones run from the cache, 2M ones don't fit. loop is the
+// qword loop the page ops used to be, sse2 the vector path that
+// needs an fpu section
+
+#define MEM_BENCH_BYTES     (64UL * 1024 * 1024)    // per variant and size
+#define MEM_BENCH_MIN_ITERS 16
+
+typedef void (*mem_copy_fn)(void* dst, const void* src, size_t size);
+typedef void (*mem_set_fn)(void* dst, int c, size_t size);
+
+static void copy_loop(void* dst, const void* src, size_t size)
+{
+    uint64_t* d = (uint64_t*)dst;
+    const uint64_t* s = (const uint64_t*)src;
+    for (size_t n = size/8; n; --n) {
+        // keep it a loop, not a call to the thing we measure
+        asm("" : "+r"(d));
+        *d++ = *s++;
+    }
+}
+
+// streaming sse2 copy in an fpu section, the section is part of the
+// cost. 16 byte aligned buffers, whole 64 byte blocks
+static void copy_sse2_nt(void* dst, const void* src, size_t size)
+{
+    kernel_fpu_begin();
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t n = size/64; n; --n) {
+        asm volatile(
+            "movdqa 0(%1), %%xmm0\n\t"
+            "movdqa 16(%1), %%xmm1\n\t"
+            "movdqa 32(%1), %%xmm2\n\t"
+            "movdqa 48(%1), %%xmm3\n\t"
+            "movntdq %%xmm0, 0(%0)\n\t"
+            "movntdq %%xmm1, 16(%0)\n\t"
+            "movntdq %%xmm2, 32(%0)\n\t"
+            "movntdq %%xmm3, 48(%0)"
+            :
+            : "r"(d), "r"(s)
+            : "memory"
+        );
+        d += 64;
+        s += 64;
+    }
+    asm volatile("sfence" ::: "memory");
+    kernel_fpu_end();
+}
+
+static void set_loop(void* dst, int c, size_t size)
+{
+    uint64_t* d = (uint64_t*)dst;
+    uint64_t v = 0x0101010101010101UL * (uint8_t)c;
+    for (size_t n = size/8; n; --n) {
+        asm("" : "+r"(d));
+        *d++ = v;
+    }
+}
+
+static const struct {
+    const char* name;
+    mem_copy_fn fn;
+} copy_variants[] = {
+    { "loop", copy_loop },
+    { "movsq", mem_copy_movsq },
+    { "movsb", mem_copy_movsb },
+    { "nt", mem_copy_nt },
+    { "sse2", copy_sse2_nt },
+    { "auto", mem_copy },
+};
+
+static const struct {
+    const char* name;
+    mem_set_fn fn;
+} set_variants[] = {
+    { "loop", set_loop },
+    { "stosq", mem_set_stosq },
+    { "stosb", mem_set_stosb },
+    { "nt", mem_set_nt },
+    { "auto", mem_set },
+};
+
+static const size_t mem_bench_sizes[] = { 64, PAGE_4K_SIZE, PAGE_2M_SIZE };
+
+#define ARRAY_NUM(a)    (sizeof(a) / sizeof((a)[0]))
+
+static void* bench_src;
+static void* bench_dst;
+
+static inline uint64_t mem_bench_iters(size_t size)
+{
+    uint64_t iters = MEM_BENCH_BYTES / size;
+    return iters < MEM_BENCH_MIN_ITERS ? MEM_BENCH_MIN_ITERS : iters;
+}
+
+static void mem_bench_print(const char* op, const char* name, size_t size,
+                            uint64_t iters, uint64_t cycles)
+{
+    if (!cycles)
+        cycles = 1;
+    uint64_t rate = (uint64_t)size * iters * 100 / cycles;
+    printf("%4s %6s %7ld: %8ld cycles/op %4ld.%02ld bytes/cycle\n",
+        op, name, size, cycles / iters, rate / 100, rate % 100);
+}
+
+static void mem_bench_copy()
+{
+    for (uint32_t i = 0; i < ARRAY_NUM(mem_bench_sizes); ++i) {
+        size_t size = mem_bench_sizes[i];
+        uint64_t iters = mem_bench_iters(size);
+        for (uint32_t v = 0; v < ARRAY_NUM(copy_variants); ++v) {
+            mem_copy_fn fn = copy_variants[v].fn;
+            fn(bench_dst, bench_src, size);
+            uint64_t start = rdtsc();
+            for (uint64_t n = 0; n < iters; ++n)
+                fn(bench_dst, bench_src, size);
+            uint64_t cycles = rdtsc() - start;
+            mem_bench_print("copy", copy_variants[v].name, size, iters, cycles);
+        }
+    }
+}
+
+static void mem_bench_set()
+{
+    for (uint32_t i = 0; i < ARRAY_NUM(mem_bench_sizes); ++i) {
+        size_t size = mem_bench_sizes[i];
+        uint64_t iters = mem_bench_iters(size);
+        for (uint32_t v = 0; v < ARRAY_NUM(set_variants); ++v) {
+            mem_set_fn fn = set_variants[v].fn;
+            fn(bench_dst, 0, size);
+            uint64_t start = rdtsc();
+            for (uint64_t n = 0; n < iters; ++n)
+                fn(bench_dst, (int)n, size);
+            uint64_t cycles = rdtsc() - start;
+            mem_bench_print("set", set_variants[v].name, size, iters, cycles);
+        }
+    }
+}
+
+// membench [copy|set]
+void mem_bench_cmd(int argc, const char* argv[])
+{
+    if (!bench_src || !bench_dst) {
+        void* src = kmalloc(PAGE_2M_SIZE, KMALLOC_ZERO);
+        void* dst = kmalloc(PAGE_2M_SIZE, KMALLOC_ZERO);
+        if (!src || !dst) {
+            if (src)
+                kfree(src);
+            if (dst)
+                kfree(dst);
+            printf("membench: no memory\n");
+            return;
+        }
+        bench_src = src;
+        bench_dst = dst;
+    }
+
+    if (argc < 2 || !strcmp(argv[1], "copy"))
+        mem_bench_copy();
+    if (argc < 2 || !strcmp(argv[1], "set"))
+        mem_bench_set();
+}
@@ -0,0 +1,6 @@
+#ifndef KERNEL_MEM_BENCH_H
+#define KERNEL_MEM_BENCH_H
+
+void mem_bench_cmd(int argc, const char* argv[]);
+
+#endif // KERNEL_MEM_BENCH_H
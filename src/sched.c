@@ -3,6 +3,11 @@
 #include "thread.h"
 #include "list.h"
 #include "stdio.h"
+#include "kernel.h"
+#include "interrupt.h"
+#include "local_apic.h"
+#include "vm_hat.h"
+#include "fpu.h"
 
 void sched_init()
 {
@@ -29,23 +34,58 @@ static struct thread_t* setup_idle_thread(struct cpu_desc_t* cpu)
 
     thread->next = NULL;
     thread->prev = NULL;
+    thread->run_next = NULL;
+    thread->run_prev = NULL;
     thread->next_wait = NULL;
+    thread->joiner = NULL;
+    thread->queue = NULL;
     thread->ctx = NULL;
+    thread->hat = NULL;
+    thread->fpu_state = NULL;
     thread->stack = 0;
+    thread->stack_area = NULL;
     thread->ticks = 0;
+    thread->last_run = 0;
+    timer_init(&thread->sleep_timer, sched_sleep_timeout, thread);
     thread->id = 0;
     thread->cpu_id = cpu->apic_id;
+    thread->cpu_mask = 1U << cpu->apic_id;
     thread->state = THREAD_STATE_RUNNING;
-    thread->sleep_time = 0;
     thread->flags = 0;    
+    thread->fpu_depth = 0;
+    thread->intr_depth = 0;
+    thread->join = 0;
+    thread->exit_code = 0;
     thread->pri = THREAD_DEFAULT_PRI;
     thread->cnt = THREAD_DEFAULT_PRI;
 
     return thread;
 }
 
+static void sched_queue_init(struct sched_queue_t* q)
+{
+    q->bitmap = 0;
+    for (uint32_t i = 0; i < SCHED_NUM_PRI; ++i)
+        q->threads[i] = NULL;
+}
+
+static void run_queue_init(struct run_queue_t* rq)
+{
+    sched_queue_init(&rq->queues[0]);
+    sched_queue_init(&rq->queues[1]);
+    rq->active = &rq->queues[0];
+    rq->expired = &rq->queues[1];
+    rq->num_running = 0;
+    rq->clock = timer_clock();
+    timer_init(&rq->balance_timer, sched_balance, NULL);
+}
+
 void sched_init_cpu(struct cpu_desc_t* cpu)
 {
+    run_queue_init(&cpu->rq);
+    timer_wheel_init(&cpu->timers, timer_clock());
+
+    thread_list_init(&cpu->zombies);
     struct thread_t* t = setup_idle_thread(cpu);
     queue_push_back(cpu->threads, t, next, prev);
     cpu->cur_thread = t;
@@ -54,79 +94,223 @@ void sched_init_cpu(struct cpu_desc_t* cpu)
 extern void context_switch(struct switch_context_t** old_ctx,
                            struct switch_context_t* new_ctx);
 
-// TODO: put sleeping threads on a separate list
-static int sched_check_sleeping(struct thread_t* begin)
+static inline uint32_t sched_pri(struct thread_t* t)
 {
-    int num_wakeups = 0;
-    struct thread_t* t = begin;
-    do {
-        if (t->state == THREAD_STATE_SLEEPING && t->flags & THREAD_FLAG_SLEEP_TIMER) {
-            t->sleep_time--;
-            if (!t->sleep_time) {
-                t->state = THREAD_STATE_RUNNING;
-                t->flags &= ~THREAD_FLAG_SLEEP_TIMER;
-                t->cnt = t->pri;
-                ++num_wakeups;
-            }
+    if (t->pri < 0)
+        return 0;
+    if (t->pri >= SCHED_NUM_PRI)
+        return SCHED_NUM_PRI - 1;
+    return (uint32_t)t->pri;
+}
+
+static void sched_queue_push(struct sched_queue_t* q, struct thread_t* t)
+{
+    uint32_t pri = sched_pri(t);
+    queue_push_back(q->threads[pri], t, run_next, run_prev);
+    q->bitmap |= 1U << pri;
+    t->queue = q;
+}
+
+static void sched_queue_remove(struct thread_t* t)
+{
+    struct sched_queue_t* q = t->queue;
+    uint32_t pri = sched_pri(t);
+    queue_pop(q->threads[pri], t, run_next, run_prev);
+    if (!q->threads[pri])
+        q->bitmap &= ~(1U << pri);
+    t->queue = NULL;
+}
+
+// highest priority with a runnable thread, -1 if none
+static inline int sched_queue_top(struct sched_queue_t* q)
+{
+    return q->bitmap ? 31 - __builtin_clz(q->bitmap) : -1;
+}
+
+static void sched_run(struct cpu_desc_t* cpu, struct thread_t* t)
+{
+    struct run_queue_t* rq = &cpu->rq;
+    sched_queue_push(rq->active, t);
+    rq->num_running++;
+
+    // balance periodically as long as there's something to run
+    if (!timer_pending(&rq->balance_timer))
+        timer_add_locked(cpu, &rq->balance_timer, SCHED_BALANCE_MS);
+}
+
+static void sched_stop(struct run_queue_t* rq, struct thread_t* t)
+{
+    sched_queue_remove(t);
+    rq->num_running--;
+}
+
+// find next one to run, first in fifo of the highest priority
+static struct thread_t* sched_find(struct run_queue_t* rq)
+{
+    if (!rq->active->bitmap) {
+        struct sched_queue_t* q = rq->active;
+        rq->active = rq->expired;
+        rq->expired = q;
+    }
+
+    int pri = sched_queue_top(rq->active);
+    return pri >= 0 ? rq->active->threads[pri] : NULL;
+}
+
+// thread on from that may run on cpu, expired ones first (cache cold),
+// lowest priority first, recently run ones only if not picky
+static struct thread_t* sched_find_migratable(struct cpu_desc_t* from,
+                                              struct cpu_desc_t* cpu,
+                                              bool cache_hot_ok)
+{
+    struct run_queue_t* rq = &from->rq;
+    struct sched_queue_t* queues[2] = { rq->expired, rq->active };
+    uint32_t cpu_bit = 1U << cpu->apic_id;
+    uint32_t num_scanned = 0;
+
+    for (uint32_t i = 0; i < 2; ++i) {
+        uint32_t bitmap = queues[i]->bitmap;
+        while (bitmap) {
+            uint32_t pri = __builtin_ctz(bitmap);
+            bitmap &= bitmap - 1;
+
+            struct thread_t* head = queues[i]->threads[pri];
+            struct thread_t* t = head;
+            do {
+                if (t != from->cur_thread && (t->cpu_mask & cpu_bit)) {
+                    if (cache_hot_ok || rq->clock - t->last_run >= SCHED_CACHE_HOT_MS)
+                        return t;
+                }
+                if (++num_scanned >= SCHED_STEAL_SCAN)
+                    return NULL;
+                t = t->run_next;
+            } while (t != head);
         }
-        t = t->next;
-    } while (t != begin);
+    }
 
-    return num_wakeups;
+    return NULL;
 }
 
-// find next one to run starting at begin
-static struct thread_t* sched_find(struct thread_t* begin)
+// pull one thread from the busiest cpu that has more than min_running,
+// cpu locked, never waits on the other cpu's lock
+static bool sched_steal(struct cpu_desc_t* cpu, uint32_t min_running, bool idle)
 {
-    int cnt = -1;
-    struct thread_t* t = begin;
-    struct thread_t* next_thread = t;
-    do {
-        if (t->state == THREAD_STATE_RUNNING && t->cnt > cnt) {
-            cnt = t->cnt;
-            next_thread = t;
+    struct cpu_desc_t* busiest = NULL;
+    uint32_t max_running = min_running;
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        struct cpu_desc_t* c = &cpus[i];
+        if (c == cpu || !(c->flags & CPU_FLAGS_ACTIVE))
+            continue;
+        if (c->rq.num_running > max_running) {
+            max_running = c->rq.num_running;
+            busiest = c;
         }
-        t = t->next;
-    } while (t != begin);
+    }
 
-    return next_thread;
+    if (!busiest || !spinlock_trylock(&busiest->lock))
+        return false;
+
+    struct thread_t* t = sched_find_migratable(busiest, cpu, false);
+    if (!t && idle)
+        t = sched_find_migratable(busiest, cpu, true);
+
+    if (t) {
+        sched_stop(&busiest->rq, t);
+        queue_pop(busiest->threads, t, next, prev);
+        t->cpu_id = cpu->apic_id;
+        queue_push_back(cpu->threads, t, next, prev);
+        sched_run(cpu, t);
+    }
+
+    spinlock_unlock(&busiest->lock);
+    return t != NULL;
+}
+
+// charge time since last call to the running thread
+static void sched_account(struct cpu_desc_t* cpu, uint64_t now)
+{
+    struct thread_t* t = cpu->cur_thread;
+    uint32_t elapsed = (uint32_t)(now - cpu->rq.clock);
+    cpu->rq.clock = now;
+
+    t->ticks += elapsed;
+    if (t != &cpu->idle_thread) {
+        t->cnt -= (int)elapsed;
+        if (t->cnt < 0)
+            t->cnt = 0;
+    }
+}
+
+// no ticks while idle, otherwise one when the slice runs out
+static void sched_program_timer(struct cpu_desc_t* cpu, struct thread_t* t)
+{
+    uint64_t deadline = TIMER_NEVER;
+    if (t != &cpu->idle_thread)
+        deadline = cpu->rq.clock + (t->cnt > 0 ? t->cnt : 1);
+
+    timer_program(cpu, deadline);
 }
 
 static void sched_next(struct cpu_desc_t* cpu)
 {
     struct thread_t* cur_thread = cpu->cur_thread;
+    sched_account(cpu, timer_clock());
 
-    struct thread_t* threads = cpu->threads;
-    struct thread_t* next_thread = sched_find(threads->next);
-    if (next_thread->cnt == 0) {
-        for (struct thread_t* t = threads->next; t != threads; t = t->next) {
-            t->cnt = (t->cnt >> 1) + t->pri;
-        }
-        next_thread = sched_find(threads->next);
-    }
+    struct thread_t* next_thread = sched_find(&cpu->rq);
+    if (!next_thread && sched_steal(cpu, 1, true))
+        next_thread = sched_find(&cpu->rq);
+    if (!next_thread)
+        next_thread = &cpu->idle_thread;
+
+    sched_program_timer(cpu, next_thread);
 
     if (next_thread != cur_thread) {
         struct thread_t* this_thread = cur_thread;
+        this_thread->last_run = cpu->rq.clock;
         cpu->cur_thread = next_thread;
-        this_thread->ticks++;
+        vm_hat_activate(next_thread->hat ? next_thread->hat : &kernel_hat);
+        fpu_switch(cpu, this_thread, next_thread);
         context_switch(&this_thread->ctx, next_thread->ctx);
     }
 }
 
-// entered at splhi
+// local apic timer expired, entered at splhi
 void sched_tick(struct cpu_desc_t* cpu)
 {
-    struct thread_t* threads = cpu->threads;
-    sched_check_sleeping(threads->next);
+    struct run_queue_t* rq = &cpu->rq;
+    uint64_t now = timer_clock();
+
+    // we're about to reschedule anyway, no need for wakeups to kick us
+    cpu->need_resched = 1;
+    timer_wheel_tick(&cpu->timers, now);
+    cpu->need_resched = 0;
+
+    if (!thread_list_empty(&cpu->zombies))
+        thread_reap_locked(cpu);
 
     struct thread_t* cur_thread = cpu->cur_thread;
-    cur_thread->ticks++;
+    sched_account(cpu, now);
 
-    --cur_thread->cnt;
-    if (cur_thread->cnt > 0)
+    if (cur_thread == &cpu->idle_thread) {
+        if (rq->num_running)
+            sched_next(cpu);
+        else
+            sched_program_timer(cpu, cur_thread);
         return;
+    }
 
-    cur_thread->cnt = 0;
+    if (cur_thread->cnt > 0) {
+        if (sched_queue_top(rq->active) > (int)sched_pri(cur_thread))
+            sched_next(cpu);
+        else
+            sched_program_timer(cpu, cur_thread);
+        return;
+    }
+
+    // slice used up, wait on expired queue with a fresh one
+    sched_queue_remove(cur_thread);
+    cur_thread->cnt = cur_thread->pri;
+    sched_queue_push(rq->expired, cur_thread);
     sched_next(cpu);
 
     // NOTES:
@@ -135,13 +319,73 @@ void sched_tick(struct cpu_desc_t* cpu)
     // as long as we hold the queue locks, we're fine
     // we have to disable ints before returning (iretq)
     // we know we won't be re-entered here
-    // we can run cleanup tasks (dead threads, dead processes)
+    // we can run cleanup tasks (dead processes)
+}
+
+// thread made runnable on cpu should preempt what runs there,
+// one reschedule ipi until the target gets to it
+static void sched_kick(struct cpu_desc_t* cpu, struct thread_t* thread)
+{
+    struct thread_t* cur_thread = cpu->cur_thread;
+    if (cur_thread != &cpu->idle_thread && sched_pri(thread) <= sched_pri(cur_thread))
+        return;
+
+    if (cpu->need_resched)
+        return;
+
+    cpu->need_resched = 1;
+    local_apic_ipi(cpu->apic_id, VECTOR_RESCHED);
+}
+
+// reschedule ipi, cpu locked at splhi
+void sched_resched(struct cpu_desc_t* cpu)
+{
+    if (!cpu->need_resched)
+        return;
+
+    cpu->need_resched = 0;
+
+    // idle cpus steal in sched_next
+    struct thread_t* cur_thread = cpu->cur_thread;
+    if (cur_thread == &cpu->idle_thread) {
+        sched_next(cpu);
+    } else if (sched_queue_top(cpu->rq.active) > (int)sched_pri(cur_thread)) {
+        sched_next(cpu);
+    }
+}
+
+// new thread, cpu locked
+void sched_add_locked(struct cpu_desc_t* cpu, struct thread_t* thread)
+{
+    queue_push_back(cpu->threads, thread, next, prev);
+    sched_run(cpu, thread);
+    sched_kick(cpu, thread);
+}
+
+// thread's cpu locked
+void sched_wakeup_locked(struct cpu_desc_t* cpu, struct thread_t* thread)
+{
+    if (thread->state != THREAD_STATE_SLEEPING)
+        return;
+
+    if (thread->flags & THREAD_FLAG_SLEEP_TIMER) {
+        timer_cancel_locked(cpu, &thread->sleep_timer);
+        thread->flags &= ~THREAD_FLAG_SLEEP_TIMER;
+    }
+
+    // sleepers get half of what they had left on top of the new slice
+    thread->state = THREAD_STATE_RUNNING;
+    thread->cnt = (thread->cnt >> 1) + thread->pri;
+    sched_run(cpu, thread);
+    sched_kick(cpu, thread);
 }
 
 void sched_yield_locked(struct cpu_desc_t* cpu)
 {
     struct thread_t* cur_thread = cpu->cur_thread;
+    check(cur_thread != &cpu->idle_thread);
     cur_thread->state = THREAD_STATE_SLEEPING;
+    sched_stop(&cpu->rq, cur_thread);
     sched_next(cpu);
 }
 
@@ -152,15 +396,98 @@ void sched_yield()
     cpu_unlock_splx(cpu);
 }
 
+// back of its fifo, still runnable, others of the same priority go first
+void sched_relinquish()
+{
+    struct cpu_desc_t* cpu = cpu_lock_splhi();
+    struct thread_t* cur_thread = cpu->cur_thread;
+    if (cur_thread != &cpu->idle_thread) {
+        struct sched_queue_t* q = cur_thread->queue;
+        sched_queue_remove(cur_thread);
+        sched_queue_push(q, cur_thread);
+        sched_next(cpu);
+    }
+    cpu_unlock_splx(cpu);
+}
+
+// current thread is done, its stack goes once something else runs
+void sched_exit_locked(struct cpu_desc_t* cpu)
+{
+    struct thread_t* cur_thread = cpu->cur_thread;
+    check(cur_thread != &cpu->idle_thread);
+    cur_thread->state = THREAD_STATE_DEAD;
+    sched_stop(&cpu->rq, cur_thread);
+    queue_pop(cpu->threads, cur_thread, next, prev);
+    thread_list_push(&cpu->zombies, cur_thread);
+    sched_next(cpu);
+}
+
 void sched_sleep(uint32_t ms)
 {
+    // may still be on the wheel of a cpu we migrated from, it can't
+    // be taken off there with this cpu locked
+    int s = cpu_splhi();
+    struct timer_t* timer = &get_cpu()->cur_thread->sleep_timer;
+    cpu_splx(s);
+    if (timer_pending(timer))
+        timer_cancel(timer);
+
     struct cpu_desc_t* cpu = cpu_lock_splhi();
     struct thread_t* cur_thread = cpu->cur_thread;
-    if (cur_thread != cpu->threads) {
+    if (cur_thread != &cpu->idle_thread && ms) {
         cur_thread->state = THREAD_STATE_SLEEPING;
-        cur_thread->sleep_time = ms;
         cur_thread->flags |= THREAD_FLAG_SLEEP_TIMER;
+        timer_add_locked(cpu, &cur_thread->sleep_timer, ms);
+        sched_stop(&cpu->rq, cur_thread);
         sched_next(cpu);
     }
     cpu_unlock_splx(cpu);
-}
\ No newline at end of file
+}
+
+// sleep timer expired, called from sched_tick
+void sched_sleep_timeout(void* arg)
+{
+    struct thread_t* thread = (struct thread_t*)arg;
+    struct cpu_desc_t* cpu = get_cpu();
+    thread->flags &= ~THREAD_FLAG_SLEEP_TIMER;
+    sched_wakeup_locked(cpu, thread);
+}
+
+// wake up an idle cpu, it will steal from the busiest one
+static void sched_kick_idle(struct cpu_desc_t* cpu)
+{
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        struct cpu_desc_t* c = &cpus[i];
+        if (c == cpu || !(c->flags & CPU_FLAGS_ACTIVE) || c->rq.num_running)
+            continue;
+        if (!spinlock_trylock(&c->lock))
+            continue;
+
+        bool kicked = false;
+        if (!c->rq.num_running && !c->need_resched) {
+            c->need_resched = 1;
+            local_apic_ipi(c->apic_id, VECTOR_RESCHED);
+            kicked = true;
+        }
+        spinlock_unlock(&c->lock);
+
+        if (kicked)
+            break;
+    }
+}
+
+// balance timer, runs while this cpu has threads
+void sched_balance(void* arg)
+{
+    struct cpu_desc_t* cpu = get_cpu();
+    struct run_queue_t* rq = &cpu->rq;
+    if (!rq->num_running)
+        return;
+
+    if (rq->num_running > 1)
+        sched_kick_idle(cpu);
+    else
+        sched_steal(cpu, rq->num_running + 1, false);
+
+    timer_add_locked(cpu, &rq->balance_timer, SCHED_BALANCE_MS);
+}
@@ -2,15 +2,49 @@
 #define KERNEL_SCHED_H
 
 #include "types.h"
+#include "timer.h"
+
+// priorities [0..SCHED_NUM_PRI), higher runs first
+#define SCHED_NUM_PRI   32
+
+#define SCHED_BALANCE_MS    100 // periodic balancing while busy
+#define SCHED_CACHE_HOT_MS  5   // ran this recently, better not migrate
+#define SCHED_STEAL_SCAN    16  // candidates looked at per steal
 
 struct cpu_desc_t;
+struct thread_t;
+
+// one fifo per priority, bit set in bitmap when fifo is not empty
+struct sched_queue_t {
+    uint32_t bitmap;
+    struct thread_t* threads[SCHED_NUM_PRI];
+};
+
+// threads with time left (cnt > 0) are on active queue,
+// threads that used up their slice wait on expired one
+// until active queue drains, then the two are swapped
+struct run_queue_t {
+    struct sched_queue_t queues[2];
+    struct sched_queue_t* active;
+    struct sched_queue_t* expired;
+    uint64_t clock;     // tick of last accounting
+    struct timer_t balance_timer;
+    uint32_t num_running;
+};
 
 void sched_init(void);
 void sched_dump(void);
 void sched_init_cpu(struct cpu_desc_t* cpu);
 void sched_tick(struct cpu_desc_t* cpu);
+void sched_resched(struct cpu_desc_t* cpu);
 void sched_yield(void);
 void sched_yield_locked(struct cpu_desc_t* cpu);
+void sched_relinquish(void);
+void sched_exit_locked(struct cpu_desc_t* cpu);
 void sched_sleep(uint32_t ms);
+void sched_sleep_timeout(void* arg);
+void sched_balance(void* arg);
+void sched_add_locked(struct cpu_desc_t* cpu, struct thread_t* thread);
+void sched_wakeup_locked(struct cpu_desc_t* cpu, struct thread_t* thread);
 
 #endif // KERNEL_SCHED_H
@@ -43,7 +43,7 @@ void sema_signal(struct semaphore_t* s)
 
     struct thread_t* t = thread_list_pop(&s->threads);
     struct cpu_desc_t* cpu = cpu_lock_id(t->cpu_id);
-    t->state = THREAD_STATE_RUNNING;
+    sched_wakeup_locked(cpu, t);
     cpu_unlock(cpu);
 
     spinlock_unlock(&s->lock);
@@ -3,18 +3,39 @@
 #include "kernel.h"
 #include "stdio.h"
 #include "spinlock.h"
+#include "vm_page.h"
 
 //#define TRACE_ENABLED
 #include "trace.h"
 
-static uintptr_t sys_alloc_page(uint32_t size)
+static inline struct page_desc_t* sys_page_desc(uintptr_t page)
 {
-    // TODO: rip from page db once setup
-    return 0;
+    return page_db_desc(page_db, page_db_addr2index(page_db, kernel_vaddr_phys(page)));
+}
+
+// tag the page so slab_list_find() can get back to sl
+static void sys_own_page(struct slab_list_t* sl, uintptr_t page)
+{
+    struct page_desc_t* desc = sys_page_desc(page);
+    desc->flags |= PGF_KMEM_SLAB;
+    desc->slab_list = sl;
+}
+
+static uintptr_t sys_alloc_page(struct slab_list_t* sl, uint32_t size)
+{
+    check(size == PAGE_2M_SIZE);
+    uintptr_t page = kernel_page_alloc();
+    if (page)
+        sys_own_page(sl, page);
+    return page;
 }
 
 static void sys_free_page(uintptr_t page)
 {
+    struct page_desc_t* desc = sys_page_desc(page);
+    desc->flags &= ~PGF_KMEM_SLAB;
+    desc->slab_list = NULL;
+    kernel_page_free(page);
 }
 
 #define SLAB_RESERVED   0x1
@@ -22,7 +43,8 @@ static void sys_free_page(uintptr_t page)
 struct slab_t {
     struct slab_t* next;
     struct slab_t** prev;
-    uint16_t chunk_shift;
+    struct slab_list_t* sl;
+    uint32_t chunk_size;
     uint16_t num_chunks;
     uint16_t num_free;
     uint16_t num_reserved;
@@ -31,25 +53,25 @@ struct slab_t {
     uint16_t chunk_list[];
 };
 
-static struct slab_t* slab_init(uintptr_t addr, uint32_t size, uint32_t chunk_size)
+// chunks need not be a power of two, indices go by division
+static struct slab_t* slab_init(struct slab_list_t* sl, uintptr_t addr,
+                                uint32_t size, uint32_t chunk_size)
 {
-    uint32_t chunk_shift = ceil_pow2(chunk_size);
-    uint32_t chunk_size_pow2 = 1 << chunk_shift;
-    uint32_t num_chunks = size >> chunk_shift;
+    uint32_t num_chunks = size / chunk_size;
     uint32_t cache_size = sizeof(struct slab_t) + num_chunks * sizeof(uint16_t);
-    uint32_t num_reserved = ((cache_size + (chunk_size_pow2-1)) & ~(chunk_size_pow2-1))
-                          >> chunk_shift;
+    uint32_t num_reserved = (cache_size + (chunk_size-1)) / chunk_size;
+    check(num_chunks <= 0xFFFF && num_reserved < num_chunks);
 
     trace("slab_init(): %016lx\n", addr);
-    trace("slab_init(): chunk_size: %d -> [%d:%d], size %d\n",
-            chunk_size, chunk_size_pow2, chunk_shift, size);
+    trace("slab_init(): chunk_size: %d, size %d\n", chunk_size, size);
     trace("slab_init(): num,rsvd,free (%d,%d,%d), cache_size %d\n",
             num_chunks, num_reserved, num_chunks - num_reserved, cache_size);
 
     struct slab_t* slab = (struct slab_t*)addr;
     slab->next = NULL;
     slab->prev = NULL;
-    slab->chunk_shift = (uint16_t)chunk_shift;
+    slab->sl = sl;
+    slab->chunk_size = chunk_size;
     slab->num_chunks = (uint16_t)num_chunks;
     slab->num_free = (uint16_t)(num_chunks - num_reserved);
     slab->num_reserved = (uint16_t)num_reserved;
@@ -78,14 +100,14 @@ static void* slab_alloc(struct slab_t* slab)
 
     trace("slab_alloc(): %d\n", index);
     uintptr_t base = (uintptr_t)slab;
-    return (void*)(base + (index << slab->chunk_shift));
+    return (void*)(base + index * slab->chunk_size);
 }
 
 // addr assumed checked
 static void slab_free(struct slab_t* slab, void* addr)
 {
     uintptr_t base = (uintptr_t)slab;
-    uint32_t index = (uint32_t)((uintptr_t)addr - base) >> slab->chunk_shift;
+    uint32_t index = (uint32_t)((uintptr_t)addr - base) / slab->chunk_size;
     trace("slab_free(): %d\n", index);
     slab->chunk_list[index] = slab->free_list;
     slab->free_list = (uint16_t)index;
@@ -107,14 +129,15 @@ static inline bool slab_is_reserved(struct slab_t* slab)
     return slab->flags & SLAB_RESERVED;
 }
 
-static inline void slab_list_lock(struct slab_list_t* sl)
+// slab lists are shared by all cpus, queue the waiters
+static inline int slab_list_lock(struct slab_list_t* sl)
 {
-    spinlock_lock(&sl->lock);
+    return mcs_lock_splhi(&sl->lock);
 }
 
-static inline void slab_list_unlock(struct slab_list_t* sl)
+static inline void slab_list_unlock(struct slab_list_t* sl, int s)
 {
-    spinlock_unlock(&sl->lock);
+    mcs_unlock_splx(&sl->lock, s);
 }
 
 static inline void slab_list_insert(struct slab_t** list, struct slab_t* s)
@@ -145,23 +168,36 @@ bool slab_list_init(struct slab_list_t* sl,
                     uint32_t chunk_size)
 {
     uint32_t size_shift = ceil_pow2(size);
-    if (sl_owner && sl_owner->chunk_shift != size_shift) {
+    if (sl_owner && sl_owner->chunk_size != (1U << size_shift)) {
         printf("slab_list_init(): sl_owner has bad chunk size %d (expected %d)\n",
-                (1 << sl_owner->chunk_shift), (1 << size_shift));
+                sl_owner->chunk_size, (1 << size_shift));
         return false;
     }
 
-    uint32_t chunk_shift = ceil_pow2(chunk_size);
-    trace("slab_list_init(): size [%d:%d], chunk_size [%d:%d]\n",
-            size, size_shift, chunk_size, chunk_shift);
+    chunk_size = (chunk_size + 7) & ~7U;
+    trace("slab_list_init(): size [%d:%d], chunk_size %d\n",
+            size, size_shift, chunk_size);
 
     sl->sl_owner = sl_owner;
     sl->free_slabs = NULL;
     sl->used_slabs = NULL;
     sl->size_shift = size_shift;
-    sl->chunk_shift = chunk_shift;
+    sl->chunk_size = chunk_size;
     sl->flags = 0;
-    sl->lock.counter = 0;
+    mcs_lock_init(&sl->lock);
+    if (sl_owner)
+        sl_owner->flags |= SLAB_LIST_NESTED;
+
+    sl->sl_mag = NULL;
+    spinlock_init(&sl->depot_lock);
+    sl->full_mags = NULL;
+    sl->empty_mags = NULL;
+    sl->num_full = 0;
+    sl->num_empty = 0;
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        sl->cpu[i].loaded = NULL;
+        sl->cpu[i].prev = NULL;
+    }
 
     return true;
 }
@@ -174,11 +210,12 @@ bool slab_list_reserve_on_slack(struct slab_list_t* sl)
         p = (uintptr_t)slab_list_alloc(sl->sl_owner);
     else {
         p = kernel_slack_alloc(size, size);
+        if (p)
+            sys_own_page(sl, p);
     }
 
     if (p) {
-        uint32_t chunk_size = 1 << sl->chunk_shift;
-        struct slab_t* s = slab_init(p, size, chunk_size);
+        struct slab_t* s = slab_init(sl, p, size, sl->chunk_size);
         if (s) {
             s->flags |= SLAB_RESERVED;
             slab_list_insert(&sl->free_slabs, s);
@@ -189,9 +226,9 @@ bool slab_list_reserve_on_slack(struct slab_list_t* sl)
     return false;
 }
 
-void* slab_list_alloc(struct slab_list_t* sl)
+static void* slab_list_alloc_slow(struct slab_list_t* sl)
 {
-    slab_list_lock(sl);
+    int spl = slab_list_lock(sl);
     struct slab_t* s = sl->free_slabs;
     if (s) {
         void* addr = slab_alloc(s);
@@ -199,7 +236,7 @@ void* slab_list_alloc(struct slab_list_t* sl)
             slab_list_remove(s);
             slab_list_insert(&sl->used_slabs, s);
         }
-        slab_list_unlock(sl);
+        slab_list_unlock(sl, spl);
         return addr;
     }
 
@@ -210,28 +247,27 @@ void* slab_list_alloc(struct slab_list_t* sl)
     if (sl->sl_owner)
         p = (uintptr_t)slab_list_alloc(sl->sl_owner);
     else
-        p = sys_alloc_page(size);
+        p = sys_alloc_page(sl, size);
 
     if (p) {
-        uint32_t chunk_size = 1 << sl->chunk_shift;
-        s = slab_init(p, size, chunk_size);
+        s = slab_init(sl, p, size, sl->chunk_size);
         if (s) {
             slab_list_insert(&sl->free_slabs, s);
             void* addr = slab_alloc(s);
-            slab_list_unlock(sl);
+            slab_list_unlock(sl, spl);
             return addr;
         }
     }
 
-    slab_list_unlock(sl);
+    slab_list_unlock(sl, spl);
     return NULL;
 }
 
-void slab_list_free(struct slab_list_t* sl, void* addr)
+static void slab_list_free_slow(struct slab_list_t* sl, void* addr)
 {
     uintptr_t slab_addr = (uintptr_t)addr & ~((1UL << sl->size_shift) - 1);
     struct slab_t* s = (struct slab_t*)slab_addr;
-    slab_list_lock(sl);
+    int spl = slab_list_lock(sl);
     bool was_full = slab_is_full(s);
     slab_free(s, addr);
     if (was_full) {
@@ -244,15 +280,237 @@ void slab_list_free(struct slab_list_t* sl, void* addr)
         else
             sys_free_page(slab_addr);
     }
-    slab_list_unlock(sl);
+    slab_list_unlock(sl, spl);
+}
+
+// per-cpu magazines index through gs, cpu_init() turns them on
+static bool slab_mag_enabled;
+
+void slab_enable_magazines()
+{
+    slab_mag_enabled = true;
+}
+
+void slab_list_set_magazines(struct slab_list_t* sl, struct slab_list_t* sl_mag)
+{
+    check(!sl_mag || sl_mag->chunk_size >= sizeof(struct slab_mag_t));
+    sl->sl_mag = sl_mag;
+}
+
+static inline bool slab_mag_empty(struct slab_mag_t* m)
+{
+    return !m || m->rounds == 0;
+}
+
+static inline bool slab_mag_full(struct slab_mag_t* m)
+{
+    return !m || m->rounds == SLAB_MAG_ROUNDS;
+}
+
+static inline void slab_mag_push(struct slab_mag_t** list, struct slab_mag_t* m)
+{
+    m->next = *list;
+    *list = m;
+}
+
+static inline struct slab_mag_t* slab_mag_pop(struct slab_mag_t** list)
+{
+    struct slab_mag_t* m = *list;
+    if (m)
+        *list = m->next;
+    return m;
+}
+
+// objects back to the slabs, the magazine stays
+static void slab_mag_drain(struct slab_list_t* sl, struct slab_mag_t* m)
+{
+    for (uint32_t i = 0; i < m->rounds; ++i)
+        slab_list_free_slow(sl, m->objs[i]);
+    m->rounds = 0;
+}
+
+// both magazines empty, trade prev for a full one from the depot
+static bool slab_cpu_reload_full(struct slab_list_t* sl, struct slab_cpu_t* c)
+{
+    spinlock_lock(&sl->depot_lock);
+    struct slab_mag_t* m = slab_mag_pop(&sl->full_mags);
+    if (!m) {
+        spinlock_unlock(&sl->depot_lock);
+        return false;
+    }
+
+    --sl->num_full;
+    struct slab_mag_t* spare = c->prev;
+    if (spare && sl->num_empty < SLAB_DEPOT_MAGS) {
+        slab_mag_push(&sl->empty_mags, spare);
+        ++sl->num_empty;
+        spare = NULL;
+    }
+    spinlock_unlock(&sl->depot_lock);
+
+    // enough empty ones parked already
+    if (spare)
+        slab_list_free(sl->sl_mag, spare);
+
+    c->prev = c->loaded;
+    c->loaded = m;
+    return true;
+}
+
+// both magazines full, trade prev for an empty one
+static bool slab_cpu_reload_empty(struct slab_list_t* sl, struct slab_cpu_t* c)
+{
+    spinlock_lock(&sl->depot_lock);
+    bool depot_full = sl->num_full >= SLAB_DEPOT_MAGS;
+    struct slab_mag_t* m = NULL;
+    if (!depot_full || !c->prev) {
+        m = slab_mag_pop(&sl->empty_mags);
+        if (m)
+            --sl->num_empty;
+    }
+    spinlock_unlock(&sl->depot_lock);
+
+    // enough full ones parked already, prev goes back
+    // to the slabs and comes back empty
+    if (depot_full && c->prev) {
+        m = c->prev;
+        c->prev = NULL;
+        slab_mag_drain(sl, m);
+    }
+
+    if (!m) {
+        m = (struct slab_mag_t*)slab_list_alloc(sl->sl_mag);
+        if (!m)
+            return false;
+        m->rounds = 0;
+    }
+
+    if (c->prev) {
+        spinlock_lock(&sl->depot_lock);
+        slab_mag_push(&sl->full_mags, c->prev);
+        ++sl->num_full;
+        spinlock_unlock(&sl->depot_lock);
+    }
+
+    c->prev = c->loaded;
+    c->loaded = m;
+    return true;
+}
+
+static void* slab_cpu_alloc(struct slab_list_t* sl, struct slab_cpu_t* c)
+{
+    while (1) {
+        struct slab_mag_t* m = c->loaded;
+        if (!slab_mag_empty(m))
+            return m->objs[--m->rounds];
+
+        if (!slab_mag_empty(c->prev)) {
+            c->loaded = c->prev;
+            c->prev = m;
+            continue;
+        }
+
+        if (!slab_cpu_reload_full(sl, c))
+            return NULL;
+    }
+}
+
+static bool slab_cpu_free(struct slab_list_t* sl, struct slab_cpu_t* c, void* addr)
+{
+    while (1) {
+        struct slab_mag_t* m = c->loaded;
+        if (m && m->rounds < SLAB_MAG_ROUNDS) {
+            m->objs[m->rounds++] = addr;
+            return true;
+        }
+
+        if (c->prev && !slab_mag_full(c->prev)) {
+            c->loaded = c->prev;
+            c->prev = m;
+            continue;
+        }
+
+        if (!slab_cpu_reload_empty(sl, c))
+            return false;
+    }
+}
+
+void* slab_list_alloc(struct slab_list_t* sl)
+{
+    if (sl->sl_mag && slab_mag_enabled) {
+        int s = cpu_splhi();
+        void* addr = slab_cpu_alloc(sl, &sl->cpu[get_cpu_id()]);
+        cpu_splx(s);
+        if (addr)
+            return addr;
+    }
+
+    return slab_list_alloc_slow(sl);
+}
+
+void slab_list_free(struct slab_list_t* sl, void* addr)
+{
+    if (sl->sl_mag && slab_mag_enabled) {
+        int s = cpu_splhi();
+        bool cached = slab_cpu_free(sl, &sl->cpu[get_cpu_id()], addr);
+        cpu_splx(s);
+        if (cached)
+            return;
+    }
+
+    slab_list_free_slow(sl, addr);
+}
+
+// return everything parked in the depot to the slabs,
+// per-cpu magazines stay loaded
+void slab_list_reap(struct slab_list_t* sl)
+{
+    int s = cpu_splhi();
+    spinlock_lock(&sl->depot_lock);
+    struct slab_mag_t* full = sl->full_mags;
+    struct slab_mag_t* empty = sl->empty_mags;
+    sl->full_mags = NULL;
+    sl->empty_mags = NULL;
+    sl->num_full = 0;
+    sl->num_empty = 0;
+    spinlock_unlock(&sl->depot_lock);
+    cpu_splx(s);
+
+    struct slab_mag_t* m;
+    while ((m = slab_mag_pop(&full)) != NULL) {
+        slab_mag_drain(sl, m);
+        slab_list_free(sl->sl_mag, m);
+    }
+    while ((m = slab_mag_pop(&empty)) != NULL)
+        slab_list_free(sl->sl_mag, m);
+}
+
+// slab list an object was allocated from, NULL if the
+// address is not slab memory
+struct slab_list_t* slab_list_find(void* addr)
+{
+    struct page_desc_t* desc = sys_page_desc((uintptr_t)addr);
+    if (!(desc->flags & PGF_KMEM_SLAB))
+        return NULL;
+
+    struct slab_list_t* sl = desc->slab_list;
+    if (sl->flags & SLAB_LIST_NESTED) {
+        uintptr_t mask = (uintptr_t)sl->chunk_size - 1;
+        struct slab_t* s = (struct slab_t*)((uintptr_t)addr & ~mask);
+        sl = s->sl;
+    }
+
+    return sl;
 }
 
 void slab_list_dump(struct slab_list_t* sl)
 {
     printf("slab_list: %016lx\n", (uintptr_t)sl);
     printf("\tsl_owner: %016lx\n", (uintptr_t)sl->sl_owner);
-    printf("\tchunk_size: %08x\n", 1 << sl->chunk_shift);
+    printf("\tchunk_size: %08x\n", sl->chunk_size);
     printf("\t      size: %08x\n", 1 << sl->size_shift);
+    if (sl->sl_mag)
+        printf("\tdepot: full %d empty %d\n", sl->num_full, sl->num_empty);
     printf("\tfree_slabs:\n");
     struct slab_t* s = sl->free_slabs;
     while (s) {
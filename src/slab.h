@@ -3,17 +3,46 @@
 
 #include "types.h"
 #include "spinlock.h"
+#include "cpu.h"
 
 struct slab_t;
 
+// magazine, a stack of cached objects (bonwick)
+#define SLAB_MAG_ROUNDS     30
+#define SLAB_DEPOT_MAGS     16      // full and empty ones parked, each
+
+struct slab_mag_t {
+    struct slab_mag_t* next;
+    uint32_t rounds;
+    uint32_t reserved;
+    void* objs[SLAB_MAG_ROUNDS];
+};
+
+// per-cpu magazine pair, only touched by its cpu at splhi
+struct slab_cpu_t {
+    struct slab_mag_t* loaded;
+    struct slab_mag_t* prev;
+} __attribute__((aligned(64)));
+
+#define SLAB_LIST_NESTED    0x1     // chunks are slabs of other lists
+
 struct slab_list_t {
     struct slab_list_t* sl_owner;
     struct slab_t* free_slabs;
     struct slab_t* used_slabs;
     uint32_t size_shift;
-    uint32_t chunk_shift;
+    uint32_t chunk_size;
     uint32_t flags;
-    struct spinlock_t lock;
+    struct mcs_lock_t lock;
+
+    // magazine layer, sl_mag is NULL when disabled
+    struct slab_list_t* sl_mag;
+    struct spinlock_t depot_lock;
+    struct slab_mag_t* full_mags;
+    struct slab_mag_t* empty_mags;
+    uint32_t num_full;
+    uint32_t num_empty;
+    struct slab_cpu_t cpu[MAX_CPUS];
 };
 
 bool slab_list_init(struct slab_list_t* sl,
@@ -21,9 +50,13 @@ bool slab_list_init(struct slab_list_t* sl,
                     uint32_t size,
                     uint32_t chunk_size);
 bool slab_list_reserve_on_slack(struct slab_list_t* sl);
+void slab_list_set_magazines(struct slab_list_t* sl, struct slab_list_t* sl_mag);
+void slab_list_reap(struct slab_list_t* sl);
+void slab_enable_magazines(void);
 void* slab_list_alloc(struct slab_list_t* sl);
 void slab_list_free(struct slab_list_t* sl, void* addr);
 void slab_list_dump(struct slab_list_t* sl);
+struct slab_list_t* slab_list_find(void* addr);
 
 static inline uint32_t ceil_pow2(uint32_t x)
 {
@@ -3,10 +3,20 @@
 
 #include "x86.h"
 
+// ticket lock, fifo fair, waiters back off in proportion
+// to how far they are from the head of the line
 struct spinlock_t {
-    volatile uint32_t counter;
+    union {
+        volatile uint32_t counter;
+        struct {
+            volatile uint16_t owner;    // ticket being served
+            volatile uint16_t next;     // next ticket to hand out
+        };
+    };
 };
 
+#define SPINLOCK_TICKET     0x10000
+
 static inline void spinlock_init(struct spinlock_t* lock)
 {
     lock->counter = 0;
@@ -14,12 +24,37 @@ static inline void spinlock_init(struct spinlock_t* lock)
 
 static inline void spinlock_lock(struct spinlock_t* lock)
 {
-    do {} while(compare_and_swap_32(&lock->counter, 0, 1) != 0);
+    uint32_t val = fetch_and_add_32((uint32_t*)&lock->counter, SPINLOCK_TICKET);
+    uint16_t ticket = (uint16_t)(val >> 16);
+    uint16_t owner = (uint16_t)val;
+    while (owner != ticket) {
+        uint16_t n = ticket - owner;
+        while (n--)
+            cpu_pause();
+        owner = lock->owner;
+    }
+    barrier();
 }
 
+static inline bool spinlock_trylock(struct spinlock_t* lock)
+{
+    uint32_t val = lock->counter;
+    if ((uint16_t)val != (uint16_t)(val >> 16))
+        return false;
+    return compare_and_swap_32(&lock->counter, val, val + SPINLOCK_TICKET) == val;
+}
+
+// only the holder writes owner, plain store releases on x86
 static inline void spinlock_unlock(struct spinlock_t* lock)
 {
-    compare_and_swap_32(&lock->counter, 1, 0);
+    barrier();
+    lock->owner = lock->owner + 1;
+}
+
+static inline bool spinlock_is_locked(struct spinlock_t* lock)
+{
+    uint32_t val = lock->counter;
+    return (uint16_t)val != (uint16_t)(val >> 16);
 }
 
 static inline int spinlock_lock_splhi(struct spinlock_t* lock)
@@ -35,4 +70,92 @@ static inline void spinlock_unlock_splx(struct spinlock_t* lock, int s)
     cpu_splx(s);
 }
 
+// MCS queue lock for heavily contended locks, every waiter
+// spins on its own node (usually on the stack) instead of
+// the shared lock word
+struct mcs_node_t {
+    struct mcs_node_t* volatile next;
+    volatile uint32_t locked;
+};
+
+struct mcs_lock_t {
+    struct mcs_node_t* volatile tail;
+};
+
+static inline void mcs_lock_init(struct mcs_lock_t* lock)
+{
+    lock->tail = NULL;
+}
+
+static inline void mcs_lock(struct mcs_lock_t* lock, struct mcs_node_t* node)
+{
+    node->next = NULL;
+    node->locked = 1;
+
+    struct mcs_node_t* prev =
+        (struct mcs_node_t*)atomic_swap_64((uint64_t*)&lock->tail, (uint64_t)node);
+    if (prev) {
+        prev->next = node;
+        while (node->locked)
+            cpu_pause();
+    }
+    barrier();
+}
+
+static inline bool mcs_trylock(struct mcs_lock_t* lock, struct mcs_node_t* node)
+{
+    node->next = NULL;
+    node->locked = 0;
+    return compare_and_swap_64((uint64_t*)&lock->tail, 0, (uint64_t)node) == 0;
+}
+
+static inline void mcs_unlock(struct mcs_lock_t* lock, struct mcs_node_t* node)
+{
+    barrier();
+    if (!node->next) {
+        if (compare_and_swap_64((uint64_t*)&lock->tail, (uint64_t)node, 0) == (uint64_t)node)
+            return;
+        // successor is about to link itself
+        while (!node->next)
+            cpu_pause();
+    }
+    node->next->locked = 0;
+}
+
+// same api as spinlock_t, nodes come from the cpu taking the lock.
+// at splhi nothing else on the cpu wants one, short of taking
+// another mcs lock while holding this one, up to MCS_CPU_NODES deep
+#define MCS_CPU_NODES   4
+
+struct mcs_cpu_nodes_t {
+    struct mcs_node_t nodes[MCS_CPU_NODES];
+    struct mcs_lock_t* locks[MCS_CPU_NODES];    // held with nodes[i]
+};
+
+// this cpu's, see cpu.c
+struct mcs_cpu_nodes_t* mcs_cpu_nodes(void);
+
+static inline int mcs_lock_splhi(struct mcs_lock_t* lock)
+{
+    int s = cpu_splhi();
+    struct mcs_cpu_nodes_t* cn = mcs_cpu_nodes();
+    uint32_t i = 0;
+    while (cn->locks[i])
+        ++i;
+    cn->locks[i] = lock;
+    mcs_lock(lock, &cn->nodes[i]);
+    return s;
+}
+
+static inline void mcs_unlock_splx(struct mcs_lock_t* lock, int s)
+{
+    struct mcs_cpu_nodes_t* cn = mcs_cpu_nodes();
+    uint32_t i = 0;
+    while (cn->locks[i] != lock)
+        ++i;
+    mcs_unlock(lock, &cn->nodes[i]);
+    cn->locks[i] = NULL;
+    cpu_splx(s);
+}
+
 #endif // KERNEL_SPINLOCK_H
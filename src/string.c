@@ -1,5 +1,6 @@
 #include "types.h"
 #include "string.h"
+#include "x86.h"
 
 size_t strlen(const char* p)
 {
@@ -43,3 +44,174 @@ const char* c_strncpy(char* dst, const char* src, size_t len)
     dst[len] = 0;
     return dst;
 }
+
+// memory ops
+//
+// rep movsb/stosb is the fastest for most sizes where the cpu says
+// so (ERMS), short ones included with FSRM. without them rep movsq
+// does the bulk and short runs are done a qword at a time. huge ones
+// are written with movnti so they don't wipe out the caches
+
+static struct {
+    bool erms;      // enhanced rep movsb/stosb
+    bool fsrm;      // fast short rep movsb
+} mem_cpu;
+
+#define MEM_SHORT   128 // below this rep startup dominates without FSRM
+
+void mem_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        mem_cpu.erms = (ebx & CPUID_7_EBX_ERMS) != 0;
+        mem_cpu.fsrm = (edx & CPUID_7_EDX_FSRM) != 0;
+    }
+}
+
+void mem_copy_movsb(void* dst, const void* src, size_t size)
+{
+    asm volatile(
+        "rep movsb"
+        : "+D"(dst), "+S"(src), "+c"(size)
+        :
+        : "memory"
+    );
+}
+
+void mem_copy_movsq(void* dst, const void* src, size_t size)
+{
+    size_t tail = size & 7;
+    size >>= 3;
+    asm volatile(
+        "rep movsq\n\t"
+        "movq %3, %%rcx\n\t"
+        "rep movsb"
+        : "+D"(dst), "+S"(src), "+c"(size)
+        : "r"(tail)
+        : "memory"
+    );
+}
+
+// destination aligned by a short byte copy, then 32 bytes a round
+void mem_copy_nt(void* dst, const void* src, size_t size)
+{
+    size_t head = -(uintptr_t)dst & 7;
+    if (head > size)
+        head = size;
+    mem_copy_movsb(dst, src, head);
+
+    uint8_t* d = (uint8_t*)dst + head;
+    const uint8_t* s = (const uint8_t*)src + head;
+    size -= head;
+    for (size_t n = size/32; n; --n) {
+        const uint64_t* q = (const uint64_t*)s;
+        uint64_t a = q[0], b = q[1], c = q[2], e = q[3];
+        asm volatile(
+            "prefetchnta 512(%5)\n\t"
+            "movnti %1, 0(%0)\n\t"
+            "movnti %2, 8(%0)\n\t"
+            "movnti %3, 16(%0)\n\t"
+            "movnti %4, 24(%0)"
+            :
+            : "r"(d), "r"(a), "r"(b), "r"(c), "r"(e), "r"(s)
+            : "memory"
+        );
+        d += 32;
+        s += 32;
+    }
+    mem_copy_movsb(d, s, size & 31);
+    asm volatile("sfence" ::: "memory");
+}
+
+void mem_set_stosb(void* dst, int c, size_t size)
+{
+    asm volatile(
+        "rep stosb"
+        : "+D"(dst), "+c"(size)
+        : "a"(c)
+        : "memory"
+    );
+}
+
+void mem_set_stosq(void* dst, int c, size_t size)
+{
+    uint64_t v = 0x0101010101010101UL * (uint8_t)c;
+    size_t tail = size & 7;
+    size >>= 3;
+    asm volatile(
+        "rep stosq\n\t"
+        "movq %2, %%rcx\n\t"
+        "rep stosb"
+        : "+D"(dst), "+c"(size)
+        : "r"(tail), "a"(v)
+        : "memory"
+    );
+}
+
+void mem_set_nt(void* dst, int c, size_t size)
+{
+    uint64_t v = 0x0101010101010101UL * (uint8_t)c;
+    size_t head = -(uintptr_t)dst & 7;
+    if (head > size)
+        head = size;
+    mem_set_stosb(dst, c, head);
+
+    uint8_t* d = (uint8_t*)dst + head;
+    size -= head;
+    for (size_t n = size/32; n; --n) {
+        asm volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)"
+            :
+            : "r"(d), "r"(v)
+            : "memory"
+        );
+        d += 32;
+    }
+    mem_set_stosb(d, c, size & 31);
+    asm volatile("sfence" ::: "memory");
+}
+
+static inline void mem_copy_short(void* dst, const void* src, size_t size)
+{
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (; size >= 8; size -= 8, d += 8, s += 8)
+        *(uint64_t*)d = *(const uint64_t*)s;
+    while (size--)
+        *d++ = *s++;
+}
+
+void mem_copy(void* dst, const void* src, size_t size)
+{
+    if (size >= MEM_NT_THRESHOLD)
+        mem_copy_nt(dst, src, size);
+    else if (size < MEM_SHORT && !mem_cpu.fsrm)
+        mem_copy_short(dst, src, size);
+    else if (mem_cpu.erms)
+        mem_copy_movsb(dst, src, size);
+    else
+        mem_copy_movsq(dst, src, size);
+}
+
+void mem_set(void* dst, int c, size_t size)
+{
+    if (size >= MEM_NT_THRESHOLD) {
+        mem_set_nt(dst, c, size);
+    } else if (size < MEM_SHORT && !mem_cpu.fsrm) {
+        uint8_t* d = (uint8_t*)dst;
+        uint64_t v = 0x0101010101010101UL * (uint8_t)c;
+        for (; size >= 8; size -= 8, d += 8)
+            *(uint64_t*)d = v;
+        while (size--)
+            *d++ = (uint8_t)c;
+    } else if (mem_cpu.erms) {
+        mem_set_stosb(dst, c, size);
+    } else {
+        mem_set_stosq(dst, c, size);
+    }
+}
@@ -9,14 +9,50 @@ size_t strlen(const char* p);
 int strcmp(const char* s1, const char* s2);
 char* strcpy(char* dest, const char* src);
 
+// memory ops, the variant is picked per call from the size and what
+// mem_init found in cpuid. copies and fills of MEM_NT_THRESHOLD or
+// more go around the caches. no vector registers, these run in
+// interrupt handlers too where fpu sections are not allowed
+#define MEM_NT_THRESHOLD    (1024 * 1024)
+
+void mem_init(void);
+void mem_copy(void* dst, const void* src, size_t size);
+void mem_set(void* dst, int c, size_t size);
+
+// the variants, for benchmarks
+void mem_copy_movsb(void* dst, const void* src, size_t size);
+void mem_copy_movsq(void* dst, const void* src, size_t size);
+void mem_copy_nt(void* dst, const void* src, size_t size);
+void mem_set_stosb(void* dst, int c, size_t size);
+void mem_set_stosq(void* dst, int c, size_t size);
+void mem_set_nt(void* dst, int c, size_t size);
+
+// small constant sizes stay inline as plain moves
 static inline void* memcpy(void* dst, const void* src, size_t size)
 {
-    asm volatile(
-        "cld; rep movsb" 
-        :: "S"(src), "D"(dst), "c"(size) 
-        : "flags", "memory"
-    );
+    if (__builtin_constant_p(size) && size <= 32 && !(size & 7)) {
+        uint64_t* d = (uint64_t*)dst;
+        const uint64_t* s = (const uint64_t*)src;
+        for (size_t i = 0; i < size/8; ++i)
+            d[i] = s[i];
+        return dst;
+    }
+
+    mem_copy(dst, src, size);
+    return dst;
+}
+
+static inline void* memset(void* dst, int c, size_t size)
+{
+    if (__builtin_constant_p(size) && size <= 32 && !(size & 7)) {
+        uint64_t* d = (uint64_t*)dst;
+        uint64_t v = 0x0101010101010101UL * (uint8_t)c;
+        for (size_t i = 0; i < size/8; ++i)
+            d[i] = v;
+        return dst;
+    }
 
+    mem_set(dst, c, size);
     return dst;
 }
 
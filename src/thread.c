@@ -1,9 +1,15 @@
 #include "thread.h"
 #include "kernel.h"
 #include "cpu.h"
-#include "list.h"
+#include "sched.h"
 #include "stdio.h"
+#include "string.h"
 #include "kmalloc.h"
+#include "vm_buddy.h"
+#include "vm_hat.h"
+#include "vm_mmap.h"
+#include "vm_page.h"
+#include "x86.h"
 
 struct switch_context_t {
     uint64_t r15;
@@ -19,6 +25,195 @@ struct switch_context_t {
 
 static struct slab_list_t* thread_sl;
 
+// exit and join
+//
+// an exiting thread can't release the stack it runs on, it goes on
+// its cpu's zombie list and sched_tick hands stacks and thread_t
+// slots to the per cpu hot caches later. what doesn't fit there may
+// need an unmap or a slab free, that is left for the idle loop or
+// the next thread_create on the cpu. the thread_t stays until it is
+// both reaped and joined (or detached), whichever comes last frees it
+
+static struct spinlock_t join_lock;     // joiner and exited handoff
+
+static struct {
+    uint32_t exited;
+    uint32_t reaped;
+    uint32_t reaped_hot;    // from sched_tick
+} thread_stats;
+
+// thread stacks
+//
+// stacks live in a region of kernel_mmap reserved at init, each in
+// a slot of its size plus an unmapped guard page below it. running
+// into the guard faults, and with the fault frame having nowhere to
+// go either that ends up as a double fault on its own stack. sizes
+// are powers of two backed by one buddy block. freed stacks stay
+// mapped in a small per cpu cache, then on a global list per size,
+// past that they are unmapped and only the slot is kept
+
+#define THREAD_STACK_REGION     (16UL << 30)
+#define THREAD_STACK_MIN_ORDER  2   // 16K, interrupt frames land here too
+#define THREAD_STACK_MAX_ORDER  BUDDY_MAX_ORDER
+#define THREAD_STACK_ORDERS     (THREAD_STACK_MAX_ORDER + 1)
+#define THREAD_STACK_CACHE      4   // per cpu and size
+#define THREAD_STACK_FREE       16  // mapped ones kept globally per size
+
+struct thread_stack_t {
+    struct thread_stack_t* next;
+    uintptr_t base;         // lowest address, guard page below
+    uintptr_t block;        // buddy block behind it, 0 while unmapped
+    uint32_t order;         // 4K pages
+};
+
+#define THREAD_CACHE            16  // thread_t slots per cpu
+
+// hot stacks and thread_t slots, each cpu touches its own at splhi
+static struct {
+    struct thread_stack_t* stacks[THREAD_STACK_ORDERS];
+    uint32_t num_stacks[THREAD_STACK_ORDERS];
+    struct thread_t* threads;   // through next, fpu_state kept
+    uint32_t num_threads;
+} __attribute__((aligned(64))) thread_cache[MAX_CPUS];
+
+static struct {
+    struct spinlock_t lock;
+    struct thread_stack_t* free[THREAD_STACK_ORDERS];   // mapped
+    struct thread_stack_t* vacant[THREAD_STACK_ORDERS]; // slot only
+    uint32_t num_free[THREAD_STACK_ORDERS];
+    uintptr_t start;
+    uintptr_t next;         // slots are never given back to the region
+    uintptr_t end;
+    struct slab_list_t* sl;
+} stacks;
+
+static uint32_t thread_stack_order(uint32_t stack_size)
+{
+    uint32_t order = THREAD_STACK_MIN_ORDER;
+    while (order < THREAD_STACK_MAX_ORDER && (PAGE_4K_SIZE << order) < stack_size)
+        ++order;
+    return order;
+}
+
+static inline uint64_t thread_stack_size(struct thread_stack_t* st)
+{
+    return PAGE_4K_SIZE << st->order;
+}
+
+// a slot, mapped or not
+static struct thread_stack_t* thread_stack_slot(uint32_t order)
+{
+    struct thread_stack_t* spare = (struct thread_stack_t*)slab_list_alloc(stacks.sl);
+    if (!spare)
+        return NULL;
+
+    int s = spinlock_lock_splhi(&stacks.lock);
+    struct thread_stack_t* st = stacks.free[order];
+    if (st) {
+        stacks.free[order] = st->next;
+        stacks.num_free[order]--;
+    } else if ((st = stacks.vacant[order])) {
+        stacks.vacant[order] = st->next;
+    } else {
+        uint64_t slot = PAGE_4K_SIZE + (PAGE_4K_SIZE << order);
+        if (stacks.next + slot <= stacks.end) {
+            st = spare;
+            spare = NULL;
+            st->base = stacks.next + PAGE_4K_SIZE;
+            st->block = 0;
+            st->order = order;
+            stacks.next += slot;
+        }
+    }
+    spinlock_unlock_splx(&stacks.lock, s);
+
+    if (spare)
+        slab_list_free(stacks.sl, spare);
+    return st;
+}
+
+static struct thread_stack_t* thread_stack_alloc(uint32_t order)
+{
+    int s = cpu_splhi();
+    uint32_t cpu_id = get_cpu_id();
+    struct thread_stack_t* st = thread_cache[cpu_id].stacks[order];
+    if (st) {
+        thread_cache[cpu_id].stacks[order] = st->next;
+        thread_cache[cpu_id].num_stacks[order]--;
+    }
+    cpu_splx(s);
+    if (st)
+        return st;
+
+    st = thread_stack_slot(order);
+    if (!st || st->block)
+        return st;
+
+    uintptr_t block = buddy_alloc(order);
+    if (block && vm_hat_map(&kernel_hat, NULL, st->base, kernel_vaddr_phys(block),
+                            thread_stack_size(st), HAT_WRITE)) {
+        st->block = block;
+        return st;
+    }
+
+    if (block)
+        buddy_free(block);
+    s = spinlock_lock_splhi(&stacks.lock);
+    st->next = stacks.vacant[order];
+    stacks.vacant[order] = st;
+    spinlock_unlock_splx(&stacks.lock, s);
+    return NULL;
+}
+
+// at splhi
+static bool thread_stack_cache(uint32_t cpu_id, struct thread_stack_t* st)
+{
+    uint32_t order = st->order;
+    if (thread_cache[cpu_id].num_stacks[order] >= THREAD_STACK_CACHE)
+        return false;
+    st->next = thread_cache[cpu_id].stacks[order];
+    thread_cache[cpu_id].stacks[order] = st;
+    thread_cache[cpu_id].num_stacks[order]++;
+    return true;
+}
+
+void thread_stack_free(struct thread_stack_t* st)
+{
+    uint32_t order = st->order;
+    int s = cpu_splhi();
+    bool cached = thread_stack_cache(get_cpu_id(), st);
+    cpu_splx(s);
+    if (cached)
+        return;
+
+    s = spinlock_lock_splhi(&stacks.lock);
+    bool kept = stacks.num_free[order] < THREAD_STACK_FREE;
+    if (kept) {
+        st->next = stacks.free[order];
+        stacks.free[order] = st;
+        stacks.num_free[order]++;
+    }
+    spinlock_unlock_splx(&stacks.lock, s);
+    if (kept)
+        return;
+
+    // no lock across the unmap, it shoots down other cpus
+    vm_hat_unmap(&kernel_hat, NULL, st->base, thread_stack_size(st));
+    buddy_free(st->block);
+    st->block = 0;
+
+    s = spinlock_lock_splhi(&stacks.lock);
+    st->next = stacks.vacant[order];
+    stacks.vacant[order] = st;
+    spinlock_unlock_splx(&stacks.lock, s);
+}
+
+// a fault in the region can only be a guard page
+bool thread_stack_fault(uintptr_t addr)
+{
+    return addr >= stacks.start && addr < stacks.end;
+}
+
 extern void _isr_ret(void);
 
 static void thread_start()
@@ -26,32 +221,170 @@ static void thread_start()
     cpu_unlock(get_cpu());
 }
 
+// entry function returned, its ret left rsp 16 byte aligned
+__attribute__((force_align_arg_pointer))
+static void thread_return()
+{
+    thread_exit(0);
+}
+
 void thread_init()
 {
     thread_sl = kmalloc_get_slab(sizeof(struct thread_t));
+    spinlock_init(&join_lock);
+
+    spinlock_init(&stacks.lock);
+    stacks.sl = kmalloc_get_slab(sizeof(struct thread_stack_t));
+    stacks.start = vm_mmap(&kernel_mmap, NULL, 0, THREAD_STACK_REGION, 0);
+    check(stacks.start);
+    stacks.next = stacks.start;
+    stacks.end = stacks.start + THREAD_STACK_REGION;
+}
+
+// at splhi
+static bool thread_cache_put(uint32_t cpu_id, struct thread_t* t)
+{
+    if (thread_cache[cpu_id].num_threads >= THREAD_CACHE)
+        return false;
+    t->next = thread_cache[cpu_id].threads;
+    thread_cache[cpu_id].threads = t;
+    thread_cache[cpu_id].num_threads++;
+    return true;
 }
 
 static struct thread_t* thread_alloc()
 {
-    struct thread_t* t = (struct thread_t*)slab_list_alloc(thread_sl);
+    int s = cpu_splhi();
+    uint32_t cpu_id = get_cpu_id();
+    struct thread_t* t = thread_cache[cpu_id].threads;
+    if (t) {
+        thread_cache[cpu_id].threads = t->next;
+        thread_cache[cpu_id].num_threads--;
+    }
+    cpu_splx(s);
+    if (t)
+        return t;
+
+    t = (struct thread_t*)slab_list_alloc(thread_sl);
+    if (t)
+        t->fpu_state = NULL;
     return t;
 }
 
+static void thread_free(struct thread_t* t)
+{
+    int s = cpu_splhi();
+    bool cached = thread_cache_put(get_cpu_id(), t);
+    cpu_splx(s);
+    if (cached)
+        return;
+
+    if (t->fpu_state)
+        kfree(t->fpu_state);
+    slab_list_free(thread_sl, t);
+}
+
+// true for whoever completes detached and reaped, the thread_t is
+// theirs to free
+static bool thread_join_set(struct thread_t* t, uint32_t bit)
+{
+    const uint32_t done = THREAD_JOIN_DETACHED | THREAD_JOIN_REAPED;
+    uint32_t join;
+    do {
+        join = t->join;
+        check(!(join & bit));
+    } while (compare_and_swap_32(&t->join, join, join | bit) != join);
+    return ((join | bit) & done) == done;
+}
+
+// everything on this cpu's zombie list, no locks held
+static void thread_reap()
+{
+    struct cpu_desc_t* cpu = cpu_lock_splhi();
+    struct thread_t* t = cpu->zombies.head;
+    thread_list_init(&cpu->zombies);
+    cpu_unlock_splx(cpu);
+
+    while (t) {
+        struct thread_t* next = t->next_wait;
+        bool last = true;
+        if (t->stack_area) {
+            thread_stack_free(t->stack_area);
+            t->stack_area = NULL;
+            fetch_and_add_32(&thread_stats.reaped, 1);
+            last = thread_join_set(t, THREAD_JOIN_REAPED);
+        }
+        if (last)
+            thread_free(t);
+        t = next;
+    }
+}
+
+// sched_tick, cpu locked. only what fits the hot caches, the rest
+// stays for thread_reap
+void thread_reap_locked(struct cpu_desc_t* cpu)
+{
+    struct thread_list_t left;
+    thread_list_init(&left);
+
+    struct thread_t* t;
+    while ((t = thread_list_pop(&cpu->zombies)) != NULL) {
+        if (t->stack_area) {
+            if (!thread_stack_cache(cpu->apic_id, t->stack_area)) {
+                thread_list_push(&left, t);
+                continue;
+            }
+            t->stack_area = NULL;
+            fetch_and_add_32(&thread_stats.reaped_hot, 1);
+            if (!thread_join_set(t, THREAD_JOIN_REAPED))
+                continue;
+        }
+        if (!thread_cache_put(cpu->apic_id, t))
+            thread_list_push(&left, t);
+    }
+
+    cpu->zombies = left;
+}
+
+// idle loop, interrupts off
+void thread_reap_idle()
+{
+    if (thread_list_empty(&get_cpu()->zombies))
+        return;
+
+    cpu_enable_interrupts();
+    thread_reap();
+    cpu_disable_interrupts();
+}
+
 struct thread_t* thread_create(thread_entry_fn entry_fn,
                                uint32_t stack_size,
                                uint32_t cpu_id)
 {
-    // FIXME:
-    stack_size = KMALLOC_CHUNK_SIZE;
+    // last round of exits here may still hold stacks. sched_tick
+    // reaps the same list, thread_reap takes it under the cpu lock
+    thread_reap();
+
+    struct thread_stack_t* st = thread_stack_alloc(thread_stack_order(stack_size));
+    if (!st)
+        return NULL;
 
     struct thread_t* thread = thread_alloc();
-    //uintptr_t stack = kernel_slack_alloc(stack_size, stack_size);
-    uintptr_t stack = (uintptr_t)kmalloc_alloc();
-    uintptr_t stack_top = stack + stack_size;
+    if (!thread) {
+        thread_stack_free(st);
+        return NULL;
+    }
+    uintptr_t stack_top = st->base + thread_stack_size(st);
 
     //printf("thread_create(): %016lx\n", stack);
 
+    // entry_fn returns to thread_return, pushed where a call would
+    // have put it so it starts with rsp 8 off a 16 byte boundary
     uint8_t* sp = (uint8_t*)stack_top;
+    sp -= sizeof(uintptr_t);
+    *(uintptr_t*)sp = (uintptr_t)thread_return;
+    uintptr_t entry_sp = (uintptr_t)sp;
+
     sp -= sizeof(struct isr_frame_t);
     struct isr_frame_t* frame = (struct isr_frame_t*)sp;
 
@@ -68,7 +401,7 @@ struct thread_t* thread_create(thread_entry_fn entry_fn,
     frame->rip = (uintptr_t)entry_fn;
     frame->cs = 0x08;
     frame->rflags = RFLAGS_IF;
-    frame->rsp = (uintptr_t)stack_top;
+    frame->rsp = entry_sp;
     frame->ss = 0x10;
 
     sp -= sizeof(uintptr_t);
@@ -89,12 +422,24 @@ struct thread_t* thread_create(thread_entry_fn entry_fn,
 
     thread->next = NULL;
     thread->prev = NULL;
+    thread->run_next = NULL;
+    thread->run_prev = NULL;
     thread->next_wait = NULL;
+    thread->joiner = NULL;
+    thread->queue = NULL;
+    thread->hat = NULL;
     thread->stack = stack_top;
+    thread->stack_area = st;
     thread->ticks = 0;
+    thread->last_run = 0;
+    timer_init(&thread->sleep_timer, sched_sleep_timeout, thread);
+    thread->cpu_mask = THREAD_CPU_MASK_ALL;
     thread->state = THREAD_STATE_RUNNING;
-    thread->sleep_time = 0;
     thread->flags = 0;
+    thread->fpu_depth = 0;
+    thread->intr_depth = 0;
+    thread->join = 0;
+    thread->exit_code = 0;
     thread->pri = THREAD_DEFAULT_PRI;
     thread->cnt = THREAD_DEFAULT_PRI;
 
@@ -106,7 +451,7 @@ struct thread_t* thread_create(thread_entry_fn entry_fn,
     uint32_t id = ++cpu->id_cnt;
     thread->id = id;
     thread->cpu_id = cpu->apic_id;
-    queue_push_back(cpu->threads, thread, next, prev);
+    sched_add_locked(cpu, thread);
 
     if (this_cpu_id == cpu_id)
         cpu_unlock_splx(cpu);
@@ -116,17 +461,140 @@ struct thread_t* thread_create(thread_entry_fn entry_fn,
     return thread;
 }
 
+// lock cpu the thread is on, it may be migrating
+static struct cpu_desc_t* thread_lock_cpu(struct thread_t* thread)
+{
+    while (1) {
+        uint32_t cpu_id = thread->cpu_id;
+        struct cpu_desc_t* cpu = cpu_lock_smp(cpu_id);
+        if (thread->cpu_id == cpu_id)
+            return cpu;
+        cpu_unlock_smp(cpu);
+    }
+}
+
 void thread_wakeup(struct thread_t* thread)
 {
-    const bool this_cpu = get_cpu_id() == thread->cpu_id;
-    struct cpu_desc_t* cpu = this_cpu
-                           ? cpu_lock_splhi()
-                           : cpu_lock_id(thread->cpu_id);
+    struct cpu_desc_t* cpu = thread_lock_cpu(thread);
+    sched_wakeup_locked(cpu, thread);
+    cpu_unlock_smp(cpu);
+}
 
-    thread->state = THREAD_STATE_RUNNING;
+// takes effect next time the balancer looks at it
+void thread_set_affinity(struct thread_t* thread, uint32_t cpu_mask)
+{
+    struct cpu_desc_t* cpu = thread_lock_cpu(thread);
+    thread->cpu_mask = cpu_mask;
+    cpu_unlock_smp(cpu);
+}
 
-    if (this_cpu)
-        cpu_unlock_splx(cpu);
-    else
+// never returns, the thread_t stays for thread_join unless detached
+void thread_exit(int code)
+{
+    cpu_splhi();
+    struct thread_t* t = get_cpu()->cur_thread;
+    check(!t->fpu_depth);
+
+    spinlock_lock(&join_lock);
+    t->exit_code = code;
+    thread_join_set(t, THREAD_JOIN_EXITED);
+    struct thread_t* joiner = t->joiner;
+    if (joiner) {
+        struct cpu_desc_t* cpu = cpu_lock_id(joiner->cpu_id);
+        sched_wakeup_locked(cpu, joiner);
         cpu_unlock(cpu);
+    }
+    spinlock_unlock(&join_lock);
+
+    fetch_and_add_32(&thread_stats.exited, 1);
+    sched_exit_locked(cpu_lock());
+    kernel_panic("thread_exit(): back from the dead");
+    while (1);
+}
+
+// one joiner per thread, the thread_t is gone after this
+int thread_join(struct thread_t* thread)
+{
+    int s = cpu_splhi();
+    spinlock_lock(&join_lock);
+    while (!(thread->join & THREAD_JOIN_EXITED)) {
+        struct cpu_desc_t* cpu = cpu_lock();
+        check(thread != cpu->cur_thread && !(thread->join & THREAD_JOIN_DETACHED));
+        thread->joiner = cpu->cur_thread;
+        spinlock_unlock(&join_lock);
+
+        sched_yield_locked(cpu);
+
+        cpu_unlock(cpu);
+        spinlock_lock(&join_lock);
+    }
+    int code = thread->exit_code;
+    spinlock_unlock(&join_lock);
+    cpu_splx(s);
+
+    if (thread_join_set(thread, THREAD_JOIN_DETACHED))
+        thread_free(thread);
+    return code;
+}
+
+// nobody will join, it goes away by itself once it exits
+void thread_detach(struct thread_t* thread)
+{
+    if (thread_join_set(thread, THREAD_JOIN_DETACHED))
+        thread_free(thread);
+}
+
+// create and join short lived threads round robin over the cpus
+
+#define THREAD_TEST_NUM     64
+#define THREAD_TEST_ROUNDS  4   // the first one starts cold
+
+static uint32_t thread_test_runs;
+
+static void thread_test_worker()
+{
+    fetch_and_add_32(&thread_test_runs, 1);
+}
+
+static void thread_test()
+{
+    struct thread_t* threads[THREAD_TEST_NUM];
+    for (uint32_t round = 0; round < THREAD_TEST_ROUNDS; ++round) {
+        thread_test_runs = 0;
+        uint32_t cpu_id = get_cpu_id();
+        uint64_t start = rdtsc();
+        for (uint32_t i = 0; i < THREAD_TEST_NUM; ++i) {
+            do {
+                cpu_id = (cpu_id + 1) % MAX_CPUS;
+            } while (!(cpus[cpu_id].flags & CPU_FLAGS_ACTIVE));
+            threads[i] = thread_create(thread_test_worker, 0x2000, cpu_id);
+        }
+        for (uint32_t i = 0; i < THREAD_TEST_NUM; ++i) {
+            if (threads[i])
+                thread_join(threads[i]);
+        }
+        uint64_t cycles = rdtsc() - start;
+        printf("thread: round %d %d ran, %ld cycles per create and join\n",
+            round, thread_test_runs, cycles / THREAD_TEST_NUM);
+    }
+}
+
+// -t: exit/join churn test
+void thread_cmd(int argc, const char* argv[])
+{
+    printf("thread: exited %d reaped %d (%d from tick)\n",
+        thread_stats.exited, thread_stats.reaped + thread_stats.reaped_hot,
+        thread_stats.reaped_hot);
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        if (!(cpus[i].flags & CPU_FLAGS_ACTIVE))
+            continue;
+        uint32_t num_stacks = 0;
+        for (uint32_t order = 0; order < THREAD_STACK_ORDERS; ++order)
+            num_stacks += thread_cache[i].num_stacks[order];
+        printf("cpu[%d]: cached threads %d stacks %d\n",
+            i, thread_cache[i].num_threads, num_stacks);
+    }
+
+    if (argc > 1 && !strcmp(argv[1], "-t"))
+        thread_test();
 }
@@ -2,28 +2,53 @@
 #define KERNEL_THREAD_H
 
 #include "types.h"
+#include "timer.h"
 
 #define THREAD_DEFAULT_PRI  8
 
 #define THREAD_STATE_RUNNING    0
 #define THREAD_STATE_SLEEPING   1
+#define THREAD_STATE_DEAD       2   // exited, on its cpu's zombie list
 
 #define THREAD_FLAG_SLEEP_TIMER (1<<0)
 
+// thread_t::join, changed atomically
+#define THREAD_JOIN_EXITED      (1<<0)
+#define THREAD_JOIN_DETACHED    (1<<1)  // joined or never will be
+#define THREAD_JOIN_REAPED      (1<<2)  // stack gone
+
+#define THREAD_CPU_MASK_ALL     (~0U)
+
 struct switch_context_t;
+struct sched_queue_t;
+struct vm_hat_t;
+struct thread_stack_t;
 
 struct thread_t {
     struct thread_t* next;
     struct thread_t* prev;
+    struct thread_t* run_next;
+    struct thread_t* run_prev;
     struct thread_t* next_wait;
+    struct thread_t* joiner;    // waiting in thread_join
+    struct sched_queue_t* queue;
     struct switch_context_t* ctx;
-    uintptr_t stack;
+    struct vm_hat_t* hat;   // address space, NULL for kernel_hat
+    void* fpu_state;        // save area, from the first fpu section on
+    uintptr_t stack;        // top
+    struct thread_stack_t* stack_area;
     uint64_t ticks;
+    uint64_t last_run;  // clock tick it was last switched out
+    struct timer_t sleep_timer;
     uint32_t id;
     uint32_t cpu_id;
+    uint32_t cpu_mask;  // cpus it may migrate to, by apic id
     uint32_t state;
-    uint32_t sleep_time;
     uint32_t flags;
+    uint32_t fpu_depth;     // nested kernel_fpu_begin
+    uint32_t intr_depth;    // interrupt handlers running on its stack
+    uint32_t join;
+    int exit_code;
     int pri;
     int cnt;
 };
@@ -72,5 +97,16 @@ struct thread_t* thread_create(thread_entry_fn entry_fn,
                                uint32_t stack_size,
                                uint32_t cpu_id);
 void thread_wakeup(struct thread_t* thread);
+void thread_exit(int code) __attribute__((noreturn));
+int thread_join(struct thread_t* thread);
+void thread_detach(struct thread_t* thread);
+void thread_stack_free(struct thread_stack_t* st);
+bool thread_stack_fault(uintptr_t addr);
+void thread_set_affinity(struct thread_t* thread, uint32_t cpu_mask);
+
+struct cpu_desc_t;
+void thread_reap_locked(struct cpu_desc_t* cpu);
+void thread_reap_idle(void);
+void thread_cmd(int argc, const char* argv[]);
 
 #endif // KERNEL_THREAD_H
@@ -0,0 +1,273 @@
+#include "timer.h"
+#include "cpu.h"
+#include "local_apic.h"
+#include "kernel.h"
+#include "list.h"
+#include "stdio.h"
+
+// tick clock, 1 tick = 1 ms, driven by tsc
+static uint64_t clock_tsc_base;
+static uint64_t clock_tsc_per_tick;
+
+void timer_clock_init(uint64_t tsc_per_tick)
+{
+    clock_tsc_base = rdtsc();
+    clock_tsc_per_tick = tsc_per_tick;
+}
+
+// ticks since calibration, 0 before that
+uint64_t timer_clock()
+{
+    if (!clock_tsc_per_tick)
+        return 0;
+    return (rdtsc() - clock_tsc_base) / clock_tsc_per_tick;
+}
+
+static inline uint64_t timer_clock_tsc(uint64_t tick)
+{
+    return clock_tsc_base + tick * clock_tsc_per_tick;
+}
+
+void timer_init(struct timer_t* timer, timer_fn fn, void* arg)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->expires = 0;
+    timer->cpu_id = 0;
+    timer->flags = 0;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->reserved = 0;
+}
+
+void timer_wheel_init(struct timer_wheel_t* wheel, uint64_t now)
+{
+    wheel->now = now;
+    wheel->armed = TIMER_NEVER;
+    wheel->num_timers = 0;
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        wheel->bitmap[level] = 0;
+        for (uint32_t slot = 0; slot < TIMER_WHEEL_SLOTS; ++slot)
+            wheel->slots[level][slot] = NULL;
+    }
+}
+
+// base is the first tick still to be processed
+static void timer_wheel_insert(struct timer_wheel_t* wheel,
+                               struct timer_t* timer,
+                               uint64_t base)
+{
+    // slots are indexed by absolute expiry bits,
+    // level picked by distance from base
+    uint64_t expires = timer->expires > base ? timer->expires : base;
+    uint64_t delta = expires - base;
+    if (delta >= TIMER_WHEEL_RANGE) {
+        // out of range, re-inserted when the capped expiry comes
+        expires = base + TIMER_WHEEL_RANGE - 1;
+        delta = TIMER_WHEEL_RANGE - 1;
+    }
+
+    uint32_t level = 0;
+    while (delta >= (1UL << (TIMER_WHEEL_BITS * (level + 1))))
+        ++level;
+
+    uint32_t slot = (uint32_t)(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    queue_push_back(wheel->slots[level][slot], timer, next, prev);
+    wheel->bitmap[level] |= 1UL << slot;
+
+    timer->level = (uint8_t)level;
+    timer->slot = (uint8_t)slot;
+    timer->flags |= TIMER_PENDING;
+    wheel->num_timers++;
+}
+
+static void timer_wheel_remove(struct timer_wheel_t* wheel, struct timer_t* timer)
+{
+    struct timer_t** head = &wheel->slots[timer->level][timer->slot];
+    queue_pop(*head, timer, next, prev);
+    if (!*head)
+        wheel->bitmap[timer->level] &= ~(1UL << timer->slot);
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->flags &= ~TIMER_PENDING;
+    wheel->num_timers--;
+}
+
+// detach whole slot
+static struct timer_t* timer_wheel_take(struct timer_wheel_t* wheel,
+                                        uint32_t level, uint32_t slot)
+{
+    struct timer_t* list = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->bitmap[level] &= ~(1UL << slot);
+    if (list)
+        list->prev->next = NULL;
+    return list;
+}
+
+// move due slot of level down, returns slot index
+static uint32_t timer_wheel_cascade(struct timer_wheel_t* wheel, uint32_t level)
+{
+    uint32_t slot = (uint32_t)(wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer_t* timer = timer_wheel_take(wheel, level, slot);
+    while (timer) {
+        struct timer_t* next = timer->next;
+        wheel->num_timers--;
+        timer_wheel_insert(wheel, timer, wheel->now);
+        timer = next;
+    }
+    return slot;
+}
+
+static void timer_wheel_expire(struct timer_wheel_t* wheel)
+{
+    uint32_t slot = (uint32_t)wheel->now & TIMER_WHEEL_MASK;
+    if (!slot) {
+        for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if (timer_wheel_cascade(wheel, level))
+                break;
+        }
+    }
+
+    if (!(wheel->bitmap[0] & (1UL << slot)))
+        return;
+
+    struct timer_t* timer = timer_wheel_take(wheel, 0, slot);
+    while (timer) {
+        struct timer_t* next = timer->next;
+        wheel->num_timers--;
+        if (timer->expires > wheel->now) {
+            timer_wheel_insert(wheel, timer, wheel->now);
+        } else {
+            timer->next = NULL;
+            timer->prev = NULL;
+            timer->flags &= ~TIMER_PENDING;
+            timer->fn(timer->arg);
+        }
+        timer = next;
+    }
+}
+
+// distance to the first non-empty slot at or after slot
+static inline uint32_t timer_slot_distance(uint64_t bitmap, uint32_t slot)
+{
+    uint64_t rotated = slot ? (bitmap >> slot) | (bitmap << (64 - slot)) : bitmap;
+    return (uint32_t)__builtin_ctzl(rotated);
+}
+
+// next tick with work to do (expiry or cascade), TIMER_NEVER if empty
+uint64_t timer_wheel_next(struct timer_wheel_t* wheel)
+{
+    uint64_t base = wheel->now + 1;
+    uint64_t next = TIMER_NEVER;
+
+    if (wheel->bitmap[0]) {
+        uint32_t slot = (uint32_t)base & TIMER_WHEEL_MASK;
+        next = base + timer_slot_distance(wheel->bitmap[0], slot);
+    }
+
+    for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if (!wheel->bitmap[level])
+            continue;
+
+        // slots of this level cascade at multiples of 64^level
+        uint32_t shift = TIMER_WHEEL_BITS * level;
+        uint64_t block = (base + (1UL << shift) - 1) >> shift;
+        uint32_t slot = (uint32_t)block & TIMER_WHEEL_MASK;
+        uint64_t cascade = (block + timer_slot_distance(wheel->bitmap[level], slot)) << shift;
+        if (cascade < next)
+            next = cascade;
+    }
+
+    return next;
+}
+
+// expire everything due up to and including now,
+// ticks with nothing to do are skipped
+// called from local timer interrupt, which also means we're disarmed
+void timer_wheel_tick(struct timer_wheel_t* wheel, uint64_t now)
+{
+    wheel->armed = TIMER_NEVER;
+    while (wheel->now < now) {
+        uint64_t next = timer_wheel_next(wheel);
+        if (next > now) {
+            wheel->now = now;
+            break;
+        }
+        wheel->now = next;
+        timer_wheel_expire(wheel);
+    }
+}
+
+// arm local timer for the earlier of deadline and next wheel event,
+// on this cpu only, cpu locked
+void timer_program(struct cpu_desc_t* cpu, uint64_t deadline)
+{
+    struct timer_wheel_t* wheel = &cpu->timers;
+    uint64_t next = timer_wheel_next(wheel);
+    if (deadline < next)
+        next = deadline;
+
+    if (next == wheel->armed)
+        return;
+
+    wheel->armed = next;
+    if (next == TIMER_NEVER)
+        local_apic_timer_stop();
+    else
+        local_apic_timer_arm(timer_clock_tsc(next));
+}
+
+// a timer pending on another cpu has to be cancelled before cpu is
+// locked, taking the other cpu's lock here has no order to follow
+void timer_add_locked(struct cpu_desc_t* cpu, struct timer_t* timer, uint32_t ms)
+{
+    struct timer_wheel_t* wheel = &cpu->timers;
+    if (timer_pending(timer)) {
+        check(timer->cpu_id == cpu->apic_id);
+        timer_wheel_remove(wheel, timer);
+    }
+
+    timer->expires = timer_clock() + (ms ? ms : 1);
+    timer->cpu_id = cpu->apic_id;
+    timer_wheel_insert(wheel, timer, wheel->now + 1);
+
+    if (timer->expires < wheel->armed && cpu == get_cpu())
+        timer_program(cpu, wheel->armed);
+}
+
+bool timer_cancel_locked(struct cpu_desc_t* cpu, struct timer_t* timer)
+{
+    if (!timer_pending(timer) || timer->cpu_id != cpu->apic_id)
+        return false;
+
+    timer_wheel_remove(&cpu->timers, timer);
+    return true;
+}
+
+// arm on this cpu, fn called after at least ms ticks
+void timer_add(struct timer_t* timer, uint32_t ms)
+{
+    if (timer_pending(timer))
+        timer_cancel(timer);
+
+    struct cpu_desc_t* cpu = cpu_lock_splhi();
+    timer_add_locked(cpu, timer, ms);
+    cpu_unlock_splx(cpu);
+}
+
+// NOTE: must not be called from the timer's own fn (cpu is locked there)
+bool timer_cancel(struct timer_t* timer)
+{
+    if (!timer_pending(timer))
+        return false;
+
+    struct cpu_desc_t* cpu = cpu_lock_smp(timer->cpu_id);
+    bool cancelled = timer_cancel_locked(cpu, timer);
+    cpu_unlock_smp(cpu);
+
+    return cancelled;
+}
@@ -0,0 +1,63 @@
+#ifndef KERNEL_TIMER_H
+#define KERNEL_TIMER_H
+
+#include "types.h"
+
+// hierarchical timing wheel, 4 levels of 64 slots
+// level n holds timers due within 64^(n+1) ticks
+#define TIMER_WHEEL_BITS    6
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS  4
+#define TIMER_WHEEL_RANGE   (1UL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+#define TIMER_NEVER         (~0UL)
+
+#define TIMER_PENDING       0x01
+
+struct cpu_desc_t;
+
+// called on the cpu the timer was added on, at splhi with cpu locked
+typedef void (*timer_fn)(void* arg);
+
+struct timer_t {
+    struct timer_t* next;
+    struct timer_t* prev;
+    timer_fn fn;
+    void* arg;
+    uint64_t expires;   // tick
+    uint32_t cpu_id;
+    uint8_t flags;
+    uint8_t level;
+    uint8_t slot;
+    uint8_t reserved;
+};
+
+struct timer_wheel_t {
+    uint64_t now;       // last processed tick
+    uint64_t armed;     // tick local timer fires at
+    uint64_t bitmap[TIMER_WHEEL_LEVELS];
+    struct timer_t* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint32_t num_timers;
+};
+
+static inline bool timer_pending(struct timer_t* timer)
+{
+    return timer->flags & TIMER_PENDING;
+}
+
+void timer_clock_init(uint64_t tsc_per_tick);
+uint64_t timer_clock(void);
+
+void timer_init(struct timer_t* timer, timer_fn fn, void* arg);
+void timer_wheel_init(struct timer_wheel_t* wheel, uint64_t now);
+void timer_wheel_tick(struct timer_wheel_t* wheel, uint64_t now);
+uint64_t timer_wheel_next(struct timer_wheel_t* wheel);
+void timer_program(struct cpu_desc_t* cpu, uint64_t deadline);
+
+void timer_add_locked(struct cpu_desc_t* cpu, struct timer_t* timer, uint32_t ms);
+bool timer_cancel_locked(struct cpu_desc_t* cpu, struct timer_t* timer);
+void timer_add(struct timer_t* timer, uint32_t ms);
+bool timer_cancel(struct timer_t* timer);
+
+#endif // KERNEL_TIMER_H
@@ -1,7 +1,9 @@
 #include "vm_boot.h"
 #include "vm_page.h"
+#include "vm_hat.h"
 #include "kernel.h"
 #include "spinlock.h"
+#include "x86.h"
 #include "stdio.h"
 
 #define BOOT_PML4       0x10000UL
@@ -30,78 +32,191 @@ static uint64_t boot_page_alloc()
     return page;
 }
 
-static void vm_boot_map_page(uintptr_t vaddr, uintptr_t paddr)
+// 1G pages if the cpu has them, without PDPE1GB the ps bit in a
+// pdp entry is reserved
+static bool boot_page_1g;
+
+// kernel half leaves are global, they stay in the tlb across
+// address space switches once cr4.pge is on
+static inline uint64_t vm_boot_leaf_flags(uintptr_t vaddr)
 {
-    uint32_t pml4_index = PML_INDEX(vaddr);
-    uint32_t pdp_index = PDP_INDEX(vaddr);
-    uint32_t pd_index = PAGE_2M_INDEX(vaddr);
+    uint64_t flags = PAGE_PRESENT | PAGE_WRITE;
+    if (vaddr >= KERNEL_PHYS_BASE)
+        flags |= PAGE_GLOBAL;
+    return flags;
+}
 
+static uint64_t* vm_boot_pdp(uintptr_t vaddr, bool alloc)
+{
     uint64_t* pml4 = (uint64_t*)KERNEL_VADDR(BOOT_PML4);
-    uint64_t pdp_entry = pml4[pml4_index];
+    uint64_t pdp_entry = pml4[PML_INDEX(vaddr)];
     if (!(pdp_entry & PAGE_PRESENT)) {
+        if (!alloc)
+            return NULL;
         pdp_entry = boot_page_alloc() | PAGE_PRESENT | PAGE_WRITE;
-        pml4[pml4_index] = pdp_entry;
+        pml4[PML_INDEX(vaddr)] = pdp_entry;
+        vm_hat_kernel_pml4(PML_INDEX(vaddr));
     }
-    uint64_t* pdp = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(pdp_entry));
+    return (uint64_t*)KERNEL_VADDR(PDIR_ADDR(pdp_entry));
+}
+
+// 1G leaf into a page directory of 2M pages, same translation
+static void vm_boot_split_1g(uint64_t* pdp_entry)
+{
+    uint64_t pd_addr = boot_page_alloc();
+    uint64_t* pd = (uint64_t*)KERNEL_VADDR(pd_addr);
+    uint64_t paddr = *pdp_entry & PAGE_ADDR_MASK & PDP_MASK;
+    uint64_t flags = *pdp_entry & 0xFFF;
+    for (uint32_t i = 0; i < PDIR_NUM_ENTRIES; ++i)
+        pd[i] = (paddr + ((uint64_t)i << PAGE_2M_SHIFT)) | flags;
+    *pdp_entry = pd_addr | PAGE_PRESENT | PAGE_WRITE;
+}
+
+static void vm_boot_map_page_1g(uintptr_t vaddr, uintptr_t paddr)
+{
+    uint64_t* pdp = vm_boot_pdp(vaddr, true);
+    uint64_t* e = &pdp[PDP_INDEX(vaddr)];
+    if ((*e & PAGE_PRESENT) && (*e & PAGE_1GB) && (*e & PAGE_ADDR_MASK) == paddr)
+        return;
+
+    // page directory left behind stays with the boot pages
+    bool flush = *e & PAGE_PRESENT;
+    *e = (uint64_t)paddr | vm_boot_leaf_flags(vaddr) | PAGE_1GB;
+    if (flush)
+        tlb_flush();
+}
+
+static void vm_boot_map_page(uintptr_t vaddr, uintptr_t paddr)
+{
+    uint32_t pdp_index = PDP_INDEX(vaddr);
+    uint32_t pd_index = PAGE_2M_INDEX(vaddr);
+
+    uint64_t* pdp = vm_boot_pdp(vaddr, true);
     uint64_t pd_entry = pdp[pdp_index];
     if (!(pd_entry & PAGE_PRESENT)) {
         pd_entry = boot_page_alloc() | PAGE_PRESENT | PAGE_WRITE;
         pdp[pdp_index] = pd_entry;
+    } else if (pd_entry & PAGE_1GB) {
+        // already covered, direct map
+        if ((pd_entry & PAGE_ADDR_MASK) + ((uint64_t)pd_index << PAGE_2M_SHIFT) == paddr)
+            return;
+        vm_boot_split_1g(&pdp[pdp_index]);
+        pd_entry = pdp[pdp_index];
     }
     uint64_t* pd = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(pd_entry));
     if (!(pd[pd_index] & PAGE_PRESENT) || PDIR_ADDR(pd[pd_index]) != paddr) {
-        pd[pd_index] = (uint64_t)paddr | PAGE_PRESENT | PAGE_WRITE | PAGE_2MB;
+        pd[pd_index] = (uint64_t)paddr | vm_boot_leaf_flags(vaddr) | PAGE_2MB;
         invlpg(vaddr);
     }
 }
 
-static void vm_boot_unmap_page(uintptr_t vaddr)
+// size unmapped at vaddr, 0 if nothing was there
+static uint64_t vm_boot_unmap_page(uintptr_t vaddr, uint64_t size)
 {
-    uint32_t pml4_index = PML_INDEX(vaddr);
-    uint32_t pdp_index = PDP_INDEX(vaddr);
-    uint32_t pd_index = PAGE_2M_INDEX(vaddr);
+    uint64_t* pdp = vm_boot_pdp(vaddr, false);
+    if (!pdp)
+        return 0;
 
-    uint64_t* pml4 = (uint64_t*)KERNEL_VADDR(BOOT_PML4);
-    uint64_t pdp_entry = pml4[pml4_index];
-    if (pdp_entry & PAGE_PRESENT) {
-        uint64_t* pdp = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(pdp_entry));
-        uint64_t pd_entry = pdp[pdp_index];
-        if (pd_entry & PAGE_PRESENT) {
-            uint64_t* pd = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(pd_entry));
-            pd[pd_index] = 0;
-            invlpg(vaddr);
+    uint64_t* e = &pdp[PDP_INDEX(vaddr)];
+    if (!(*e & PAGE_PRESENT))
+        return 0;
+    if (*e & PAGE_1GB) {
+        if (!(vaddr & (PDP_SIZE-1)) && size >= PDP_SIZE) {
+            *e = 0;
+            return PDP_SIZE;
         }
+        vm_boot_split_1g(e);
+    }
+
+    uint64_t* pd = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(*e));
+    uint32_t pd_index = PAGE_2M_INDEX(vaddr);
+    if (pd[pd_index] & PAGE_PRESENT) {
+        pd[pd_index] = 0;
+        return PAGE_2M_SIZE;
     }
+    return 0;
+}
+
+// largest page that fits, 1G only when both ends are aligned
+static inline bool vm_boot_fits_1g(uintptr_t vaddr, uintptr_t paddr, uint64_t size)
+{
+    return boot_page_1g && !((vaddr | paddr) & (PDP_SIZE-1)) && size >= PDP_SIZE;
 }
 
 void vm_boot_map_range(uintptr_t vaddr, uintptr_t paddr, uint64_t size)
 {
-    uint64_t num_pages = PAGE_2M_NUM(size + (vaddr & (PAGE_2M_SIZE-1)));
+    size = PAGE_2M_ROUND(size + (vaddr & (PAGE_2M_SIZE-1)));
 
     vaddr &= PAGE_2M_MASK;
     paddr &= PAGE_2M_MASK;
 
-    spinlock_lock(&vm_boot_lock);
-    while (num_pages--) {
-        vm_boot_map_page(vaddr, paddr);
-        vaddr += PAGE_2M_SIZE;
-        paddr += PAGE_2M_SIZE;
+    int s = spinlock_lock_splhi(&vm_boot_lock);
+    while (size) {
+        uint64_t n = PAGE_2M_SIZE;
+        if (vm_boot_fits_1g(vaddr, paddr, size)) {
+            n = PDP_SIZE;
+            vm_boot_map_page_1g(vaddr, paddr);
+        } else {
+            vm_boot_map_page(vaddr, paddr);
+        }
+        vaddr += n;
+        paddr += n;
+        size -= n;
     }
-    spinlock_unlock(&vm_boot_lock);
+    spinlock_unlock_splx(&vm_boot_lock, s);
 }
 
 void vm_boot_unmap_range(uintptr_t vaddr, uint64_t size)
 {
-    uint64_t num_pages = PAGE_2M_NUM(size + (vaddr & (PAGE_2M_SIZE-1)));
+    size = PAGE_2M_ROUND(size + (vaddr & (PAGE_2M_SIZE-1)));
 
     vaddr &= PAGE_2M_MASK;
 
-    spinlock_lock(&vm_boot_lock);
-    while (num_pages--) {
-        vm_boot_unmap_page(vaddr);
-        vaddr += PAGE_2M_SIZE;
+    // boot mappings are shared by every cpu
+    struct vm_hat_flush_t f;
+    vm_hat_flush_init(&f, &kernel_hat);
+
+    int s = spinlock_lock_splhi(&vm_boot_lock);
+    while (size) {
+        uint64_t n = vm_boot_unmap_page(vaddr, size);
+        if (n)
+            vm_hat_flush_page(&f, vaddr);
+        else
+            n = PAGE_2M_SIZE;
+        vaddr += n;
+        size -= n;
+    }
+    spinlock_unlock_splx(&vm_boot_lock, s);
+
+    vm_hat_flush(&f);
+}
+
+// physical memory window with 1G pages over gigabytes that are all
+// ram, the rest keeps being mapped 2M at a time on first use
+void vm_boot_map_phys()
+{
+    if (!boot_page_1g)
+        return;
+
+    struct boot_info_t* boot_info = kernel_boot_info();
+    uint32_t num_mapped = 0;
+    for (uint64_t start = 0; start + PDP_SIZE <= boot_info->mmap_top; start += PDP_SIZE) {
+        bool avail = false;
+        for (uint32_t j = 0; j < boot_info->num_mmap && !avail; ++j) {
+            const struct boot_info_mmap_t* m = &boot_info->mmap[j];
+            avail = m->flags && m->addr <= start && m->addr + m->size >= start + PDP_SIZE;
+        }
+        if (avail) {
+            vm_boot_map_range(PHYS_VADDR(start), start, PDP_SIZE);
+            ++num_mapped;
+        }
     }
-    spinlock_unlock(&vm_boot_lock);
+    printf("vm_boot_map_phys: %d x 1G\n", num_mapped);
+}
+
+bool vm_boot_page_1g()
+{
+    return boot_page_1g;
 }
 
 static void pml4_dump(uintptr_t pml4_addr)
@@ -127,6 +242,8 @@ static void pml4_dump(uintptr_t pml4_addr)
                             pdp_index, pd_addr,
                             pdp_vaddr,
                             (uint32_t)(pd_entry & 0x1FF));
+                    if (pd_entry & PAGE_1GB)
+                        continue;
 
                     const uint64_t* pd = (uint64_t*)KERNEL_VADDR(pd_addr);
                     for (uint32_t pd_index = 0; pd_index < 512; ++pd_index) {
@@ -156,6 +273,36 @@ void vm_boot_dump()
 void vm_boot_init()
 {
     boot_page = BOOT_PAGE_NEXT;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        boot_page_1g = (edx & CPUID_80000001_EDX_PDPE1GB) != 0;
+    }
+
+    // what boot.S mapped in the kernel half goes global too,
+    // pge is still off so nothing cached needs to go
+    uint64_t* pml4 = (uint64_t*)KERNEL_VADDR(BOOT_PML4);
+    for (uint32_t pml4_index = PDIR_NUM_ENTRIES/2; pml4_index < PDIR_NUM_ENTRIES; ++pml4_index) {
+        if (!(pml4[pml4_index] & PAGE_PRESENT))
+            continue;
+        uint64_t* pdp = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(pml4[pml4_index]));
+        for (uint32_t pdp_index = 0; pdp_index < PDIR_NUM_ENTRIES; ++pdp_index) {
+            uint64_t* e = &pdp[pdp_index];
+            if (!(*e & PAGE_PRESENT))
+                continue;
+            if (*e & PAGE_1GB) {
+                *e |= PAGE_GLOBAL;
+                continue;
+            }
+            uint64_t* pd = (uint64_t*)KERNEL_VADDR(PDIR_ADDR(*e));
+            for (uint32_t pd_index = 0; pd_index < PDIR_NUM_ENTRIES; ++pd_index) {
+                if ((pd[pd_index] & PAGE_PRESENT) && (pd[pd_index] & PAGE_2MB))
+                    pd[pd_index] |= PAGE_GLOBAL;
+            }
+        }
+    }
 }
 
 void vm_boot_sync()
@@ -169,7 +316,11 @@ void vm_boot_sync()
             const uint64_t* pdp = (uint64_t*)KERNEL_VADDR(pdp_addr);
             for (uint32_t pdp_index = 0; pdp_index < 512; ++pdp_index) {
                 uint64_t pd_entry = pdp[pdp_index];
-                if (pd_entry) {
+                if (pd_entry & PAGE_1GB) {
+                    uint32_t page_index = (uint32_t)((pd_entry & PAGE_ADDR_MASK) >> PAGE_2M_SHIFT);
+                    for (uint32_t i = 0; i < PDIR_NUM_ENTRIES; ++i)
+                        page_db_reserve_page(page_db, page_index + i);
+                } else if (pd_entry) {
                     uint64_t pd_addr = PDIR_ADDR(pd_entry);
                     const uint64_t* pd = (uint64_t*)KERNEL_VADDR(pd_addr);
                     for (uint32_t pd_index = 0; pd_index < 512; ++pd_index) {
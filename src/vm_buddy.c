@@ -0,0 +1,213 @@
+#include "vm_buddy.h"
+#include "vm_page.h"
+#include "kernel.h"
+#include "spinlock.h"
+#include "stdio.h"
+
+// binary buddy allocator for 4K..1M blocks
+//
+// 2M pages are taken from the global page_db and turned into
+// small page databases (page_db_init_4k), the database sits at
+// the start of the page so any block or descriptor finds it by
+// masking its address. free blocks of all pages hang off one
+// list per order, heads carry the block size in num_pages.
+// a page that frees up completely goes back to page_db
+
+#define BUDDY_PAGES     (PAGE_2M_SIZE >> PAGE_4K_SHIFT)
+
+struct buddy_t {
+    struct page_desc_t* free[BUDDY_NUM_ORDERS];
+    uint32_t num_free[BUDDY_NUM_ORDERS];
+    uint32_t num_pages;     // 2M pages carved up
+    struct spinlock_t lock;
+};
+
+static struct buddy_t buddy;
+
+static inline struct page_db_t* buddy_pdb(uintptr_t addr)
+{
+    return (struct page_db_t*)(addr & PAGE_2M_MASK);
+}
+
+static void buddy_push(struct page_desc_t* page, uint32_t order)
+{
+    struct page_desc_t** list = &buddy.free[order];
+    page->flags = PGF_FREE;
+    page->num_pages = 1UL << order;
+    page->next_buddy = *list;
+    page->prev_buddy = list;
+    if (*list)
+        (*list)->prev_buddy = &page->next_buddy;
+    *list = page;
+    buddy.num_free[order]++;
+}
+
+static void buddy_remove(struct page_desc_t* page, uint32_t order)
+{
+    if (page->next_buddy)
+        page->next_buddy->prev_buddy = page->prev_buddy;
+    *page->prev_buddy = page->next_buddy;
+    page->next_buddy = NULL;
+    page->prev_buddy = NULL;
+    buddy.num_free[order]--;
+}
+
+// largest aligned blocks covering the unreserved part of a page,
+// also exactly what a fully coalesced page looks like
+static inline uint32_t buddy_initial_order(uint32_t index)
+{
+    uint32_t order = __builtin_ctz(index);
+    if (order > BUDDY_MAX_ORDER)
+        order = BUDDY_MAX_ORDER;
+    while (index + (1U << order) > BUDDY_PAGES)
+        --order;
+    return order;
+}
+
+static bool buddy_grow()
+{
+    uintptr_t vaddr = kernel_page_alloc();
+    if (!vaddr)
+        return false;
+
+    uintptr_t paddr = kernel_vaddr_phys(vaddr);
+    uint32_t page_index = page_db_addr2index(page_db, paddr);
+    page_db_desc(page_db, page_index)->flags |= PGF_KMEM_BUDDY;
+
+    struct page_db_t* pdb = (struct page_db_t*)vaddr;
+    page_db_init_4k(pdb, page_index);
+
+    uint32_t index = pdb->num_reserved;
+    while (index < BUDDY_PAGES) {
+        uint32_t order = buddy_initial_order(index);
+        buddy_push(&pdb->pages[index], order);
+        index += 1U << order;
+    }
+
+    buddy.num_pages++;
+    return true;
+}
+
+// keep the last page around, no point bouncing it
+static void buddy_shrink(struct page_db_t* pdb)
+{
+    if (buddy.num_pages == 1)
+        return;
+
+    uint32_t index = pdb->num_reserved;
+    while (index < BUDDY_PAGES) {
+        uint32_t order = buddy_initial_order(index);
+        buddy_remove(&pdb->pages[index], order);
+        index += 1U << order;
+    }
+
+    uintptr_t vaddr = (uintptr_t)pdb;
+    uint32_t page_index = page_db_addr2index(page_db, kernel_vaddr_phys(vaddr));
+    page_db_desc(page_db, page_index)->flags &= ~PGF_KMEM_BUDDY;
+
+    buddy.num_pages--;
+    kernel_page_free(vaddr);
+}
+
+uint32_t buddy_order(size_t size)
+{
+    if (size <= PAGE_4K_SIZE)
+        return 0;
+    return 64 - __builtin_clzl((size - 1) >> PAGE_4K_SHIFT);
+}
+
+uintptr_t buddy_alloc(uint32_t order)
+{
+    check(order <= BUDDY_MAX_ORDER);
+
+    int s = spinlock_lock_splhi(&buddy.lock);
+    uint32_t k = order;
+    while (k <= BUDDY_MAX_ORDER && !buddy.free[k])
+        ++k;
+
+    if (k > BUDDY_MAX_ORDER) {
+        if (!buddy_grow()) {
+            spinlock_unlock_splx(&buddy.lock, s);
+            return 0;
+        }
+        k = BUDDY_MAX_ORDER;
+    }
+
+    struct page_desc_t* page = buddy.free[k];
+    buddy_remove(page, k);
+
+    // split, upper halves go back on the lists
+    while (k > order) {
+        --k;
+        buddy_push(page + (1U << k), k);
+    }
+
+    page->flags = PGF_USED;
+    page->num_pages = 1UL << order;
+
+    struct page_db_t* pdb = buddy_pdb((uintptr_t)page);
+    pdb->num_free -= 1U << order;
+    spinlock_unlock_splx(&buddy.lock, s);
+
+    return page_db_4k_vaddr(pdb, page_db_index(pdb, page));
+}
+
+void buddy_free(uintptr_t addr)
+{
+    struct page_db_t* pdb = buddy_pdb(addr);
+    uint32_t index = (uint32_t)((addr & ~PAGE_2M_MASK) >> PAGE_4K_SHIFT);
+
+    int s = spinlock_lock_splhi(&buddy.lock);
+    struct page_desc_t* page = &pdb->pages[index];
+    check(page->flags == PGF_USED && page->num_pages);
+
+    uint32_t order = __builtin_ctzl(page->num_pages);
+    pdb->num_free += 1U << order;
+    page->flags = PGF_FREE;
+    page->num_pages = 0;
+
+    // coalesce while the buddy is a free block of the same order
+    while (order < BUDDY_MAX_ORDER) {
+        uint32_t buddy_index = index ^ (1U << order);
+        struct page_desc_t* b = &pdb->pages[buddy_index];
+        if (b->flags != PGF_FREE || b->num_pages != (1UL << order))
+            break;
+
+        buddy_remove(b, order);
+        b->num_pages = 0;
+        index &= ~(1U << order);
+        ++order;
+    }
+
+    buddy_push(&pdb->pages[index], order);
+
+    if (pdb->num_free == BUDDY_PAGES - pdb->num_reserved)
+        buddy_shrink(pdb);
+
+    spinlock_unlock_splx(&buddy.lock, s);
+}
+
+size_t buddy_size(uintptr_t addr)
+{
+    struct page_db_t* pdb = buddy_pdb(addr);
+    uint32_t index = (uint32_t)((addr & ~PAGE_2M_MASK) >> PAGE_4K_SHIFT);
+    return pdb->pages[index].num_pages << PAGE_4K_SHIFT;
+}
+
+// descriptor of an allocated block, free for the owner to use
+// outside of flags and num_pages
+struct page_desc_t* buddy_desc(uintptr_t addr)
+{
+    struct page_db_t* pdb = buddy_pdb(addr);
+    uint32_t index = (uint32_t)((addr & ~PAGE_2M_MASK) >> PAGE_4K_SHIFT);
+    return &pdb->pages[index];
+}
+
+void buddy_dump()
+{
+    int s = spinlock_lock_splhi(&buddy.lock);
+    printf("buddy: %d pages\n", buddy.num_pages);
+    for (uint32_t i = 0; i < BUDDY_NUM_ORDERS; ++i)
+        printf("[%d] %4dK: %d\n", i, 4 << i, buddy.num_free[i]);
+    spinlock_unlock_splx(&buddy.lock, s);
+}
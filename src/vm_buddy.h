@@ -0,0 +1,17 @@
+#ifndef KERNEL_VM_BUDDY_H
+#define KERNEL_VM_BUDDY_H
+
+#include "types.h"
+
+// 4K..1M blocks carved out of 2M pages
+#define BUDDY_MAX_ORDER     8
+#define BUDDY_NUM_ORDERS    (BUDDY_MAX_ORDER + 1)
+
+uint32_t buddy_order(size_t size);
+uintptr_t buddy_alloc(uint32_t order);
+void buddy_free(uintptr_t addr);
+size_t buddy_size(uintptr_t addr);
+struct page_desc_t* buddy_desc(uintptr_t addr);
+void buddy_dump(void);
+
+#endif // KERNEL_VM_BUDDY_H
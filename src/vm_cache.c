@@ -1,108 +1,376 @@
 #include "vm_cache.h"
 #include "vm_page.h"
 #include "vm_alloc.h"
+#include "vm_buddy.h"
+#include "vm_reclaim.h"
 #include "kernel.h"
 #include "kmalloc.h"
+#include "cpu.h"
+#include "thread.h"
+#include "semaphore.h"
+#include "cond.h"
+#include "spinlock.h"
 #include "stdio.h"
 
-static struct page_hash_t page_hash;
+// page hash
+//
+// one table for the pages of all caches, keyed by (cache, offset).
+// every bucket has its own lock and nothing else is shared on the
+// lookup path. past two pages a bucket on average the table doubles,
+// incrementally: while old is set inserts move a few of its buckets
+// over to cur, a moved bucket is flagged and operations that find the
+// flag go to cur. table pointers are read without a lock, a table
+// is freed only after every cpu has been seen outside an operation
+
+#define PAGE_HASH_MIN_SIZE  1024
+#define PAGE_HASH_LOAD      2
+#define PAGE_HASH_MIGRATE   8   // old buckets moved per insert
+
+struct page_hash_bucket_t {
+    struct spinlock_t lock;
+    uint32_t moved;             // contents went to the next table
+    struct page_desc_t* pages;
+};
+
+struct page_hash_table_t {
+    uint32_t size;
+    struct page_hash_bucket_t buckets[];
+};
+
+static struct {
+    struct page_hash_table_t* volatile cur;
+    struct page_hash_table_t* volatile old;     // being moved to cur
+    uint32_t next_move;                         // next old bucket
+    uint32_t num_pages;
+    uint32_t num_resizes;
+    struct spinlock_t resize_lock;
+} page_hash;
+
+// odd while the cpu is inside a hash operation
+static struct {
+    volatile uint32_t seq;
+} __attribute__((aligned(64))) page_hash_epoch[MAX_CPUS];
+
 static struct slab_list_t* sl_page_cache;
 
-static inline uint32_t hash_func(struct page_cache_t* cache, uintptr_t offset)
+// readahead
+//
+// sequential lookups of a cache with read_page grow its window from
+// PAGE_CACHE_RA_MIN pages up to PAGE_CACHE_RA_MAX bytes, anything else
+// halves it. a window is read by the readahead thread into the cache
+// while the reader works through the previous one, reaching the mark
+// at the start of a window queues the next. a fault on the page the
+// thread is filling waits for it instead of reading it again. queued
+// windows hold a map reference on their cache, they are dropped when
+// the queue is full or memory is short
+
+#define CACHE_RA_QUEUE  16
+
+struct cache_ra_req_t {
+    struct page_cache_t* cache;
+    uint64_t offset;
+    uint32_t num_pages;
+};
+
+static struct {
+    struct spinlock_t lock;
+    struct cache_ra_req_t queue[CACHE_RA_QUEUE];
+    uint32_t head;
+    uint32_t tail;
+    bool started;
+    struct semaphore_t wake;
+    uint32_t num_windows;
+    uint32_t num_pages;
+    uint32_t num_dropped;
+    uint32_t num_waits;     // faults that found the page being read
+} cache_ra;
+
+// cache pointers are slab aligned, everything gets mixed in
+static inline uint64_t hash_func(struct page_cache_t* cache, uint64_t offset)
 {
-    uintptr_t page2m_offset = offset >> PAGE_2M_SHIFT;
-    uint32_t hash_index = (uint32_t)(((uintptr_t)cache + page2m_offset) & (uintptr_t)(page_hash.size-1));
+    uint64_t h = (uint64_t)(uintptr_t)cache ^ ((offset >> PAGE_4K_SHIFT) * 0x9e3779b97f4a7c15UL);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
 
-    printf("hash_index: %d [%p:%016llx]\n", hash_index, cache, offset);
-    return hash_index;
+static int page_hash_enter()
+{
+    int s = cpu_splhi();
+    // locked op, the odd seq must be visible before we load a table pointer
+    fetch_and_add_32((uint32_t*)&page_hash_epoch[get_cpu_id()].seq, 1);
+    return s;
 }
 
-static inline uint32_t hash_func_local(struct page_cache_t* cache, uintptr_t offset)
+static void page_hash_exit(int s)
 {
-    uintptr_t page4k_offset = offset >> PAGE_4K_SHIFT;
-    uint32_t hash_index = (uint32_t)(page4k_offset & (uintptr_t)(cache->hash.size-1));
+    barrier();
+    page_hash_epoch[get_cpu_id()].seq++;
+    cpu_splx(s);
+}
 
-    printf("hash_index[local]: %d [%p:%016llx]\n", hash_index, cache, offset);
-    return hash_index;
+// wait out operations that may still hold a table pointer
+static void page_hash_drain()
+{
+    uint32_t self = get_cpu_id();
+    mfence();
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        uint32_t seq = page_hash_epoch[i].seq;
+        if (i == self || !(seq & 1))
+            continue;
+        while (page_hash_epoch[i].seq == seq)
+            cpu_pause();
+    }
 }
 
-void page_hash_insert(struct page_cache_t* cache,
-                      uint64_t offset,
-                      struct page_desc_t* page)
+static struct page_hash_table_t* page_hash_table_alloc(uint32_t size)
 {
-    uint32_t hash_index;
-    struct page_hash_t* hash;
-    if (cache->flags & PAGE_CACHE_4K_PAGES) {
-        hash_index = hash_func_local(cache, offset);
-        hash = &cache->hash;
-    } else {
-        hash_index = hash_func(cache, offset);
-        hash = &page_hash;
+    struct page_hash_table_t* table = (struct page_hash_table_t*)kmalloc(
+        sizeof(struct page_hash_table_t) + size * sizeof(struct page_hash_bucket_t), 0);
+    if (!table)
+        return NULL;
+
+    table->size = size;
+    for (uint32_t i = 0; i < size; ++i) {
+        spinlock_init(&table->buckets[i].lock);
+        table->buckets[i].moved = 0;
+        table->buckets[i].pages = NULL;
+    }
+    return table;
+}
+
+// locked bucket that holds h, with enter/exit around
+static struct page_hash_bucket_t* page_hash_lock(uint64_t h)
+{
+    while (1) {
+        // cur is published after old, seeing the new cur means seeing old
+        struct page_hash_table_t* cur = page_hash.cur;
+        barrier();
+        struct page_hash_table_t* old = page_hash.old;
+
+        struct page_hash_bucket_t* b;
+        if (old && old != cur) {
+            b = &old->buckets[h & (old->size - 1)];
+            spinlock_lock(&b->lock);
+            if (!b->moved)
+                return b;
+            spinlock_unlock(&b->lock);
+        }
+
+        // cur may already be stale and moved too
+        b = &cur->buckets[h & (cur->size - 1)];
+        spinlock_lock(&b->lock);
+        if (!b->moved)
+            return b;
+        spinlock_unlock(&b->lock);
+        cpu_pause();
+    }
+}
+
+static void page_hash_move_bucket(struct page_hash_table_t* old,
+                                  struct page_hash_table_t* cur, uint32_t index)
+{
+    // old before new, operations never hold two buckets
+    struct page_hash_bucket_t* b = &old->buckets[index];
+    struct page_hash_bucket_t* lo = &cur->buckets[index];
+    struct page_hash_bucket_t* hi = &cur->buckets[index + old->size];
+    spinlock_lock(&b->lock);
+    spinlock_lock(&lo->lock);
+    spinlock_lock(&hi->lock);
+
+    struct page_desc_t* page = b->pages;
+    while (page) {
+        struct page_desc_t* next = page->next_hash;
+        uint64_t h = hash_func(page->cache, page->cache_offset);
+        struct page_hash_bucket_t* to = &cur->buckets[h & (cur->size - 1)];
+        page->next_hash = to->pages;
+        to->pages = page;
+        page = next;
+    }
+    b->pages = NULL;
+    b->moved = 1;
+
+    spinlock_unlock(&hi->lock);
+    spinlock_unlock(&lo->lock);
+    spinlock_unlock(&b->lock);
+}
+
+// start a resize or move some more of one along, outside of any
+// operation, whoever gets the lock does it and the rest go on
+static void page_hash_resize()
+{
+    struct page_hash_table_t* done = NULL;
+    int s = cpu_splhi();
+    if (!spinlock_trylock(&page_hash.resize_lock)) {
+        cpu_splx(s);
+        return;
+    }
+
+    struct page_hash_table_t* old = page_hash.old;
+    struct page_hash_table_t* cur = page_hash.cur;
+    if (!old && page_hash.num_pages > cur->size * PAGE_HASH_LOAD) {
+        // allocated with interrupts back on
+        spinlock_unlock_splx(&page_hash.resize_lock, s);
+        struct page_hash_table_t* table = page_hash_table_alloc(cur->size * 2);
+        if (!table)
+            return;
+
+        s = cpu_splhi();
+        if (!spinlock_trylock(&page_hash.resize_lock)) {
+            cpu_splx(s);
+            kfree(table);
+            return;
+        }
+        if (page_hash.old || page_hash.cur != cur) {
+            spinlock_unlock_splx(&page_hash.resize_lock, s);
+            kfree(table);
+            return;
+        }
+
+        page_hash.next_move = 0;
+        page_hash.old = cur;
+        barrier();
+        page_hash.cur = table;
+        page_hash.num_resizes++;
+        old = cur;
+        cur = table;
     }
 
-    struct page_desc_t* hash_pages = hash->pages[hash_index];
-    if (hash_pages)
-        hash_pages->next_hash = page;
-    page->next_hash = NULL;
-    hash->pages[hash_index] = page;
+    if (old) {
+        for (uint32_t n = 0; n < PAGE_HASH_MIGRATE && page_hash.next_move < old->size; ++n)
+            page_hash_move_bucket(old, cur, page_hash.next_move++);
+        if (page_hash.next_move == old->size) {
+            page_hash.old = NULL;
+            page_hash_drain();
+            done = old;
+        }
+    }
+    spinlock_unlock_splx(&page_hash.resize_lock, s);
 
-    page->cache = cache;
-    page->cache_offset = offset;
+    if (done)
+        kfree(done);
+}
+
+// page now hashed at offset, pinned, an earlier one if it got there
+// first, NULL if that one is being evicted
+struct page_desc_t* page_hash_insert(struct page_cache_t* cache,
+                                     uint64_t offset,
+                                     struct page_desc_t* page)
+{
+    uint64_t h = hash_func(cache, offset);
+    int s = page_hash_enter();
+    struct page_hash_bucket_t* b = page_hash_lock(h);
+
+    struct page_desc_t* p = b->pages;
+    while (p && !(p->cache == cache && p->cache_offset == offset))
+        p = p->next_hash;
+    if (!p) {
+        page->cache = cache;
+        page->cache_offset = offset;
+        page->next_hash = b->pages;
+        b->pages = page;
+        p = page;
+    }
+    if (p->flags & PGF_EVICTING)
+        p = NULL;
+    else
+        fetch_and_add_32(&p->pins, 1);
+
+    spinlock_unlock(&b->lock);
+    page_hash_exit(s);
+
+    if (p == page) {
+        fetch_and_add_32(&page_hash.num_pages, 1);
+        if (page_hash.old || page_hash.num_pages > page_hash.cur->size * PAGE_HASH_LOAD)
+            page_hash_resize();
+    }
+    return p;
 }
 
 struct page_desc_t* page_hash_find(struct page_cache_t* cache,
                                    uint64_t offset)
 {
-    uint32_t hash_index;
-    struct page_hash_t* hash;
-    if (cache->flags & PAGE_CACHE_4K_PAGES) {
-        hash_index = hash_func_local(cache, offset);
-        hash = &cache->hash;
-    } else {
-        hash_index = hash_func(cache, offset);
-        hash = &page_hash;
-    }
+    uint64_t h = hash_func(cache, offset);
+    int s = page_hash_enter();
+    struct page_hash_bucket_t* b = page_hash_lock(h);
 
-    struct page_desc_t* hash_pages = hash->pages[hash_index];
-    struct page_desc_t* page = hash_pages;
-    while (page) {
-        if (page->cache == cache && page->cache_offset == offset)
-            return page;
+    struct page_desc_t* page = b->pages;
+    while (page && !(page->cache == cache && page->cache_offset == offset))
+        page = page->next_hash;
+
+    spinlock_unlock(&b->lock);
+    page_hash_exit(s);
+    return page;
+}
+
+// lookup for a user of the page, pinned. NULL with busy set while
+// it is being evicted
+static struct page_desc_t* page_hash_get(struct page_cache_t* cache,
+                                         uint64_t offset, bool* busy)
+{
+    uint64_t h = hash_func(cache, offset);
+    int s = page_hash_enter();
+    struct page_hash_bucket_t* b = page_hash_lock(h);
+
+    struct page_desc_t* page = b->pages;
+    while (page && !(page->cache == cache && page->cache_offset == offset))
         page = page->next_hash;
+    if (page && (page->flags & PGF_EVICTING)) {
+        *busy = true;
+        page = NULL;
+    } else if (page) {
+        fetch_and_add_32(&page->pins, 1);
     }
 
-    return NULL;
+    spinlock_unlock(&b->lock);
+    page_hash_exit(s);
+    return page;
+}
+
+// no lookup holds it, new ones wait until it is gone
+static bool page_hash_evict(struct page_desc_t* page)
+{
+    uint64_t h = hash_func(page->cache, page->cache_offset);
+    int s = page_hash_enter();
+    struct page_hash_bucket_t* b = page_hash_lock(h);
+
+    bool idle = page->pins == 0;
+    if (idle)
+        page->flags |= PGF_EVICTING;
+
+    spinlock_unlock(&b->lock);
+    page_hash_exit(s);
+    return idle;
 }
 
 void page_hash_remove(struct page_cache_t* cache,
                       uint64_t offset,
                       struct page_desc_t* page_desc)
 {
-    uint32_t hash_index;
-    struct page_hash_t* hash;
-    if (cache->flags & PAGE_CACHE_4K_PAGES) {
-        hash_index = hash_func_local(cache, offset);
-        hash = &cache->hash;
-    } else {
-        hash_index = hash_func(cache, offset);
-        hash = &page_hash;
-    }
-
-    struct page_desc_t* hash_pages = hash->pages[hash_index];
-    struct page_desc_t* page = hash_pages;
-    struct page_desc_t* prev = NULL;
-    while (page) {
-        if (page == page_desc) {
-            if (prev)
-                prev->next_hash = page->next_hash;
-            else
-                hash->pages[hash_index] = page->next_hash;
-
+    uint64_t h = hash_func(cache, offset);
+    int s = page_hash_enter();
+    struct page_hash_bucket_t* b = page_hash_lock(h);
+
+    bool found = false;
+    struct page_desc_t** link = &b->pages;
+    while (*link) {
+        if (*link == page_desc) {
+            *link = page_desc->next_hash;
+            page_desc->next_hash = NULL;
+            found = true;
             break;
         }
-        prev = page;
-        page = page->next_hash;
+        link = &(*link)->next_hash;
     }
+
+    spinlock_unlock(&b->lock);
+    page_hash_exit(s);
+
+    if (found)
+        fetch_and_add_32(&page_hash.num_pages, -1U);
 }
 
 void page_cache_insert(struct page_cache_t* cache,
@@ -128,26 +396,25 @@ void page_cache_remove(struct page_desc_t* page)
     page->prev_cache = NULL;
 }
 
-void vm_hash_init()
+void vm_cache_init()
 {
-    uint32_t page_hash_size = 1;
-    while (page_hash_size < page_db->num_pages)
-        page_hash_size <<= 1;
+    uint32_t size = PAGE_HASH_MIN_SIZE;
+    while (size < page_db->num_pages)
+        size <<= 1;
 
-    printf("vm_hash_init(): page_hash_size: %d (%d bytes)\n",
-        page_hash_size, page_hash_size * (uint32_t)sizeof(uintptr_t));
+    spinlock_init(&page_hash.resize_lock);
+    page_hash.cur = page_hash_table_alloc(size);
+    check(page_hash.cur);
+    page_hash.old = NULL;
 
-    page_hash.size = page_hash_size;
-    page_hash.pages = (struct page_desc_t**)kernel_slack_alloc(page_hash_size * sizeof(uintptr_t), 16);
-    for (uint32_t i = 0; i < page_hash_size; ++i)
-        page_hash.pages[i] = NULL;
-}
+    printf("vm_cache_init(): page_hash size: %d (%d bytes)\n",
+        size, size * (uint32_t)sizeof(struct page_hash_bucket_t));
 
-void vm_cache_init()
-{
     sl_page_cache = kmalloc_get_slab(sizeof(struct page_cache_t));
+    spinlock_init(&cache_ra.lock);
 }
 
+
 static struct page_cache_t* page_cache_alloc()
 {
     return (struct page_cache_t*)slab_list_alloc(sl_page_cache);
@@ -161,76 +428,459 @@ static void page_cache_free(struct page_cache_t* cache)
 struct page_cache_t* vm_cache_create(uint64_t size, uint32_t flags)
 {
     struct page_cache_t* cache = page_cache_alloc();
+    spinlock_init(&cache->lock);
     cache->pages = NULL;
-    cache->hash.pages = NULL;
-    cache->hash.size = 0;
+    cache->maps = NULL;
     cache->read_page = NULL;
     cache->write_page = NULL;
     cache->size = size;
     cache->flags = flags;
     cache->map_refcnt = 0;
+    cache->ra.next = 0;
+    cache->ra.mark = ~0UL;
+    cache->ra.end = 0;
+    cache->ra.size = 0;
+    cache->ra.reading = 0;
+    cond_init(&cache->wait);
+    cache->wait_seq = 0;
+    return cache;
+}
 
-    if ((flags & PAGE_CACHE_4K_PAGES) && !(flags & PAGE_CACHE_NO_HASH)) {
-        // init local hash
-        cache->hash.size = KMALLOC_CHUNK_SIZE / sizeof(uintptr_t);
-        cache->hash.pages = (struct page_desc_t**)kmalloc_alloc();
-        for (uint32_t i = 0; i < cache->hash.size; ++i)
-            cache->hash.pages[i] = NULL;
-    }
+uint64_t vm_cache_page_size(struct page_cache_t* cache)
+{
+    return (cache->flags & PAGE_CACHE_4K_PAGES) ? PAGE_4K_SIZE : PAGE_2M_SIZE;
+}
 
-    return cache;
+// 4K caches take buddy blocks, the rest whole kernel pages. zero
+// filled ones come out of the pre-zeroed pools
+static uintptr_t cache_page_alloc(struct page_cache_t* cache, bool zero)
+{
+    if (cache->flags & PAGE_CACHE_4K_PAGES)
+        return zero ? kernel_page_alloc_zero_4k() : buddy_alloc(0);
+    return zero ? kernel_page_alloc_zero() : kernel_page_alloc();
 }
 
-void vm_cache_release(struct page_cache_t* cache)
+static void cache_page_free(struct page_cache_t* cache, uintptr_t vaddr)
 {
-    --cache->map_refcnt;
-    if (cache->map_refcnt <= 0)
-        vm_cache_delete(cache);
+    if (cache->flags & PAGE_CACHE_4K_PAGES)
+        buddy_free(vaddr);
+    else
+        kernel_page_free(vaddr);
 }
 
-void vm_cache_delete(struct page_cache_t* cache)
+static struct page_desc_t* cache_page_desc(struct page_cache_t* cache, uintptr_t vaddr)
 {
-#if 0
-    if (cache->flags & PAGE_CACHE_4K_PAGES) {
-        if (cache->hash.pages)
-            kmalloc_free((void*)cache->hash.pages);
-        struct page_desc_t* page = cache->pages;
-        while (page) {
-            struct page_desc_t* next = page->next_cache;
-            vm_small_page_free(vm_small_page_desc2addr(page));
-            page = next;
+    if (cache->flags & PAGE_CACHE_4K_PAGES)
+        return buddy_desc(vaddr);
+    return page_db_desc(page_db, page_db_addr2index(page_db, kernel_vaddr_phys(vaddr)));
+}
+
+// caches without a hash are searched through their page list
+static struct page_desc_t* cache_page_list_find(struct page_cache_t* cache, uint64_t offset)
+{
+    struct page_desc_t* page = cache->pages;
+    while (page && page->cache_offset != offset)
+        page = page->next_cache;
+    return page;
+}
+
+static struct page_desc_t* cache_page_get(struct page_cache_t* cache,
+                                          uint64_t offset, bool* busy)
+{
+    if (!(cache->flags & PAGE_CACHE_NO_HASH))
+        return page_hash_get(cache, offset, busy);
+
+    int s = spinlock_lock_splhi(&cache->lock);
+    struct page_desc_t* page = cache_page_list_find(cache, offset);
+    if (page && (page->flags & PGF_EVICTING)) {
+        *busy = true;
+        page = NULL;
+    } else if (page) {
+        fetch_and_add_32(&page->pins, 1);
+    }
+    spinlock_unlock_splx(&cache->lock, s);
+    return page;
+}
+
+// new_page filled in, it or whoever got there first, pinned
+static struct page_desc_t* cache_page_insert(struct page_cache_t* cache, uint64_t offset,
+                                             struct page_desc_t* new_page)
+{
+    struct page_desc_t* page;
+    if (!(cache->flags & PAGE_CACHE_NO_HASH)) {
+        page = page_hash_insert(cache, offset, new_page);
+        if (page == new_page) {
+            int s = spinlock_lock_splhi(&cache->lock);
+            page_cache_insert(cache, page);
+            spinlock_unlock_splx(&cache->lock, s);
         }
+        return page;
+    }
+
+    int s = spinlock_lock_splhi(&cache->lock);
+    page = cache_page_list_find(cache, offset);
+    if (!page) {
+        page = new_page;
+        page->cache = cache;
+        page->cache_offset = offset;
+        page_cache_insert(cache, page);
+    }
+    if (page->flags & PGF_EVICTING)
+        page = NULL;
+    else
+        fetch_and_add_32(&page->pins, 1);
+    spinlock_unlock_splx(&cache->lock, s);
+    return page;
+}
+
+// readahead does not reclaim for itself
+static struct page_desc_t* cache_page_fill(struct page_cache_t* cache, uint64_t offset,
+                                           bool reclaim)
+{
+    uintptr_t vaddr = cache_page_alloc(cache, !cache->read_page);
+    if (!vaddr) {
+        if (!reclaim)
+            return NULL;
+        // nothing free, take it from the page cache itself
+        vm_reclaim_pages(VM_RECLAIM_BATCH);
+        vaddr = cache_page_alloc(cache, !cache->read_page);
+        if (!vaddr)
+            return NULL;
+    }
+
+    if (cache->read_page)
+        cache->read_page(vaddr, offset);
+
+    struct page_desc_t* page = cache_page_desc(cache, vaddr);
+    page->vaddr = vaddr;
+    return page;
+}
+
+static bool cache_page_present(struct page_cache_t* cache, uint64_t offset)
+{
+    if (!(cache->flags & PAGE_CACHE_NO_HASH))
+        return page_hash_find(cache, offset) != NULL;
+
+    int s = spinlock_lock_splhi(&cache->lock);
+    bool present = cache_page_list_find(cache, offset) != NULL;
+    spinlock_unlock_splx(&cache->lock, s);
+    return present;
+}
+
+static void cache_ra_queue(struct page_cache_t* cache, uint64_t offset, uint32_t num_pages)
+{
+    if (!cache_ra.started)
+        return;
+
+    // the window keeps the cache around until it is read
+    int s = spinlock_lock_splhi(&cache->lock);
+    bool mapped = cache->map_refcnt > 0;
+    if (mapped)
+        cache->map_refcnt++;
+    spinlock_unlock_splx(&cache->lock, s);
+    if (!mapped)
+        return;
+
+    s = spinlock_lock_splhi(&cache_ra.lock);
+    bool full = cache_ra.tail - cache_ra.head == CACHE_RA_QUEUE;
+    if (!full) {
+        struct cache_ra_req_t* req = &cache_ra.queue[cache_ra.tail++ % CACHE_RA_QUEUE];
+        req->cache = cache;
+        req->offset = offset;
+        req->num_pages = num_pages;
+        cache_ra.num_windows++;
     } else {
-        struct page_desc_t* page = cache->pages;
-        while (page) {
-            struct page_desc_t* next = page->next_cache;
-            page_hash_remove(cache, page->cache_offset, page);
-            vm_big_page_free(vm_big_page_desc2addr(page));
-            page = next;
+        cache_ra.num_dropped++;
+    }
+    spinlock_unlock_splx(&cache_ra.lock, s);
+
+    if (full)
+        vm_cache_release(cache);
+    else
+        sema_signal(&cache_ra.wake);
+}
+
+// window bookkeeping for a lookup of offset
+static void cache_ra_update(struct page_cache_t* cache, uint64_t offset)
+{
+    uint64_t page_size = vm_cache_page_size(cache);
+    uint32_t max_pages = PAGE_CACHE_RA_MAX / page_size;
+    if (max_pages < 1)
+        max_pages = 1;
+
+    struct page_cache_ra_t* ra = &cache->ra;
+    uint64_t start = 0;
+    uint32_t num_pages = 0;
+
+    int s = spinlock_lock_splhi(&cache->lock);
+    if (offset == ra->mark || (offset == ra->next && offset >= ra->end)) {
+        ra->size = ra->size ? ra->size * 2 : PAGE_CACHE_RA_MIN;
+        if (ra->size > max_pages)
+            ra->size = max_pages;
+        start = offset + page_size > ra->end ? offset + page_size : ra->end;
+        num_pages = ra->size;
+        ra->mark = start;
+        ra->end = start + num_pages * page_size;
+    } else if (offset != ra->next) {
+        ra->size /= 2;
+        if (ra->size < PAGE_CACHE_RA_MIN)
+            ra->size = 0;
+        ra->mark = ~0UL;
+        ra->end = 0;
+    }
+    ra->next = offset + page_size;
+    spinlock_unlock_splx(&cache->lock, s);
+
+    if (num_pages && start < cache->size)
+        cache_ra_queue(cache, start, num_pages);
+}
+
+// faults on the page being read sleep until it moves on, the lock
+// also orders it before the lookups that follow
+static void cache_ra_reading(struct page_cache_t* cache, uint64_t reading)
+{
+    int s = spinlock_lock_splhi(&cache->lock);
+    cache->ra.reading = reading;
+    vm_cache_wakeup_locked(cache);
+    spinlock_unlock_splx(&cache->lock, s);
+}
+
+// fill in the pages of a window not in the cache yet, every page is
+// in before the next one is marked
+static void cache_ra_read(struct page_cache_t* cache, uint64_t offset, uint32_t num_pages)
+{
+    uint64_t page_size = vm_cache_page_size(cache);
+    for (; num_pages && offset < cache->size; --num_pages, offset += page_size) {
+        cache_ra_reading(cache, offset + 1);
+        if (cache_page_present(cache, offset))
+            continue;
+
+        struct page_desc_t* new_page = cache_page_fill(cache, offset, false);
+        if (!new_page)
+            break;
+
+        struct page_desc_t* page = cache_page_insert(cache, offset, new_page);
+        if (page == new_page) {
+            vm_reclaim_add(page);
+            fetch_and_add_32(&cache_ra.num_pages, 1);
+        } else {
+            cache_page_free(cache, new_page->vaddr);
         }
+        if (page)
+            vm_cache_put_page(page);
     }
-#endif
-    page_cache_free(cache);
+    cache_ra_reading(cache, 0);
 }
 
-void page_hash_dump(struct page_hash_t* hash)
+static void cache_ra_thread()
 {
-    if (!hash)
-        hash = &page_hash;
+    while (1) {
+        sema_wait(&cache_ra.wake);
 
-    printf("page_hash_dump(): size: %d\n", hash->size);
-    for (uint32_t i = 0; i < hash->size; ++i) {
-        struct page_desc_t* page = hash->pages[i];
-        if (!page)
+        int s = spinlock_lock_splhi(&cache_ra.lock);
+        struct cache_ra_req_t req = cache_ra.queue[cache_ra.head++ % CACHE_RA_QUEUE];
+        spinlock_unlock_splx(&cache_ra.lock, s);
+
+        cache_ra_read(req.cache, req.offset, req.num_pages);
+        vm_cache_release(req.cache);
+    }
+}
+
+// needs the scheduler up
+void vm_cache_start()
+{
+    sema_init(&cache_ra.wake, 0);
+    struct thread_t* t = thread_create(cache_ra_thread, 0x1000, get_cpu_id());
+    check(t);
+    cache_ra.started = true;
+}
+
+// cache locked, lookups waiting on the cache look again
+void vm_cache_wakeup_locked(struct page_cache_t* cache)
+{
+    cache->wait_seq++;
+    cond_broadcast(&cache->wait);
+}
+
+// sleep until the next wakeup after seq was read
+static void cache_wait(struct page_cache_t* cache, uint32_t seq)
+{
+    int s = spinlock_lock_splhi(&cache->lock);
+    while (cache->wait_seq == seq)
+        cond_wait(&cache->wait, &cache->lock);
+    spinlock_unlock_splx(&cache->lock, s);
+}
+
+// page holding offset, pinned until vm_cache_put_page. on a miss a
+// new one is filled through read_page, or zeroed without one, before
+// anyone else can see it. read_page may block so it runs with no
+// lock held. a page being evicted is waited out, it may have to be
+// written back before it can be read in again
+struct page_desc_t* vm_cache_get_page(struct page_cache_t* cache, uint64_t offset)
+{
+    offset &= ~(vm_cache_page_size(cache) - 1);
+    if (offset >= cache->size)
+        return NULL;
+    if (cache->read_page)
+        cache_ra_update(cache, offset);
+
+    while (1) {
+        // read before the lookup, a wakeup after it changes it
+        uint32_t seq = cache->wait_seq;
+        bool busy = false;
+        struct page_desc_t* page = cache_page_get(cache, offset, &busy);
+        if (page)
+            return page;
+        if (busy) {
+            cache_wait(cache, seq);
+            continue;
+        }
+        if (cache->ra.reading == offset + 1) {
+            fetch_and_add_32(&cache_ra.num_waits, 1);
+            cache_wait(cache, seq);
             continue;
-        printf("[%d]\n", i);
-        while (page) {
-            printf("\tpage: cache[%p:%llu]\n", page->cache, page->cache_offset);
-            page = page->next_hash;
         }
+
+        struct page_desc_t* new_page = cache_page_fill(cache, offset, true);
+        if (!new_page)
+            return NULL;
+
+        // another fault on the same page may have filled it meanwhile
+        page = cache_page_insert(cache, offset, new_page);
+        if (page == new_page)
+            vm_reclaim_add(page);
+        else
+            cache_page_free(cache, new_page->vaddr);
+        if (page)
+            return page;
     }
 }
 
+void vm_cache_put_page(struct page_desc_t* page)
+{
+    fetch_and_add_32(&page->pins, -1U);
+}
+
+// start evicting page, false while somebody has it pinned. lookups
+// wait for vm_cache_evict_end
+bool vm_cache_evict_begin(struct page_desc_t* page)
+{
+    struct page_cache_t* cache = page->cache;
+    if (!(cache->flags & PAGE_CACHE_NO_HASH))
+        return page_hash_evict(page);
+
+    int s = spinlock_lock_splhi(&cache->lock);
+    bool idle = page->pins == 0;
+    if (idle)
+        page->flags |= PGF_EVICTING;
+    spinlock_unlock_splx(&cache->lock, s);
+    return idle;
+}
+
+// off the lists, unmapped and written back, the page goes. once the
+// cache lock is dropped vm_cache_delete may free the cache
+static void cache_page_release(struct page_cache_t* cache, struct page_desc_t* page)
+{
+    uintptr_t vaddr = page->vaddr;
+    bool small = cache->flags & PAGE_CACHE_4K_PAGES;
+    if (!(cache->flags & PAGE_CACHE_NO_HASH))
+        page_hash_remove(cache, page->cache_offset, page);
+
+    int s = spinlock_lock_splhi(&cache->lock);
+    page_cache_remove(page);
+    vm_cache_wakeup_locked(cache);
+    spinlock_unlock_splx(&cache->lock, s);
+
+    page->cache = NULL;
+    page->cache_offset = 0;
+    page->flags &= ~(PGF_EVICTING | PGF_REFERENCED | PGF_ACTIVE | PGF_LRU | PGF_DIRTY);
+    if (small)
+        buddy_free(vaddr);
+    else
+        kernel_page_free(vaddr);
+}
+
+// it stays after all
+void vm_cache_evict_cancel(struct page_desc_t* page)
+{
+    struct page_cache_t* cache = page->cache;
+    if (!(cache->flags & PAGE_CACHE_NO_HASH)) {
+        uint64_t h = hash_func(cache, page->cache_offset);
+        int s = page_hash_enter();
+        struct page_hash_bucket_t* b = page_hash_lock(h);
+        page->flags &= ~PGF_EVICTING;
+        spinlock_unlock(&b->lock);
+        page_hash_exit(s);
+    }
+
+    // lookups of a hashed page see the flag under the bucket lock
+    int s = spinlock_lock_splhi(&cache->lock);
+    if (cache->flags & PAGE_CACHE_NO_HASH)
+        page->flags &= ~PGF_EVICTING;
+    vm_cache_wakeup_locked(cache);
+    spinlock_unlock_splx(&cache->lock, s);
+}
+
+void vm_cache_evict_end(struct page_desc_t* page)
+{
+    cache_page_release(page->cache, page);
+}
+
+void vm_cache_release(struct page_cache_t* cache)
+{
+    int s = spinlock_lock_splhi(&cache->lock);
+    int refcnt = --cache->map_refcnt;
+    spinlock_unlock_splx(&cache->lock, s);
+    if (refcnt <= 0)
+        vm_cache_delete(cache);
+}
+
+// nothing may have its pages mapped anymore. pages the reclaim
+// thread is looking at are left to it, it either evicts them or
+// puts them back on its lists, both wake us under the cache lock
+void vm_cache_delete(struct page_cache_t* cache)
+{
+    while (1) {
+        int s = spinlock_lock_splhi(&cache->lock);
+        struct page_desc_t* page = cache->pages;
+        bool taken = page && vm_reclaim_take(page);
+        if (page && !taken)
+            cond_wait(&cache->wait, &cache->lock);
+        spinlock_unlock_splx(&cache->lock, s);
+
+        if (!page)
+            break;
+        if (taken)
+            cache_page_release(cache, page);
+    }
+
+    page_cache_free(cache);
+}
+
+void page_hash_dump()
+{
+    int s = page_hash_enter();
+    struct page_hash_table_t* table = page_hash.cur;
+    uint32_t used = 0;
+    uint32_t longest = 0;
+    for (uint32_t i = 0; i < table->size; ++i) {
+        struct page_hash_bucket_t* b = &table->buckets[i];
+        uint32_t n = 0;
+        spinlock_lock(&b->lock);
+        for (struct page_desc_t* page = b->pages; page; page = page->next_hash)
+            ++n;
+        spinlock_unlock(&b->lock);
+        if (n)
+            ++used;
+        if (n > longest)
+            longest = n;
+    }
+    printf("page_hash_dump(): size %d pages %d used %d longest %d resizes %d%s\n",
+        table->size, page_hash.num_pages, used, longest, page_hash.num_resizes,
+        page_hash.old ? " (resizing)" : "");
+    page_hash_exit(s);
+}
+
 void page_cache_dump(struct page_cache_t* cache)
 {
     printf("page_cache_dump(): cache %p\n", cache);
@@ -240,3 +890,10 @@ void page_cache_dump(struct page_cache_t* cache)
         page = page->next_cache;
     }
 }
+
+void page_cache_ra_dump()
+{
+    printf("page_cache_ra_dump(): windows %d pages %d dropped %d waits %d queued %d\n",
+        cache_ra.num_windows, cache_ra.num_pages, cache_ra.num_dropped,
+        cache_ra.num_waits, cache_ra.tail - cache_ra.head);
+}
@@ -2,49 +2,71 @@
 #define KERNEL_VM_CACHE_H
 
 #include "types.h"
+#include "spinlock.h"
+#include "cond.h"
 
 struct page_desc_t;
-
-struct page_hash_t {
-    struct page_desc_t** pages;
-    uint32_t size;
-};
+struct vm_area_t;
 
 #define PAGE_CACHE_4K_PAGES 0x01
 #define PAGE_CACHE_NO_HASH  0x02
 
 typedef void (*page_cache_fn)(uintptr_t vaddr, uint64_t offset);
 
+// readahead of caches with read_page, pages
+#define PAGE_CACHE_RA_MIN   4
+#define PAGE_CACHE_RA_MAX   (256 * 1024)    // bytes
+
+struct page_cache_ra_t {
+    uint64_t next;              // offset a sequential reader looks up next
+    uint64_t mark;              // looking it up queues the next window
+    uint64_t end;               // read ahead up to here
+    uint32_t size;              // window, pages
+    volatile uint64_t reading;  // offset + 1 being filled by the thread
+};
+
 struct page_cache_t {
+    struct spinlock_t lock;     // pages list
     struct page_desc_t* pages;
-    struct page_hash_t hash;
+    struct vm_area_t* maps;     // areas mapping it, vm_mmap
     page_cache_fn read_page;
     page_cache_fn write_page;
     uint64_t size; // size may be unaligned to page size
     uint32_t flags;
     int map_refcnt;
+    struct page_cache_ra_t ra;
+    struct condition_t wait;    // lookups waiting out a busy page, lock
+    volatile uint32_t wait_seq; // bumped by every wakeup
 };
 
-void vm_hash_init(void);
 void vm_cache_init(void);
+void vm_cache_start(void);
 
 struct page_cache_t* vm_cache_create(uint64_t size, uint32_t flags);
 void vm_cache_release(struct page_cache_t* cache);
 void vm_cache_delete(struct page_cache_t* cache);
+uint64_t vm_cache_page_size(struct page_cache_t* cache);
+struct page_desc_t* vm_cache_get_page(struct page_cache_t* cache, uint64_t offset);
+void vm_cache_put_page(struct page_desc_t* page);
+bool vm_cache_evict_begin(struct page_desc_t* page);
+void vm_cache_evict_cancel(struct page_desc_t* page);
+void vm_cache_evict_end(struct page_desc_t* page);
+void vm_cache_wakeup_locked(struct page_cache_t* cache);
 
 void page_cache_insert(struct page_cache_t* cache,
                        struct page_desc_t* page);
 void page_cache_remove(struct page_desc_t* page);
 void page_cache_dump(struct page_cache_t* cache);
+void page_cache_ra_dump(void);
 
-void page_hash_insert(struct page_cache_t* cache,
-                      uint64_t offset,
-                      struct page_desc_t* page);
+struct page_desc_t* page_hash_insert(struct page_cache_t* cache,
+                                     uint64_t offset,
+                                     struct page_desc_t* page);
 struct page_desc_t* page_hash_find(struct page_cache_t* cache,
                                    uint64_t offset);
 void page_hash_remove(struct page_cache_t* cache,
                       uint64_t offset,
                       struct page_desc_t* page_desc);
-void page_hash_dump(struct page_hash_t* hash);
+void page_hash_dump(void);
 
 #endif // KERNEL_VM_CACHE_H
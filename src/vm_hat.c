@@ -1 +1,815 @@
 #include "vm_hat.h"
+#include "vm_page.h"
+#include "vm_buddy.h"
+#include "vm_boot.h"
+#include "kmalloc.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "local_apic.h"
+#include "interrupt.h"
+#include "x86.h"
+#include "stdio.h"
+
+// page table pages are 4K buddy blocks, reached through the physical
+// window, boot tables below kernel_top through the kernel window.
+// a level l entry maps HAT_LEVEL_SIZE(l), pml4 entries are level 3.
+//
+// tables are only unlinked when a range covers all of them, they go
+// on the flush batch and are freed once nothing can walk them
+
+#define HAT_TABLE_FLAGS     (PAGE_PRESENT | PAGE_WRITE)
+
+struct vm_hat_t kernel_hat;
+
+// every other address space, their kernel half pml4 entries are
+// copies of kernel_hat's and new ones are copied as they appear
+static struct spinlock_t hat_list_lock;
+static struct vm_hat_t* hat_list;
+
+// leaf levels in use, 1G when the cpu has them
+static uint32_t hat_leaf_levels = (1U << 0) | (1U << 1);
+
+// page walks on tlb misses, intel event encodings (haswell on)
+#define HAT_PERF_DTLB_WALKS     0x0e08  // DTLB_LOAD_MISSES.WALK_COMPLETED
+#define HAT_PERF_ITLB_WALKS     0x0e85  // ITLB_MISSES.WALK_COMPLETED
+
+static bool hat_perf;
+
+// pcids
+//
+// every cpu hands out its own pcids, an address space gets one per
+// cpu on first use there and keeps it for the cpu's generation. when
+// a cpu runs out it starts a new generation with all its pcids
+// flushed, older ones get a fresh id on their next switch in.
+// kernel_hat is pcid 0 and the kernel half is global in all of them.
+//
+// each flush bumps the hat's tlb_gen before looking for cpus to
+// shoot down, a cpu holding the hat's entries under a pcid without
+// running it compares tlb_gen on its next switch in and loads cr3
+// without the noflush bit if it has moved, dropping just that pcid
+
+struct hat_pcid_t {
+    uint32_t gen;
+    uint32_t next;
+} __attribute__((aligned(64)));
+
+static struct hat_pcid_t hat_pcid[MAX_CPUS];
+static bool hat_has_pcid;
+static bool hat_has_invpcid;
+
+static inline uint64_t* hat_table_vaddr(uint64_t entry)
+{
+    uintptr_t paddr = entry & PAGE_ADDR_MASK;
+    if (paddr < kernel_boot_info()->kernel_top)
+        return (uint64_t*)KERNEL_VADDR(paddr);
+    return (uint64_t*)PHYS_VADDR(paddr);
+}
+
+static inline bool hat_is_leaf(uint64_t entry, uint32_t level)
+{
+    return level == 0 || (entry & PAGE_2MB);
+}
+
+static inline bool hat_is_active(struct vm_hat_t* hat)
+{
+    return hat == &kernel_hat || get_cpu()->hat == hat;
+}
+
+static uint64_t* hat_table_alloc(struct vm_hat_t* hat)
+{
+    uintptr_t vaddr = kernel_page_alloc_zero_4k();
+    if (!vaddr)
+        return NULL;
+    fetch_and_add_32(&hat->num_tables, 1);
+    return (uint64_t*)vaddr;
+}
+
+// the table and everything hanging off it
+static void hat_table_free(struct vm_hat_t* hat, uint64_t* table, uint32_t level)
+{
+    if (level > 0) {
+        for (uint32_t i = 0; i < PDIR_NUM_ENTRIES; ++i) {
+            uint64_t e = table[i];
+            if ((e & PAGE_PRESENT) && !hat_is_leaf(e, level))
+                hat_table_free(hat, hat_table_vaddr(e), level - 1);
+        }
+    }
+    buddy_free((uintptr_t)table);
+    fetch_and_add_32(&hat->num_tables, -1U);
+}
+
+void vm_hat_flush_init(struct vm_hat_flush_t* f, struct vm_hat_t* hat)
+{
+    f->hat = hat;
+    f->num_pages = 0;
+    f->num_tables = 0;
+    f->full = false;
+}
+
+void vm_hat_flush_page(struct vm_hat_flush_t* f, uintptr_t vaddr)
+{
+    if (f->num_pages < HAT_FLUSH_PAGES)
+        f->pages[f->num_pages++] = vaddr;
+    else
+        f->full = true;
+}
+
+// span that may hold 4K leaves anywhere
+static void hat_flush_range(struct vm_hat_flush_t* f, uintptr_t vaddr, uint64_t size)
+{
+    if (f->full || size > (HAT_FLUSH_PAGES << PAGE_4K_SHIFT)) {
+        f->full = true;
+        return;
+    }
+    for (uint64_t offset = 0; offset < size; offset += PAGE_4K_SIZE)
+        vm_hat_flush_page(f, vaddr + offset);
+}
+
+// entry at level was pointing to a table
+static void hat_flush_table(struct vm_hat_flush_t* f,
+                            uint64_t entry, uint32_t level, uintptr_t vaddr)
+{
+    check(f->num_tables < HAT_FLUSH_TABLES);
+    f->tables[f->num_tables].vaddr = (uintptr_t)hat_table_vaddr(entry);
+    f->tables[f->num_tables].level = level - 1;
+    f->num_tables++;
+    hat_flush_range(f, vaddr, HAT_LEVEL_SIZE(level));
+}
+
+// tlb shootdown
+//
+// every cpu has a queue of pages to invalidate and the generation of
+// the last request it has gone through. senders queue their batch on
+// each cpu running the address space, so invlpg there hits its pcid,
+// every cpu for kernel_hat as its pages are global. ipi only the ones
+// without an ipi already pending, so concurrent unmaps share a round.
+// cpus halted in idle are neither interrupted nor waited for, the
+// interrupt that wakes them up catches up on the queue first thing
+
+struct hat_tlb_t {
+    struct spinlock_t lock;
+    uint32_t num_pages;
+    bool full;
+    bool ipi_pending;
+    volatile uint32_t req_gen;
+    volatile uint32_t done_gen;
+    uintptr_t pages[HAT_FLUSH_PAGES];
+} __attribute__((aligned(64)));
+
+static struct hat_tlb_t hat_tlb[MAX_CPUS];
+static uint32_t hat_tlb_gen;
+
+static struct {
+    uint32_t num_shootdowns;
+    uint32_t num_ipis;
+    uint32_t num_lazy;      // cpus skipped while idle
+    uint32_t num_pcid_rollovers;
+} hat_tlb_stats;
+
+void vm_hat_tlb_process(struct cpu_desc_t* cpu)
+{
+    struct hat_tlb_t* q = &hat_tlb[cpu->apic_id];
+    int s = spinlock_lock_splhi(&q->lock);
+    if (q->done_gen != q->req_gen) {
+        if (q->full) {
+            tlb_flush_global();
+        } else {
+            for (uint32_t i = 0; i < q->num_pages; ++i)
+                invlpg(q->pages[i]);
+        }
+        q->num_pages = 0;
+        q->full = false;
+        q->done_gen = q->req_gen;
+    }
+    q->ipi_pending = false;
+    spinlock_unlock_splx(&q->lock, s);
+}
+
+// interrupts off, right before hlt
+void vm_hat_tlb_idle(struct cpu_desc_t* cpu)
+{
+    cpu->tlb_lazy = 1;
+    mfence();
+    vm_hat_tlb_process(cpu);
+}
+
+// first thing on an interrupt while lazy
+void vm_hat_tlb_wake(struct cpu_desc_t* cpu)
+{
+    struct hat_tlb_t* q = &hat_tlb[cpu->apic_id];
+    cpu->tlb_lazy = 0;
+    mfence();
+    if (q->done_gen != q->req_gen)
+        vm_hat_tlb_process(cpu);
+}
+
+static inline bool hat_tlb_done(uint32_t id, uint32_t gen)
+{
+    return (int32_t)(hat_tlb[id].done_gen - gen) >= 0 || cpus[id].tlb_lazy;
+}
+
+static void hat_shootdown(struct vm_hat_flush_t* f)
+{
+    struct cpu_desc_t* self = get_cpu();
+    uint32_t gen = fetch_and_add_32(&hat_tlb_gen, 1) + 1;
+    uint32_t wait_mask = 0;
+
+    for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+        struct cpu_desc_t* cpu = &cpus[i];
+        if (cpu == self || !(cpu->flags & CPU_FLAGS_ACTIVE))
+            continue;
+        if (f->hat != &kernel_hat && cpu->hat != f->hat)
+            continue;
+
+        struct hat_tlb_t* q = &hat_tlb[i];
+        int s = spinlock_lock_splhi(&q->lock);
+        if (f->full || q->full || q->num_pages + f->num_pages > HAT_FLUSH_PAGES) {
+            q->full = true;
+        } else {
+            for (uint32_t j = 0; j < f->num_pages; ++j)
+                q->pages[q->num_pages++] = f->pages[j];
+        }
+        if ((int32_t)(gen - q->req_gen) > 0)
+            q->req_gen = gen;
+
+        // pairs with vm_hat_tlb_wake, either we see it awake
+        // or it sees the request
+        mfence();
+        bool lazy = cpu->tlb_lazy;
+        bool send = !lazy && !q->ipi_pending;
+        if (send)
+            q->ipi_pending = true;
+        spinlock_unlock_splx(&q->lock, s);
+
+        if (lazy) {
+            fetch_and_add_32(&hat_tlb_stats.num_lazy, 1);
+            continue;
+        }
+        wait_mask |= 1U << i;
+        if (send) {
+            fetch_and_add_32(&hat_tlb_stats.num_ipis, 1);
+            local_apic_ipi(cpu->apic_id, VECTOR_TLB_SHOOTDOWN);
+        }
+    }
+    fetch_and_add_32(&hat_tlb_stats.num_shootdowns, 1);
+
+    // keep answering requests aimed at us, the other side may be
+    // waiting on us in the same loop
+    struct hat_tlb_t* self_q = &hat_tlb[self->apic_id];
+    while (wait_mask) {
+        for (uint32_t i = 0; i < MAX_CPUS; ++i) {
+            if ((wait_mask & (1U << i)) && hat_tlb_done(i, gen))
+                wait_mask &= ~(1U << i);
+        }
+        if (self_q->done_gen != self_q->req_gen)
+            vm_hat_tlb_process(self);
+        cpu_pause();
+    }
+}
+
+void vm_hat_flush(struct vm_hat_flush_t* f)
+{
+    if (f->num_pages || f->full) {
+        // before anyone is looked at, pairs with vm_hat_activate
+        fetch_and_add_32((uint32_t*)&f->hat->tlb_gen, 1);
+        if (hat_is_active(f->hat)) {
+            if (f->hat == &kernel_hat && f->full) {
+                tlb_flush_global();
+            } else if (f->full) {
+                tlb_flush();
+            } else {
+                for (uint32_t i = 0; i < f->num_pages; ++i)
+                    invlpg(f->pages[i]);
+            }
+        }
+        if (num_cpus > 1)
+            hat_shootdown(f);
+    }
+
+    for (uint32_t i = 0; i < f->num_tables; ++i)
+        hat_table_free(f->hat, (uint64_t*)f->tables[i].vaddr, f->tables[i].level);
+
+    vm_hat_flush_init(f, f->hat);
+}
+
+// room for another unlinked table, flushes with the lock dropped
+static int hat_flush_reserve(struct vm_hat_flush_t* f, int s)
+{
+    if (f->num_tables < HAT_FLUSH_TABLES)
+        return s;
+    spinlock_unlock_splx(&f->hat->lock, s);
+    vm_hat_flush(f);
+    return spinlock_lock_splhi(&f->hat->lock);
+}
+
+// turn a large leaf into a table of the next size down,
+// same translation so the old entry can stay in the tlb until flushed
+static bool hat_split(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                      uint64_t* e, uint32_t level, uintptr_t vaddr)
+{
+    uint64_t* table = hat_table_alloc(hat);
+    if (!table)
+        return false;
+
+    uint64_t size = HAT_LEVEL_SIZE(level - 1);
+    uint64_t paddr = *e & PAGE_ADDR_MASK & ~(HAT_LEVEL_SIZE(level) - 1);
+    uint64_t flags = *e & ((0xFFF & ~PAGE_2MB) | PAGE_NX);
+    // pat moves to bit 7 in 4K leaves, where large ones have PS
+    if (level > 1)
+        flags |= PAGE_2MB | (*e & PAGE_PAT_LARGE);
+    else if (*e & PAGE_PAT_LARGE)
+        flags |= PAGE_PAT;
+    for (uint32_t i = 0; i < PDIR_NUM_ENTRIES; ++i)
+        table[i] = (paddr + i * size) | flags;
+
+    *e = kernel_vaddr_phys((uintptr_t)table) | HAT_TABLE_FLAGS | (*e & PAGE_USER);
+    vm_hat_flush_page(f, vaddr & ~(HAT_LEVEL_SIZE(level) - 1));
+    return true;
+}
+
+// entry for vaddr at level, missing tables are created
+// and larger leaves on the way split
+static uint64_t* hat_walk(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                          uintptr_t vaddr, uint32_t level, uint64_t table_flags)
+{
+    uint64_t* table = hat->pml4;
+    for (uint32_t l = HAT_LEVELS - 1; l > level; --l) {
+        uint64_t* e = &table[HAT_INDEX(vaddr, l)];
+        if (!(*e & PAGE_PRESENT)) {
+            uint64_t* t = hat_table_alloc(hat);
+            if (!t)
+                return NULL;
+            *e = kernel_vaddr_phys((uintptr_t)t) | HAT_TABLE_FLAGS;
+            if (hat == &kernel_hat && l == HAT_LEVELS - 1)
+                vm_hat_kernel_pml4(HAT_INDEX(vaddr, l));
+        } else if (hat_is_leaf(*e, l)) {
+            if (!hat_split(hat, f, e, l, vaddr))
+                return NULL;
+        }
+        *e |= table_flags;
+        table = hat_table_vaddr(*e);
+    }
+    return &table[HAT_INDEX(vaddr, level)];
+}
+
+// largest page both addresses are aligned to and the range still covers
+static uint32_t hat_leaf_level(uintptr_t vaddr, uintptr_t paddr, uint64_t size)
+{
+    for (uint32_t level = 2; level > 0; --level) {
+        uint64_t n = HAT_LEVEL_SIZE(level);
+        if ((hat_leaf_levels & (1U << level))
+                && !((vaddr | paddr) & (n - 1)) && size >= n)
+            return level;
+    }
+    return 0;
+}
+
+bool vm_hat_map(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                uintptr_t vaddr, uintptr_t paddr, uint64_t size, uint32_t prot)
+{
+    check(!((vaddr | paddr | size) & (PAGE_4K_SIZE - 1)));
+
+    struct vm_hat_flush_t local;
+    if (!f) {
+        f = &local;
+        vm_hat_flush_init(f, hat);
+    }
+
+    uint64_t flags = PAGE_PRESENT;
+    if (prot & HAT_WRITE)
+        flags |= PAGE_WRITE;
+    if (prot & HAT_USER)
+        flags |= PAGE_USER;
+    if (prot & HAT_NOCACHE)
+        flags |= PAGE_PCD | PAGE_PWT;
+    if (hat == &kernel_hat)
+        flags |= PAGE_GLOBAL;
+
+    bool ok = true;
+    int s = spinlock_lock_splhi(&hat->lock);
+    while (size) {
+        s = hat_flush_reserve(f, s);
+
+        uint32_t level = hat_leaf_level(vaddr, paddr, size);
+        uint64_t* e = hat_walk(hat, f, vaddr, level, flags & PAGE_USER);
+        if (!e) {
+            ok = false;
+            break;
+        }
+
+        uint64_t old = *e;
+        *e = paddr | flags | (level > 0 ? PAGE_2MB : 0);
+        if (old & PAGE_PRESENT) {
+            if (hat_is_leaf(old, level))
+                vm_hat_flush_page(f, vaddr);
+            else
+                hat_flush_table(f, old, level, vaddr);
+        }
+
+        uint64_t n = HAT_LEVEL_SIZE(level);
+        vaddr += n;
+        paddr += n;
+        size -= n;
+    }
+    spinlock_unlock_splx(&hat->lock, s);
+
+    if (f == &local)
+        vm_hat_flush(f);
+    return ok;
+}
+
+// pml4 entries stay, the kernel ones are shared between address spaces
+void vm_hat_unmap(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                  uintptr_t vaddr, uint64_t size)
+{
+    check(!((vaddr | size) & (PAGE_4K_SIZE - 1)));
+
+    struct vm_hat_flush_t local;
+    if (!f) {
+        f = &local;
+        vm_hat_flush_init(f, hat);
+    }
+
+    uintptr_t end = vaddr + size;
+    int s = spinlock_lock_splhi(&hat->lock);
+    while (vaddr < end) {
+        s = hat_flush_reserve(f, s);
+
+        uint64_t* table = hat->pml4;
+        uint32_t level = HAT_LEVELS - 1;
+        uint64_t* e;
+        bool whole;
+        while (1) {
+            uint64_t span = HAT_LEVEL_SIZE(level);
+            e = &table[HAT_INDEX(vaddr, level)];
+            whole = level < HAT_LEVELS - 1
+                 && !(vaddr & (span - 1)) && end - vaddr >= span;
+            if (!(*e & PAGE_PRESENT) || whole || hat_is_leaf(*e, level))
+                break;
+            table = hat_table_vaddr(*e);
+            --level;
+        }
+
+        uint64_t span = HAT_LEVEL_SIZE(level);
+        uint64_t old = *e;
+        if (!(old & PAGE_PRESENT)) {
+            vaddr = (vaddr & ~(span - 1)) + span;
+        } else if (whole) {
+            *e = 0;
+            if (hat_is_leaf(old, level))
+                vm_hat_flush_page(f, vaddr);
+            else
+                hat_flush_table(f, old, level, vaddr);
+            vaddr += span;
+        } else if (!hat_split(hat, f, e, level, vaddr)) {
+            kernel_panic("vm_hat_unmap: split");
+        }
+    }
+    spinlock_unlock_splx(&hat->lock, s);
+
+    if (f == &local)
+        vm_hat_flush(f);
+}
+
+bool vm_hat_lookup(struct vm_hat_t* hat, uintptr_t vaddr,
+                   uintptr_t* paddr, uint64_t* page_size)
+{
+    bool found = false;
+    int s = spinlock_lock_splhi(&hat->lock);
+    uint64_t* table = hat->pml4;
+    for (uint32_t level = HAT_LEVELS - 1; ; --level) {
+        uint64_t e = table[HAT_INDEX(vaddr, level)];
+        if (!(e & PAGE_PRESENT))
+            break;
+        if (hat_is_leaf(e, level)) {
+            uint64_t size = HAT_LEVEL_SIZE(level);
+            *paddr = (e & PAGE_ADDR_MASK & ~(size - 1)) | (vaddr & (size - 1));
+            if (page_size)
+                *page_size = size;
+            found = true;
+            break;
+        }
+        table = hat_table_vaddr(e);
+    }
+    spinlock_unlock_splx(&hat->lock, s);
+    return found;
+}
+
+// leaf mapping vaddr, NULL if there is none
+static uint64_t* hat_find_leaf(struct vm_hat_t* hat, uintptr_t vaddr, uint32_t* level)
+{
+    uint64_t* table = hat->pml4;
+    for (uint32_t l = HAT_LEVELS - 1; ; --l) {
+        uint64_t* e = &table[HAT_INDEX(vaddr, l)];
+        if (!(*e & PAGE_PRESENT))
+            return NULL;
+        if (hat_is_leaf(*e, l)) {
+            *level = l;
+            return e;
+        }
+        table = hat_table_vaddr(*e);
+    }
+}
+
+static inline uint32_t hat_leaf_bits(uint64_t e)
+{
+    return ((e & PAGE_ACCESSED) ? HAT_REFERENCED : 0)
+         | ((e & PAGE_DIRTY) ? HAT_MODIFIED : 0);
+}
+
+// referenced/modified bits of the leaf at vaddr that were set, the
+// ones asked for are cleared. the cpu sets them with a locked update,
+// so do we. a cleared modified bit needs the tlb entry gone for the
+// next write to set it again, a cleared referenced bit is left to
+// the tlb, the entry ages out soon enough
+uint32_t vm_hat_test_clear(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                           uintptr_t vaddr, uint32_t bits)
+{
+    uint64_t mask = ((bits & HAT_REFERENCED) ? PAGE_ACCESSED : 0)
+                  | ((bits & HAT_MODIFIED) ? PAGE_DIRTY : 0);
+
+    struct vm_hat_flush_t local;
+    if (!f) {
+        f = &local;
+        vm_hat_flush_init(f, hat);
+    }
+
+    uint32_t found = 0;
+    uint32_t level;
+    int s = spinlock_lock_splhi(&hat->lock);
+    uint64_t* e = hat_find_leaf(hat, vaddr, &level);
+    if (e) {
+        uint64_t old = *e;
+        while (old & mask) {
+            uint64_t prev = compare_and_swap_64(e, old, old & ~mask);
+            if (prev == old)
+                break;
+            old = prev;
+        }
+        found = hat_leaf_bits(old);
+        if (old & mask & PAGE_DIRTY)
+            vm_hat_flush_page(f, vaddr & ~(HAT_LEVEL_SIZE(level) - 1));
+    }
+    spinlock_unlock_splx(&hat->lock, s);
+
+    if (f == &local)
+        vm_hat_flush(f);
+    return found;
+}
+
+// remove the size leaf at vaddr, returning its referenced/modified
+// bits as they were when it went. nothing can set them after that
+uint32_t vm_hat_unmap_page(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                           uintptr_t vaddr, uint64_t size)
+{
+    struct vm_hat_flush_t local;
+    if (!f) {
+        f = &local;
+        vm_hat_flush_init(f, hat);
+    }
+
+    uint32_t found = 0;
+    uint32_t level;
+    int s = spinlock_lock_splhi(&hat->lock);
+    uint64_t* e = hat_find_leaf(hat, vaddr, &level);
+    if (e) {
+        check(HAT_LEVEL_SIZE(level) == size && !(vaddr & (size - 1)));
+        found = hat_leaf_bits(atomic_swap_64(e, 0));
+        vm_hat_flush_page(f, vaddr);
+    }
+    spinlock_unlock_splx(&hat->lock, s);
+
+    if (f == &local)
+        vm_hat_flush(f);
+    return found;
+}
+
+struct vm_hat_t* vm_hat_create()
+{
+    struct vm_hat_t* hat = (struct vm_hat_t*)kmalloc(sizeof(struct vm_hat_t), KMALLOC_ZERO);
+    if (!hat)
+        return NULL;
+
+    spinlock_init(&hat->lock);
+    hat->pml4 = hat_table_alloc(hat);
+    if (!hat->pml4) {
+        kfree(hat);
+        return NULL;
+    }
+    hat->pml4_paddr = kernel_vaddr_phys((uintptr_t)hat->pml4);
+
+    // kernel half, on the list before another entry can appear
+    int s = spinlock_lock_splhi(&hat_list_lock);
+    for (uint32_t i = PDIR_NUM_ENTRIES/2; i < PDIR_NUM_ENTRIES; ++i)
+        hat->pml4[i] = kernel_hat.pml4[i];
+    hat->next = hat_list;
+    hat_list = hat;
+    spinlock_unlock_splx(&hat_list_lock, s);
+
+    return hat;
+}
+
+// kernel_hat or the boot mapper filled a kernel half pml4 entry,
+// nothing to flush for an entry that wasn't present
+void vm_hat_kernel_pml4(uint32_t index)
+{
+    if (index < PDIR_NUM_ENTRIES/2)
+        return;
+
+    int s = spinlock_lock_splhi(&hat_list_lock);
+    for (struct vm_hat_t* hat = hat_list; hat; hat = hat->next)
+        hat->pml4[index] = kernel_hat.pml4[index];
+    spinlock_unlock_splx(&hat_list_lock, s);
+}
+
+// must not be active on any cpu
+void vm_hat_destroy(struct vm_hat_t* hat)
+{
+    check(hat != &kernel_hat);
+    int s = spinlock_lock_splhi(&hat_list_lock);
+    struct vm_hat_t** link = &hat_list;
+    while (*link != hat)
+        link = &(*link)->next;
+    *link = hat->next;
+    spinlock_unlock_splx(&hat_list_lock, s);
+
+    for (uint32_t i = 0; i < PDIR_NUM_ENTRIES/2; ++i) {
+        uint64_t e = hat->pml4[i];
+        if (e & PAGE_PRESENT)
+            hat_table_free(hat, hat_table_vaddr(e), HAT_LEVELS - 2);
+    }
+    buddy_free((uintptr_t)hat->pml4);
+    kfree(hat);
+}
+
+static void hat_dump_table(uint64_t* table, uint32_t level, uintptr_t base)
+{
+    uint32_t num_4k = 0;
+    for (uint32_t i = 0; i < PDIR_NUM_ENTRIES; ++i) {
+        uint64_t e = table[i];
+        if (!(e & PAGE_PRESENT))
+            continue;
+        uintptr_t vaddr = base + ((uintptr_t)i << HAT_LEVEL_SHIFT(level));
+        if (level == 0)
+            ++num_4k;
+        else if (hat_is_leaf(e, level))
+            printf("%016lx -> %016lx %s [%03x]\n", vaddr,
+                e & PAGE_ADDR_MASK, level == 1 ? "2M" : "1G", (uint32_t)(e & 0xFFF));
+        else
+            hat_dump_table(hat_table_vaddr(e), level - 1, vaddr);
+    }
+    if (num_4k)
+        printf("%016lx -> %d x 4K\n", base, num_4k);
+}
+
+void vm_hat_dump(struct vm_hat_t* hat)
+{
+    printf("hat %016lx: pml4 %016lx tables %d\n",
+        (uintptr_t)hat, hat->pml4_paddr, hat->num_tables);
+    printf("shootdowns %d ipis %d lazy %d pcid rollovers %d\n",
+        hat_tlb_stats.num_shootdowns, hat_tlb_stats.num_ipis, hat_tlb_stats.num_lazy,
+        hat_tlb_stats.num_pcid_rollovers);
+    if (hat_perf) {
+        printf("cpu %d tlb walks: dtlb %ld itlb %ld\n", get_cpu_id(),
+            rdmsr(MSR_PMC0), rdmsr(MSR_PMC0 + 1));
+    }
+
+    int s = spinlock_lock_splhi(&hat->lock);
+    uint64_t* e = &hat->pml4[PML_INDEX(KERNEL_VM_BASE)];
+    hat_dump_table(hat_table_vaddr(*e), HAT_LEVELS - 2, KERNEL_VM_BASE);
+    spinlock_unlock_splx(&hat->lock, s);
+}
+
+// cr3 for hat on this cpu, interrupts off
+static uint64_t hat_cr3(struct vm_hat_t* hat, struct cpu_desc_t* cpu)
+{
+    if (!hat_has_pcid)
+        return hat->pml4_paddr;
+
+    uint32_t id = cpu->apic_id;
+    uint32_t pcid = 0;
+    bool flush = false;
+    if (hat != &kernel_hat) {
+        struct hat_pcid_t* p = &hat_pcid[id];
+        pcid = hat->ctx[id].pcid;
+        if ((pcid >> HAT_PCID_BITS) != p->gen) {
+            if (p->next > HAT_PCID_MASK) {
+                // the global kernel half stays
+                if (hat_has_invpcid)
+                    invpcid(INVPCID_ALL, 0, 0);
+                else
+                    tlb_flush_global();
+                p->gen++;
+                p->next = 1;
+                fetch_and_add_32(&hat_tlb_stats.num_pcid_rollovers, 1);
+            }
+            pcid = (p->gen << HAT_PCID_BITS) | p->next++;
+            hat->ctx[id].pcid = pcid;
+            flush = true;
+        }
+    }
+
+    uint32_t gen = hat->tlb_gen;
+    if (hat->ctx[id].tlb_gen != gen) {
+        hat->ctx[id].tlb_gen = gen;
+        flush = true;
+    }
+
+    uint64_t cr3 = hat->pml4_paddr | (pcid & HAT_PCID_MASK);
+    if (!flush)
+        cr3 |= CR3_NOFLUSH;
+    return cr3;
+}
+
+// load hat on this cpu, from the scheduler right before the switch
+void vm_hat_activate(struct vm_hat_t* hat)
+{
+    int s = cpu_splhi();
+    struct cpu_desc_t* cpu = get_cpu();
+    if (cpu->hat != hat) {
+        // either a flush sees us on hat or we see its tlb_gen
+        cpu->hat = hat;
+        mfence();
+        set_cr3(hat_cr3(hat, cpu));
+    }
+    cpu_splx(s);
+}
+
+// adopt the boot page tables, the kernel vm region gets its
+// top level entries up front so every address space shares them
+void vm_hat_init()
+{
+    spinlock_init(&kernel_hat.lock);
+    spinlock_init(&hat_list_lock);
+    kernel_hat.pml4_paddr = get_cr3() & PAGE_ADDR_MASK;
+    kernel_hat.pml4 = (uint64_t*)KERNEL_VADDR(kernel_hat.pml4_paddr);
+    kernel_hat.num_tables = 1;
+
+    if (vm_boot_page_1g())
+        hat_leaf_levels |= 1U << 2;
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    hat_has_pcid = (ecx & CPUID_1_ECX_PCID) != 0;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        hat_has_invpcid = (ebx & CPUID_7_EBX_INVPCID) != 0;
+    }
+
+    uintptr_t vaddr = KERNEL_VM_BASE;
+    for (uint32_t i = 0; i < (KERNEL_VM_SIZE >> PML_SHIFT); ++i) {
+        uint64_t* e = &kernel_hat.pml4[PML_INDEX(vaddr)];
+        check(!(*e & PAGE_PRESENT));
+        uint64_t* table = hat_table_alloc(&kernel_hat);
+        check(table);
+        *e = kernel_vaddr_phys((uintptr_t)table) | HAT_TABLE_FLAGS;
+        vaddr += PML_SIZE;
+    }
+
+    printf("vm_hat_init: pml4 %016lx vm %016lx:%016lx pcid %d invpcid %d\n",
+        kernel_hat.pml4_paddr, KERNEL_VM_BASE, KERNEL_VM_BASE + KERNEL_VM_SIZE,
+        hat_has_pcid, hat_has_invpcid);
+}
+
+// count page walks on this cpu
+static void hat_perf_init()
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (ebx != 0x756e6547 || eax < 0xa)     // "Genu"ineIntel
+        return;
+
+    cpuid(0xa, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t version = eax & 0xff;
+    uint32_t num_counters = (eax >> 8) & 0xff;
+    if (version < 1 || num_counters < 2)
+        return;
+
+    uint64_t flags = PERFEVTSEL_USR | PERFEVTSEL_OS | PERFEVTSEL_EN;
+    wrmsr(MSR_PERFEVTSEL0, 0);
+    wrmsr(MSR_PERFEVTSEL0 + 1, 0);
+    wrmsr(MSR_PMC0, 0);
+    wrmsr(MSR_PMC0 + 1, 0);
+    wrmsr(MSR_PERFEVTSEL0, HAT_PERF_DTLB_WALKS | flags);
+    wrmsr(MSR_PERFEVTSEL0 + 1, HAT_PERF_ITLB_WALKS | flags);
+    if (version >= 2)
+        wrmsr(MSR_PERF_GLOBAL_CTRL, rdmsr(MSR_PERF_GLOBAL_CTRL) | 0x3);
+    hat_perf = true;
+}
+
+// paging features of this cpu, from its init path
+void vm_hat_init_cpu()
+{
+    struct cpu_desc_t* cpu = get_cpu();
+    uint64_t cr4 = get_cr4() | CR4_PGE;
+    if (hat_has_pcid) {
+        // pcide can only be turned on with pcid 0 loaded
+        set_cr3(get_cr3() & PAGE_ADDR_MASK);
+        cr4 |= CR4_PCIDE;
+        hat_pcid[cpu->apic_id].gen = 1;
+        hat_pcid[cpu->apic_id].next = 1;
+    }
+    set_cr4(cr4);
+    hat_perf_init();
+}
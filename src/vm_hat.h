@@ -1,4 +1,99 @@
 #ifndef KERNEL_VM_HAT_H
 #define KERNEL_VM_HAT_H
 
+#include "types.h"
+#include "spinlock.h"
+#include "cpu.h"
+
+// hardware address translation, 4 level page tables with 4K, 2M
+// and 1G leaves. each address space has its own lock, invalidations
+// are collected in a flush batch and done after the lock is dropped,
+// on other cpus through a shootdown ipi. a flush may wait for other
+// cpus, so no spinlock can be held across it.
+//
+// with pcids an address space keeps its tlb entries while switched
+// out, each cpu tags it with its own pcid, see vm_hat_activate
+
+#define HAT_LEVELS          4
+#define HAT_LEVEL_SHIFT(l)  (12UL + 9UL * (l))
+#define HAT_LEVEL_SIZE(l)   (1UL << HAT_LEVEL_SHIFT(l))
+#define HAT_INDEX(x, l)     (((x) >> HAT_LEVEL_SHIFT(l)) & 0x1FF)
+
+// kernel virtual memory managed by kernel_hat, the boot mapper
+// keeps to the other top level slots
+#define KERNEL_VM_BASE      (0xFFFFC00000000000)
+#define KERNEL_VM_SIZE      (1UL << 39)
+
+// mapping protection
+#define HAT_WRITE           0x1
+#define HAT_USER            0x2
+#define HAT_NOCACHE         0x4
+
+// what the cpu recorded in a leaf, vm_hat_test_clear
+#define HAT_REFERENCED      0x8
+#define HAT_MODIFIED        0x10
+
+#define HAT_PCID_BITS       12
+#define HAT_PCID_MASK       ((1U << HAT_PCID_BITS) - 1)
+
+struct vm_hat_t {
+    struct vm_hat_t* next;  // address spaces other than kernel_hat
+    struct spinlock_t lock;
+    uint32_t num_tables;    // page table pages, pml4 included
+    volatile uint32_t tlb_gen;  // bumped by every flush
+    uint64_t* pml4;
+    uintptr_t pml4_paddr;
+    struct {
+        uint32_t pcid;      // cpu pcid generation | id, 0 for none yet
+        uint32_t tlb_gen;   // tlb_gen its pcid was last flushed at
+    } ctx[MAX_CPUS];
+};
+
+// past this many pages a full tlb flush is cheaper than invlpg
+#define HAT_FLUSH_PAGES     32
+#define HAT_FLUSH_TABLES    8
+
+struct vm_hat_flush_t {
+    struct vm_hat_t* hat;
+    uint32_t num_pages;
+    uint32_t num_tables;
+    bool full;
+    uintptr_t pages[HAT_FLUSH_PAGES];
+    struct {
+        uintptr_t vaddr;
+        uint32_t level;
+    } tables[HAT_FLUSH_TABLES];     // unlinked, freed after the flush
+};
+
+extern struct vm_hat_t kernel_hat;
+
+void vm_hat_init(void);
+struct vm_hat_t* vm_hat_create(void);
+void vm_hat_destroy(struct vm_hat_t* hat);
+void vm_hat_kernel_pml4(uint32_t index);
+
+void vm_hat_flush_init(struct vm_hat_flush_t* f, struct vm_hat_t* hat);
+void vm_hat_flush_page(struct vm_hat_flush_t* f, uintptr_t vaddr);
+void vm_hat_flush(struct vm_hat_flush_t* f);
+
+struct cpu_desc_t;
+void vm_hat_tlb_process(struct cpu_desc_t* cpu);
+void vm_hat_tlb_idle(struct cpu_desc_t* cpu);
+void vm_hat_tlb_wake(struct cpu_desc_t* cpu);
+
+// f may be NULL, then the flush happens before returning
+bool vm_hat_map(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                uintptr_t vaddr, uintptr_t paddr, uint64_t size, uint32_t prot);
+void vm_hat_unmap(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                  uintptr_t vaddr, uint64_t size);
+bool vm_hat_lookup(struct vm_hat_t* hat, uintptr_t vaddr,
+                   uintptr_t* paddr, uint64_t* page_size);
+uint32_t vm_hat_test_clear(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                           uintptr_t vaddr, uint32_t bits);
+uint32_t vm_hat_unmap_page(struct vm_hat_t* hat, struct vm_hat_flush_t* f,
+                           uintptr_t vaddr, uint64_t size);
+void vm_hat_dump(struct vm_hat_t* hat);
+void vm_hat_activate(struct vm_hat_t* hat);
+void vm_hat_init_cpu(void);
+
 #endif // KERNEL_VM_HAT_H
@@ -1 +1,302 @@
 #include "vm_mmap.h"
+#include "vm_alloc.h"
+#include "vm_cache.h"
+#include "vm_hat.h"
+#include "vm_page.h"
+#include "kernel.h"
+#include "kmalloc.h"
+#include "x86.h"
+#include "stdio.h"
+#include "string.h"
+
+// areas are few and long lived, a sorted list does. faults look the
+// area up under the lock and drop it before going to the cache, an
+// area must not be unmapped while something may still touch it.
+// areas of a cache are also kept on it, reclaim goes through them
+// to find a page's mappings. mm lock before cache lock
+
+struct vm_mmap_t kernel_mmap;
+
+static struct vm_area_t* mmap_find(struct vm_mmap_t* mm, uintptr_t vaddr)
+{
+    struct vm_area_t* area = mm->areas;
+    while (area && area->end <= vaddr)
+        area = area->next;
+    return area && area->start <= vaddr ? area : NULL;
+}
+
+// first gap of size at align, link points at where it goes in the list
+static uintptr_t mmap_find_gap(struct vm_mmap_t* mm, uint64_t size, uint64_t align,
+                               struct vm_area_t*** link)
+{
+    uintptr_t vaddr = mm->base;
+    struct vm_area_t** prev = &mm->areas;
+    while (1) {
+        vaddr = (vaddr + align - 1) & ~(align - 1);
+        uintptr_t limit = *prev ? (*prev)->start : mm->top;
+        if (vaddr < limit && limit - vaddr >= size)
+            break;
+        if (!*prev)
+            return 0;
+        vaddr = (*prev)->end;
+        prev = &(*prev)->next;
+    }
+    *link = prev;
+    return vaddr;
+}
+
+// reserve addresses for size bytes of cache from offset on, the cache
+// gets a map reference dropped by vm_munmap. a NULL cache only takes
+// the addresses, faults there fail
+uintptr_t vm_mmap(struct vm_mmap_t* mm, struct page_cache_t* cache,
+                  uint64_t offset, uint64_t size, uint32_t prot)
+{
+    uint64_t page_size = cache ? vm_cache_page_size(cache) : PAGE_4K_SIZE;
+    check(!(offset & (page_size - 1)));
+    size = (size + page_size - 1) & ~(page_size - 1);
+    if (!size)
+        return 0;
+
+    struct vm_area_t* area = (struct vm_area_t*)kmalloc(sizeof(struct vm_area_t), 0);
+    if (!area)
+        return 0;
+
+    struct vm_area_t** link;
+    int s = spinlock_lock_splhi(&mm->lock);
+    uintptr_t vaddr = mmap_find_gap(mm, size, page_size, &link);
+    if (vaddr) {
+        area->mm = mm;
+        area->start = vaddr;
+        area->end = vaddr + size;
+        area->cache = cache;
+        area->offset = offset;
+        area->prot = prot;
+        if (cache) {
+            // on the cache before anything can fault in
+            spinlock_lock(&cache->lock);
+            area->next_map = cache->maps;
+            cache->maps = area;
+            cache->map_refcnt++;
+            spinlock_unlock(&cache->lock);
+        }
+        area->next = *link;
+        *link = area;
+    }
+    spinlock_unlock_splx(&mm->lock, s);
+
+    if (!vaddr)
+        kfree(area);
+    return vaddr;
+}
+
+void vm_munmap(struct vm_mmap_t* mm, uintptr_t vaddr)
+{
+    int s = spinlock_lock_splhi(&mm->lock);
+    struct vm_area_t** link = &mm->areas;
+    while (*link && (*link)->start != vaddr)
+        link = &(*link)->next;
+    struct vm_area_t* area = *link;
+    if (area)
+        *link = area->next;
+    spinlock_unlock_splx(&mm->lock, s);
+
+    check(area);
+    vm_hat_unmap(mm->hat, NULL, area->start, area->end - area->start);
+
+    // off the cache once nothing is mapped, reclaim looks there
+    struct page_cache_t* cache = area->cache;
+    if (cache) {
+        s = spinlock_lock_splhi(&cache->lock);
+        struct vm_area_t** map = &cache->maps;
+        while (*map != area)
+            map = &(*map)->next_map;
+        *map = area->next_map;
+        spinlock_unlock_splx(&cache->lock, s);
+        vm_cache_release(cache);
+    }
+    kfree(area);
+}
+
+// page fault on vaddr, false if it is not ours to fill in
+bool vm_mmap_fault(struct vm_mmap_t* mm, uintptr_t vaddr, uint32_t err)
+{
+    if (vaddr < mm->base || vaddr >= mm->top || (err & VM_FAULT_PRESENT))
+        return false;
+
+    struct page_cache_t* cache = NULL;
+    uintptr_t start = 0;
+    uint64_t offset = 0;
+    uint32_t prot = 0;
+
+    int s = spinlock_lock_splhi(&mm->lock);
+    struct vm_area_t* area = mmap_find(mm, vaddr);
+    if (area) {
+        cache = area->cache;
+        start = area->start;
+        offset = area->offset;
+        prot = area->prot;
+    }
+    spinlock_unlock_splx(&mm->lock, s);
+
+    if (!cache)
+        return false;
+    if ((err & VM_FAULT_WRITE) && !(prot & HAT_WRITE))
+        return false;
+    if ((err & VM_FAULT_USER) && !(prot & HAT_USER))
+        return false;
+
+    uint64_t page_size = vm_cache_page_size(cache);
+    uintptr_t page_vaddr = vaddr & ~(page_size - 1);
+    struct page_desc_t* page = vm_cache_get_page(cache, offset + (page_vaddr - start));
+    if (!page)
+        return false;
+
+    // racing faults on the same page map the same translation twice,
+    // the pin keeps reclaim off it until it is mapped
+    fetch_and_add_32(&mm->num_faults, 1);
+    bool ok = vm_hat_map(mm->hat, NULL, page_vaddr,
+        kernel_vaddr_phys(page->vaddr), page_size, prot);
+    vm_cache_put_page(page);
+    return ok;
+}
+
+#define MMAP_CLEAR_BATCH    8
+
+// referenced/modified bits of the cache page at offset in every area
+// mapping it, the ones asked for cleared or with unmap the mappings
+// removed. those in f's address space go on f, the rest are flushed
+// before returning. the hat calls are made with no lock held
+uint32_t vm_mmap_page_clear(struct page_cache_t* cache, uint64_t offset,
+                            uint32_t bits, bool unmap, struct vm_hat_flush_t* f)
+{
+    uint64_t page_size = vm_cache_page_size(cache);
+    uint32_t found = 0;
+    uint32_t skip = 0;
+    while (1) {
+        struct {
+            struct vm_hat_t* hat;
+            uintptr_t vaddr;
+        } maps[MMAP_CLEAR_BATCH];
+        uint32_t n = 0;
+        uint32_t seen = 0;
+
+        int s = spinlock_lock_splhi(&cache->lock);
+        for (struct vm_area_t* area = cache->maps; area && n < MMAP_CLEAR_BATCH; area = area->next_map) {
+            if (offset < area->offset || offset - area->offset >= area->end - area->start)
+                continue;
+            if (seen++ < skip)
+                continue;
+            maps[n].hat = area->mm->hat;
+            maps[n].vaddr = area->start + (offset - area->offset);
+            ++n;
+        }
+        spinlock_unlock_splx(&cache->lock, s);
+
+        for (uint32_t i = 0; i < n; ++i) {
+            struct vm_hat_flush_t* hf = f && f->hat == maps[i].hat ? f : NULL;
+            if (unmap)
+                found |= vm_hat_unmap_page(maps[i].hat, hf, maps[i].vaddr, page_size);
+            else
+                found |= vm_hat_test_clear(maps[i].hat, hf, maps[i].vaddr, bits);
+        }
+        if (n < MMAP_CLEAR_BATCH)
+            break;
+        skip += n;
+    }
+    return found;
+}
+
+void vm_mmap_dump(struct vm_mmap_t* mm)
+{
+    printf("mmap %016lx:%016lx faults %d\n", mm->base, mm->top, mm->num_faults);
+    int s = spinlock_lock_splhi(&mm->lock);
+    for (struct vm_area_t* area = mm->areas; area; area = area->next) {
+        printf("%016lx:%016lx cache %p offset %016lx prot %x\n",
+            area->start, area->end, area->cache, area->offset, area->prot);
+    }
+    spinlock_unlock_splx(&mm->lock, s);
+}
+
+void vm_mmap_init()
+{
+    spinlock_init(&kernel_mmap.lock);
+    kernel_mmap.hat = &kernel_hat;
+    kernel_mmap.areas = NULL;
+    kernel_mmap.base = KERNEL_VM_BASE;
+    kernel_mmap.top = KERNEL_VM_BASE + KERNEL_VM_SIZE;
+    kernel_mmap.num_faults = 0;
+}
+
+// stands in for a backing object, every page holds its offset
+static void mmap_test_read_page(uintptr_t vaddr, uint64_t offset)
+{
+    zero_page_4k(vaddr);
+    *(uint64_t*)vaddr = offset;
+}
+
+// sequential pass over a read_page backed area
+static void mmap_test_read()
+{
+    uint32_t num_pages = 256;
+    uint64_t size = (uint64_t)num_pages << PAGE_4K_SHIFT;
+    struct page_cache_t* cache = vm_cache_create(size, PAGE_CACHE_4K_PAGES);
+    cache->read_page = mmap_test_read_page;
+    uintptr_t vaddr = vm_mmap(&kernel_mmap, cache, 0, size, 0);
+    if (!vaddr) {
+        printf("vm_mmap failed\n");
+        vm_cache_delete(cache);
+        return;
+    }
+
+    uint32_t faults = kernel_mmap.num_faults;
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < num_pages; ++i) {
+        uint64_t offset = (uint64_t)i << PAGE_4K_SHIFT;
+        if (*(volatile uint64_t*)(vaddr + offset) != offset)
+            ++errors;
+    }
+
+    printf("%016lx: %d pages, %d faults, %d errors\n",
+        vaddr, num_pages, kernel_mmap.num_faults - faults, errors);
+    page_cache_ra_dump();
+    vm_munmap(&kernel_mmap, vaddr);
+}
+
+// -t: zero filled area, every other page touched
+// -r: sequential read through readahead
+void vm_mmap_cmd(int argc, const char* argv[])
+{
+    if (argc > 1 && !strcmp(argv[1], "-r")) {
+        mmap_test_read();
+        return;
+    }
+    if (argc < 2 || strcmp(argv[1], "-t")) {
+        vm_mmap_dump(&kernel_mmap);
+        return;
+    }
+
+    uint32_t num_pages = 64;
+    uint64_t size = (uint64_t)num_pages << PAGE_4K_SHIFT;
+    struct page_cache_t* cache = vm_cache_create(size, PAGE_CACHE_4K_PAGES);
+    uintptr_t vaddr = vm_mmap(&kernel_mmap, cache, 0, size, HAT_WRITE);
+    if (!vaddr) {
+        printf("vm_mmap failed\n");
+        vm_cache_delete(cache);
+        return;
+    }
+
+    uint32_t faults = kernel_mmap.num_faults;
+    for (uint32_t i = 0; i < num_pages; i += 2)
+        *(volatile uint64_t*)(vaddr + ((uintptr_t)i << PAGE_4K_SHIFT)) = i;
+
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < num_pages; i += 2) {
+        if (*(volatile uint64_t*)(vaddr + ((uintptr_t)i << PAGE_4K_SHIFT)) != i)
+            ++errors;
+    }
+
+    printf("%016lx: %d pages, %d faults, %d errors\n",
+        vaddr, num_pages, kernel_mmap.num_faults - faults, errors);
+    vm_mmap_dump(&kernel_mmap);
+    vm_munmap(&kernel_mmap, vaddr);
+}
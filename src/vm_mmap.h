@@ -1,4 +1,54 @@
 #ifndef KERNEL_VM_MMAP_H
 #define KERNEL_VM_MMAP_H
 
+#include "types.h"
+#include "spinlock.h"
+
+// areas of an address space backed by a page cache, nothing is
+// mapped up front, pages come in from the cache on first touch.
+// an area without a cache only reserves its addresses
+
+struct page_cache_t;
+struct vm_hat_t;
+struct vm_hat_flush_t;
+struct vm_mmap_t;
+
+struct vm_area_t {
+    struct vm_area_t* next;     // sorted by start
+    struct vm_area_t* next_map; // other areas of the same cache
+    struct vm_mmap_t* mm;
+    uintptr_t start;
+    uintptr_t end;
+    struct page_cache_t* cache;
+    uint64_t offset;            // cache offset at start
+    uint32_t prot;              // HAT_ flags
+};
+
+struct vm_mmap_t {
+    struct spinlock_t lock;
+    struct vm_hat_t* hat;
+    struct vm_area_t* areas;
+    uintptr_t base;
+    uintptr_t top;
+    uint32_t num_faults;
+};
+
+// page fault error code
+#define VM_FAULT_PRESENT    0x01    // protection, not a missing page
+#define VM_FAULT_WRITE      0x02
+#define VM_FAULT_USER       0x04
+#define VM_FAULT_FETCH      0x10
+
+extern struct vm_mmap_t kernel_mmap;
+
+void vm_mmap_init(void);
+uintptr_t vm_mmap(struct vm_mmap_t* mm, struct page_cache_t* cache,
+                  uint64_t offset, uint64_t size, uint32_t prot);
+void vm_munmap(struct vm_mmap_t* mm, uintptr_t vaddr);
+bool vm_mmap_fault(struct vm_mmap_t* mm, uintptr_t vaddr, uint32_t err);
+uint32_t vm_mmap_page_clear(struct page_cache_t* cache, uint64_t offset,
+                            uint32_t bits, bool unmap, struct vm_hat_flush_t* f);
+void vm_mmap_dump(struct vm_mmap_t* mm);
+void vm_mmap_cmd(int argc, const char* argv[]);
+
 #endif // KERNEL_VM_MMAP_H
@@ -3,18 +3,299 @@
 #include "kernel.h"
 #include "spinlock.h"
 #include "stdio.h"
+#include "string.h"
 
 static inline void page_desc_init(struct page_desc_t* page, uint32_t flags)
 {
     page->next_cache = NULL;
     page->prev_cache = NULL;
     page->next_hash = NULL;
+    page->next_lru = NULL;
+    page->prev_lru = NULL;
     page->cache = NULL;
     page->cache_offset = 0;
-    page->next_free = 0;
+    page->ext_pages = 0;
     page->flags = flags;
+    page->pins = 0;
     page->vaddr = 0;
-    page->reserved = 0;
+    page->num_pages = 0;
+}
+
+static inline bool page_db_is_free(struct page_db_t* pdb, uint32_t index)
+{
+    return PGF_STATE(pdb->pages[index].flags) == PGF_FREE;
+}
+
+static uint32_t page_db_map_words(uint32_t num_pages)
+{
+    uint32_t words = 0;
+    uint32_t n = num_pages;
+    do {
+        n = (n + 63) >> 6;
+        words += n;
+    } while (n > 1);
+    return words;
+}
+
+static uint32_t page_db_size(uint32_t num_pages)
+{
+    return PAGE_4K_ROUND(sizeof(struct page_db_t)
+                       + sizeof(struct page_desc_t) * num_pages
+                       + sizeof(uint64_t) * page_db_map_words(num_pages));
+}
+
+static void page_db_map_init(struct page_db_t* pdb)
+{
+    uint64_t* p = (uint64_t*)&pdb->pages[pdb->num_pages];
+    uint32_t n = pdb->num_pages;
+    uint32_t level = 0;
+    do {
+        check(level < PAGE_DB_MAP_LEVELS);
+        n = (n + 63) >> 6;
+        pdb->map[level++] = p;
+        for (uint32_t i = 0; i < n; ++i)
+            *p++ = 0UL;
+    } while (n > 1);
+    pdb->map_levels = level;
+}
+
+static void page_db_map_set(struct page_db_t* pdb, uint32_t index)
+{
+    for (uint32_t level = 0; level < pdb->map_levels; ++level) {
+        uint64_t* w = &pdb->map[level][index >> 6];
+        uint64_t prev = *w;
+        *w = prev | (1UL << (index & 63));
+        if (prev)
+            break;
+        index >>= 6;
+    }
+}
+
+static void page_db_map_clear(struct page_db_t* pdb, uint32_t index)
+{
+    for (uint32_t level = 0; level < pdb->map_levels; ++level) {
+        uint64_t* w = &pdb->map[level][index >> 6];
+        *w &= ~(1UL << (index & 63));
+        if (*w)
+            break;
+        index >>= 6;
+    }
+}
+
+// first extent starting at or after index
+static uint32_t page_db_map_next(struct page_db_t* pdb, uint32_t index)
+{
+    uint32_t level = 0;
+    uint32_t num_bits = pdb->num_pages;
+    while (1) {
+        if (level == pdb->map_levels || index >= num_bits)
+            return PAGE_DB_NONE;
+        uint32_t word = index >> 6;
+        uint64_t bits = pdb->map[level][word] & (~0UL << (index & 63));
+        if (bits) {
+            index = (word << 6) + __builtin_ctzl(bits);
+            break;
+        }
+        index = word + 1;
+        num_bits = (num_bits + 63) >> 6;
+        ++level;
+    }
+
+    while (level > 0) {
+        --level;
+        index = (index << 6) + __builtin_ctzl(pdb->map[level][index]);
+    }
+    return index;
+}
+
+// last extent starting at or before index
+static uint32_t page_db_map_prev(struct page_db_t* pdb, uint32_t index)
+{
+    uint32_t level = 0;
+    while (1) {
+        if (level == pdb->map_levels)
+            return PAGE_DB_NONE;
+        uint32_t word = index >> 6;
+        uint64_t bits = pdb->map[level][word] & (~0UL >> (63 - (index & 63)));
+        if (bits) {
+            index = (word << 6) + 63 - __builtin_clzl(bits);
+            break;
+        }
+        if (!word)
+            return PAGE_DB_NONE;
+        index = word - 1;
+        ++level;
+    }
+
+    while (level > 0) {
+        --level;
+        index = (index << 6) + 63 - __builtin_clzl(pdb->map[level][index]);
+    }
+    return index;
+}
+
+// free extent size tree, a treap keyed on (length, first page) with
+// the priority derived from the page index, nodes are first pages
+// of extents and 0 is the empty link (page 0 is never free)
+static inline uint32_t page_db_ext_prio(uint32_t index)
+{
+    index ^= index >> 16;
+    index *= 0x85ebca6bU;
+    index ^= index >> 13;
+    index *= 0xc2b2ae35U;
+    index ^= index >> 16;
+    return index;
+}
+
+static inline bool page_db_ext_less(struct page_db_t* pdb, uint32_t a, uint32_t b)
+{
+    uint32_t na = pdb->pages[a].ext_pages;
+    uint32_t nb = pdb->pages[b].ext_pages;
+    return na < nb || (na == nb && a < b);
+}
+
+// lift x above its parent
+static void page_db_ext_rotate(struct page_db_t* pdb, uint32_t x)
+{
+    struct page_desc_t* pages = pdb->pages;
+    uint32_t p = pages[x].ext_parent;
+    uint32_t g = pages[p].ext_parent;
+
+    if (pages[p].ext_left == x) {
+        uint32_t c = pages[x].ext_right;
+        pages[p].ext_left = c;
+        if (c)
+            pages[c].ext_parent = p;
+        pages[x].ext_right = p;
+    } else {
+        uint32_t c = pages[x].ext_left;
+        pages[p].ext_right = c;
+        if (c)
+            pages[c].ext_parent = p;
+        pages[x].ext_left = p;
+    }
+    pages[p].ext_parent = x;
+    pages[x].ext_parent = g;
+
+    if (!g)
+        pdb->size_root = x;
+    else if (pages[g].ext_left == p)
+        pages[g].ext_left = x;
+    else
+        pages[g].ext_right = x;
+}
+
+static void page_db_size_insert(struct page_db_t* pdb, uint32_t x)
+{
+    struct page_desc_t* pages = pdb->pages;
+    uint32_t p = 0;
+    uint32_t cur = pdb->size_root;
+    while (cur) {
+        p = cur;
+        cur = page_db_ext_less(pdb, x, cur) ? pages[cur].ext_left
+                                            : pages[cur].ext_right;
+    }
+
+    pages[x].ext_left = 0;
+    pages[x].ext_right = 0;
+    pages[x].ext_parent = p;
+    if (!p)
+        pdb->size_root = x;
+    else if (page_db_ext_less(pdb, x, p))
+        pages[p].ext_left = x;
+    else
+        pages[p].ext_right = x;
+
+    uint32_t prio = page_db_ext_prio(x);
+    while (pages[x].ext_parent
+            && page_db_ext_prio(pages[x].ext_parent) < prio)
+        page_db_ext_rotate(pdb, x);
+}
+
+static void page_db_size_remove(struct page_db_t* pdb, uint32_t x)
+{
+    struct page_desc_t* pages = pdb->pages;
+    while (pages[x].ext_left || pages[x].ext_right) {
+        uint32_t l = pages[x].ext_left;
+        uint32_t r = pages[x].ext_right;
+        if (!l)
+            page_db_ext_rotate(pdb, r);
+        else if (!r)
+            page_db_ext_rotate(pdb, l);
+        else
+            page_db_ext_rotate(pdb, page_db_ext_prio(l) > page_db_ext_prio(r) ? l : r);
+    }
+
+    uint32_t p = pages[x].ext_parent;
+    if (!p)
+        pdb->size_root = 0;
+    else if (pages[p].ext_left == x)
+        pages[p].ext_left = 0;
+    else
+        pages[p].ext_right = 0;
+}
+
+// smallest extent of at least num_pages
+static uint32_t page_db_size_lookup(struct page_db_t* pdb, uint32_t num_pages)
+{
+    uint32_t best = 0;
+    uint32_t cur = pdb->size_root;
+    while (cur) {
+        if (pdb->pages[cur].ext_pages >= num_pages) {
+            best = cur;
+            cur = pdb->pages[cur].ext_left;
+        } else {
+            cur = pdb->pages[cur].ext_right;
+        }
+    }
+    return best;
+}
+
+static uint32_t page_db_size_next(struct page_db_t* pdb, uint32_t x)
+{
+    struct page_desc_t* pages = pdb->pages;
+    if (pages[x].ext_right) {
+        x = pages[x].ext_right;
+        while (pages[x].ext_left)
+            x = pages[x].ext_left;
+        return x;
+    }
+    uint32_t p = pages[x].ext_parent;
+    while (p && pages[p].ext_right == x) {
+        x = p;
+        p = pages[p].ext_parent;
+    }
+    return p;
+}
+
+static inline void page_db_ext_set(struct page_db_t* pdb,
+                                   uint32_t first, uint32_t num_pages)
+{
+    pdb->pages[first].ext_pages = num_pages;
+    pdb->pages[first + num_pages - 1].ext_pages = num_pages;
+}
+
+static void page_db_ext_add(struct page_db_t* pdb,
+                            uint32_t first, uint32_t num_pages)
+{
+    page_db_ext_set(pdb, first, num_pages);
+    page_db_map_set(pdb, first);
+    page_db_size_insert(pdb, first);
+}
+
+static void page_db_ext_remove(struct page_db_t* pdb, uint32_t first)
+{
+    page_db_size_remove(pdb, first);
+    page_db_map_clear(pdb, first);
+}
+
+// the length is the tree key, so the extent is taken out and put back
+static void page_db_ext_resize(struct page_db_t* pdb,
+                               uint32_t first, uint32_t num_pages)
+{
+    page_db_size_remove(pdb, first);
+    page_db_ext_set(pdb, first, num_pages);
+    page_db_size_insert(pdb, first);
 }
 
 static void page_db_init_pages(struct page_db_t* pdb,
@@ -24,24 +305,19 @@ static void page_db_init_pages(struct page_db_t* pdb,
     uint32_t i;
     for (i = 0; i < num_reserved; ++i)
         page_desc_init(&pdb->pages[i], PGF_RESERVED);
-
-    for (i = num_reserved; i < num_pages-1; ++i) {
+    for (i = num_reserved; i < num_pages; ++i)
         page_desc_init(&pdb->pages[i], PGF_FREE);
-        pdb->pages[i].next_free = i+1;
-    }
-    page_desc_init(&pdb->pages[i], PGF_FREE);
 
-    pdb->free_list = num_reserved;
+    page_db_map_init(pdb);
+    pdb->size_root = 0;
+    if (num_reserved < num_pages)
+        page_db_ext_add(pdb, num_reserved, num_pages - num_reserved);
 }
 
 static uint32_t page_db_calc_size(uint64_t memory_size)
 {
     uint32_t num_pages = (uint32_t)(memory_size >> PAGE_2M_SHIFT);
-    uint32_t db_size =
-        PAGE_4K_ROUND(sizeof(struct page_db_t)
-                    + sizeof(struct page_desc_t) * num_pages);
-
-    return db_size;
+    return page_db_size(num_pages);
 }
 
 void page_db_init(struct page_db_t* pdb,
@@ -49,9 +325,7 @@ void page_db_init(struct page_db_t* pdb,
 {
     uint32_t num_reserved = (uint32_t)PAGE_2M_NUM(reserved_size);
     uint32_t num_pages = (uint32_t)(memory_size >> PAGE_2M_SHIFT);
-    uint32_t db_size =
-        PAGE_4K_ROUND(sizeof(struct page_db_t)
-                    + sizeof(struct page_desc_t) * num_pages);
+    uint32_t db_size = page_db_size(num_pages);
 
     printf("page_db_init: %016lx num_pages: [%d,%d] db_size: %08x\n",
         (uintptr_t)pdb, num_reserved, num_pages, db_size);
@@ -70,9 +344,7 @@ void page_db_init(struct page_db_t* pdb,
 void page_db_init_4k(struct page_db_t* pdb, uint32_t page_index)
 {
     uint32_t num_pages = PAGE_2M_SIZE >> PAGE_4K_SHIFT;
-    uint32_t db_size =
-        PAGE_4K_ROUND(sizeof(struct page_db_t)
-                    + sizeof(struct page_desc_t) * num_pages);
+    uint32_t db_size = page_db_size(num_pages);
 
     uint32_t num_reserved = db_size >> PAGE_4K_SHIFT;
 
@@ -90,27 +362,59 @@ void page_db_init_4k(struct page_db_t* pdb, uint32_t page_index)
     page_db_init_pages(pdb, num_pages, num_reserved);
 }
 
+// last page of the smallest extent, keeps long runs for page_db_alloc_range
 uint32_t page_db_alloc(struct page_db_t* pdb)
 {
-    uint32_t index = pdb->free_list;
-    if (index > 0) {
-        check(pdb->pages[index].flags == PGF_FREE);
-        pdb->free_list = pdb->pages[index].next_free;
-        pdb->pages[index].flags = PGF_USED;
-        --pdb->num_free;
-    }
+    uint32_t first = page_db_size_lookup(pdb, 1);
+    if (!first)
+        return 0;
+
+    uint32_t n = pdb->pages[first].ext_pages;
+    uint32_t index = first + n - 1;
+    if (n == 1)
+        page_db_ext_remove(pdb, first);
+    else
+        page_db_ext_resize(pdb, first, n - 1);
+
+    check(page_db_is_free(pdb, index));
+    pdb->pages[index].flags = PGF_USED;
+    --pdb->num_free;
     return index;
 }
 
-void page_db_free(struct page_db_t* pdb, uint32_t index)
+// merges the run with free neighbours on either side
+static void page_db_free_run(struct page_db_t* pdb,
+                             uint32_t index, uint32_t num_pages)
 {
-    check(index >= pdb->num_reserved && index < pdb->num_pages);
-    check(pdb->pages[index].flags != PGF_FREE);
+    check(index >= pdb->num_reserved && index + num_pages <= pdb->num_pages);
+
+    for (uint32_t i = index; i < index + num_pages; ++i) {
+        check(!page_db_is_free(pdb, i));
+        pdb->pages[i].flags = PGF_FREE;
+    }
+    pdb->num_free += num_pages;
+
+    uint32_t first = index;
+    uint32_t n = num_pages;
+    if (index > 0 && page_db_is_free(pdb, index - 1)) {
+        uint32_t left = pdb->pages[index - 1].ext_pages;
+        first -= left;
+        n += left;
+        page_db_ext_remove(pdb, first);
+    }
 
-    pdb->pages[index].flags = PGF_FREE;
-    pdb->pages[index].next_free = pdb->free_list;
-    pdb->free_list = index;
-    ++pdb->num_free;
+    uint32_t next = index + num_pages;
+    if (next < pdb->num_pages && page_db_is_free(pdb, next)) {
+        n += pdb->pages[next].ext_pages;
+        page_db_ext_remove(pdb, next);
+    }
+
+    page_db_ext_add(pdb, first, n);
+}
+
+void page_db_free(struct page_db_t* pdb, uint32_t index)
+{
+    page_db_free_run(pdb, index, 1);
 }
 
 // given descriptor get page physical address
@@ -151,38 +455,104 @@ uintptr_t page_db_4k_vaddr(struct page_db_t* pdb, uint32_t index)
 
 uintptr_t page_db_alloc_addr(struct page_db_t* pdb)
 {
+    int s = spinlock_lock_splhi(&pdb->lock);
     uint32_t index = page_db_alloc(pdb);
+    spinlock_unlock_splx(&pdb->lock, s);
     return index > 0 ? page_db_index2addr(pdb, index) : 0;
 }
 
 void page_db_free_addr(struct page_db_t* pdb, uintptr_t addr)
 {
-    uint32_t index = page_db_index2addr(pdb, addr);
-    if (index)
+    uint32_t index = page_db_addr2index(pdb, addr);
+    if (index) {
+        int s = spinlock_lock_splhi(&pdb->lock);
         page_db_free(pdb, index);
+        spinlock_unlock_splx(&pdb->lock, s);
+    }
+}
+
+// best fit run of num_pages starting at a multiple of align (a power
+// of two, in pages), walks the size tree upwards from the smallest
+// extent that is long enough until one also satisfies the alignment
+uint32_t page_db_alloc_range(struct page_db_t* pdb,
+                             uint32_t num_pages, uint32_t align)
+{
+    check(num_pages > 0);
+    check(align && !(align & (align - 1)));
+
+    int s = spinlock_lock_splhi(&pdb->lock);
+    uint32_t first = page_db_size_lookup(pdb, num_pages);
+    uint32_t index = 0;
+    while (first) {
+        uint32_t n = pdb->pages[first].ext_pages;
+        uint64_t start = ((uint64_t)first + align - 1) & ~((uint64_t)align - 1);
+        if (start + num_pages <= (uint64_t)first + n) {
+            index = (uint32_t)start;
+            break;
+        }
+        first = page_db_size_next(pdb, first);
+    }
+
+    if (!index) {
+        spinlock_unlock_splx(&pdb->lock, s);
+        return 0;
+    }
+
+    uint32_t n = pdb->pages[first].ext_pages;
+    uint32_t left = index - first;
+    uint32_t right = first + n - index - num_pages;
+    if (left)
+        page_db_ext_resize(pdb, first, left);
+    else
+        page_db_ext_remove(pdb, first);
+    if (right)
+        page_db_ext_add(pdb, index + num_pages, right);
+
+    for (uint32_t i = index; i < index + num_pages; ++i)
+        pdb->pages[i].flags = PGF_USED;
+    pdb->num_free -= num_pages;
+
+    spinlock_unlock_splx(&pdb->lock, s);
+    return index;
 }
 
+void page_db_free_range(struct page_db_t* pdb, uint32_t index, uint32_t num_pages)
+{
+    int s = spinlock_lock_splhi(&pdb->lock);
+    page_db_free_run(pdb, index, num_pages);
+    spinlock_unlock_splx(&pdb->lock, s);
+}
+
+// split the extent holding page_index around it
 void page_db_reserve_page(struct page_db_t* pdb, uint32_t page_index)
 {
     if (page_index >= pdb->num_pages)
         return;
-    if (pdb->pages[page_index].flags == PGF_RESERVED)
+    struct page_desc_t* page = &pdb->pages[page_index];
+    if (PGF_STATE(page->flags) == PGF_RESERVED)
         return;
-    check(pdb->pages[page_index].flags == PGF_FREE);
-    if (page_index == pdb->num_reserved) {
-        pdb->pages[page_index].flags = PGF_RESERVED;
-        pdb->pages[page_index].next_free = 0;
+    check(PGF_STATE(page->flags) == PGF_FREE);
+
+    uint32_t first = page_db_map_prev(pdb, page_index);
+    check(first != PAGE_DB_NONE);
+    uint32_t n = pdb->pages[first].ext_pages;
+    check(page_index < first + n);
+
+    uint32_t left = page_index - first;
+    uint32_t right = first + n - page_index - 1;
+    if (left)
+        page_db_ext_resize(pdb, first, left);
+    else
+        page_db_ext_remove(pdb, first);
+    if (right)
+        page_db_ext_add(pdb, page_index + 1, right);
+
+    page->flags = (page->flags & ~PGF_STATE_MASK) | PGF_RESERVED;
+    --pdb->num_free;
+
+    while (pdb->num_reserved < pdb->num_pages && pdb->num_reserved < 0xFFFF
+            && PGF_STATE(pdb->pages[pdb->num_reserved].flags) == PGF_RESERVED)
         pdb->num_reserved++;
-        pdb->free_list = pdb->num_reserved;
-        return;
-    }
-    for (uint32_t i = pdb->num_reserved; i < pdb->num_pages; ++i) {
-        if (pdb->pages[i].next_free == page_index) {
-            pdb->pages[i].next_free = pdb->pages[page_index].next_free;
-            pdb->pages[page_index].flags = PGF_RESERVED;
-            break;
-        }
-    }
 }
 
 void page_db_reserve_region(struct page_db_t* pdb,
@@ -200,23 +570,23 @@ void page_db_dump_ranges(struct page_db_t* pdb)
     uint32_t n = 0;
     while (n < pdb->num_pages) {
         struct page_desc_t* p = &pdb->pages[n];
-        if (p->flags == PGF_FREE) {
+        if (PGF_STATE(p->flags) == PGF_FREE) {
             uint32_t s = n;
-            while (n < pdb->num_pages && pdb->pages[n].flags == PGF_FREE)
+            while (n < pdb->num_pages && PGF_STATE(pdb->pages[n].flags) == PGF_FREE)
                 ++n;
             //uint32_t e = n - s;
             printf("free:[%04d:%04d] %016lx:%016lx\n", s, n,
                     (s << PAGE_2M_SHIFT), (n << PAGE_2M_SHIFT));
-        } else if (p->flags == PGF_RESERVED) {
+        } else if (PGF_STATE(p->flags) == PGF_RESERVED) {
             uint32_t s = n;
-            while (n < pdb->num_pages && pdb->pages[n].flags == PGF_RESERVED)
+            while (n < pdb->num_pages && PGF_STATE(pdb->pages[n].flags) == PGF_RESERVED)
                 ++n;
             //uint32_t e = n - s;
             printf("rsvd:[%04d:%04d] %016lx:%016lx\n", s, n,
                     (s << PAGE_2M_SHIFT), (n << PAGE_2M_SHIFT));
-        } else if (p->flags == PGF_USED) {
+        } else if (PGF_STATE(p->flags) == PGF_USED) {
             uint32_t s = n;
-            while (n < pdb->num_pages && pdb->pages[n].flags == PGF_USED)
+            while (n < pdb->num_pages && PGF_STATE(pdb->pages[n].flags) == PGF_USED)
                 ++n;
             //uint32_t e = n - s;
             printf("used:[%04d:%04d] %016lx:%016lx\n", s, n,
@@ -227,57 +597,65 @@ void page_db_dump_ranges(struct page_db_t* pdb)
 
 void page_db_dump_free_list(struct page_db_t* pdb)
 {
-    uint32_t index = pdb->free_list;
-    while (index > 0) {
-        uint32_t s = index;
-        while (pdb->pages[index].next_free
-                && pdb->pages[index].next_free == index+1)
-            ++index;
-
-        uint32_t n = (index+1) - s;
-        if (n)
-            printf("[%d:%d]\n", s, n);
-
-        index = pdb->pages[index].next_free;
+    uint32_t first = page_db_map_next(pdb, 0);
+    while (first != PAGE_DB_NONE) {
+        uint32_t n = pdb->pages[first].ext_pages;
+        printf("[%d:%d]\n", first, n);
+        first = page_db_map_next(pdb, first + n);
     }
 }
 
+// 2M ones are past MEM_NT_THRESHOLD and go around the caches
 void zero_page_4k(uintptr_t addr)
 {
-    uint64_t* p = (uint64_t*)addr;
-    uint32_t n = PAGE_4K_SIZE/8;
-    while (n--)
-        *p++ = 0UL;
+    mem_set((void*)addr, 0, PAGE_4K_SIZE);
 }
 
 void zero_page_2m(uintptr_t addr)
 {
-    uint64_t* p = (uint64_t*)addr;
-    uint32_t n = PAGE_2M_SIZE/8;
-    while (n--)
-        *p++ = 0UL;
+    mem_set((void*)addr, 0, PAGE_2M_SIZE);
+}
+
+// for pages cleared ahead of use
+void zero_page_4k_nt(uintptr_t addr)
+{
+    mem_set_nt((void*)addr, 0, PAGE_4K_SIZE);
+}
+
+void zero_page_2m_nt(uintptr_t addr)
+{
+    mem_set_nt((void*)addr, 0, PAGE_2M_SIZE);
 }
 
 void copy_page_4k(uintptr_t dst, uintptr_t src)
 {
-    const uint64_t* p_src = (uint64_t*)src;
-    uint64_t* p_dst = (uint64_t*)dst;
-    uint32_t n = PAGE_4K_SIZE/8;
-    while (n--)
-        *p_dst++ = *p_src++;
+    mem_copy((void*)dst, (const void*)src, PAGE_4K_SIZE);
 }
 
 void copy_page_2m(uintptr_t dst, uintptr_t src)
 {
-    const uint64_t* p_src = (uint64_t*)src;
-    uint64_t* p_dst = (uint64_t*)dst;
-    uint32_t n = PAGE_2M_SIZE/8;
-    while (n--)
-        *p_dst++ = *p_src++;
+    mem_copy((void*)dst, (const void*)src, PAGE_2M_SIZE);
 }
 
 struct page_db_t* page_db;
 
+// pages not entirely backed by available ram
+static void vm_page_reserve_holes(struct page_db_t* pdb)
+{
+    struct boot_info_t* boot_info = kernel_boot_info();
+    for (uint32_t i = pdb->num_reserved; i < pdb->num_pages; ++i) {
+        uint64_t start = (uint64_t)i << PAGE_2M_SHIFT;
+        uint64_t end = start + PAGE_2M_SIZE;
+        bool avail = false;
+        for (uint32_t j = 0; j < boot_info->num_mmap && !avail; ++j) {
+            const struct boot_info_mmap_t* m = &boot_info->mmap[j];
+            avail = m->flags && m->addr <= start && m->addr + m->size >= end;
+        }
+        if (!avail)
+            page_db_reserve_page(pdb, i);
+    }
+}
+
 void vm_page_init()
 {
     struct boot_info_t* boot_info = kernel_boot_info();
@@ -288,5 +666,6 @@ void vm_page_init()
 
     page_db = (struct page_db_t*)kernel_slack_alloc(db_size, 16);
     page_db_init(page_db, memory_size, boot_info->kernel_top);
+    vm_page_reserve_holes(page_db);
     //page_db_dump_ranges(page_db);
 }
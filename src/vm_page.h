@@ -41,7 +41,17 @@
 #define PAGE_PRESENT    0x01
 #define PAGE_WRITE      0x02
 #define PAGE_USER       0x04
+#define PAGE_PWT        0x08
+#define PAGE_PCD        0x10
+#define PAGE_ACCESSED   0x20
+#define PAGE_DIRTY      0x40
 #define PAGE_2MB        0x80
+#define PAGE_1GB        0x80    // same PS bit, in a pdp entry
+#define PAGE_GLOBAL     0x100   // kept across cr3 loads, kernel half only
+#define PAGE_PAT        0x80    // 4K leaf, the PS bit elsewhere
+#define PAGE_PAT_LARGE  0x1000  // 2M/1G leaf
+#define PAGE_NX         (1UL<<63)
+#define PAGE_ADDR_MASK  0x000FFFFFFFFFF000UL
 
 static inline void invlpg(uintptr_t addr)
 {
@@ -62,32 +72,106 @@ static inline void tlb_flush()
     );
 }
 
+#define INVPCID_ADDR        0   // one address in one pcid
+#define INVPCID_CONTEXT     1   // one pcid
+#define INVPCID_ALL_GLOBAL  2   // every pcid, global entries too
+#define INVPCID_ALL         3   // every pcid
+
+static inline void invpcid(uint32_t type, uint64_t pcid, uintptr_t addr)
+{
+    struct { uint64_t pcid, addr; } desc = { pcid, addr };
+    asm volatile(
+        "invpcid %0, %1"
+        :
+        : "m"(desc), "r"((uint64_t)type)
+        : "memory"
+    );
+}
+
+// global entries and every pcid, toggling cr4.pge does that too
+static inline void tlb_flush_global()
+{
+    unsigned long cr4;
+    asm volatile(
+        "mov %%cr4, %0\n\t"
+        "xorq $0x80, %0\n\t"
+        "mov %0, %%cr4\n\t"
+        "xorq $0x80, %0\n\t"
+        "mov %0, %%cr4" : "=&r"(cr4) : : "memory"
+    );
+}
+
 #define PGF_FREE        0
 #define PGF_USED        1
 #define PGF_RESERVED    2
+#define PGF_STATE_MASK  0xff
+#define PGF_STATE(f)    ((f) & PGF_STATE_MASK)
+
+// kernel heap ownership of used pages
+#define PGF_KMEM_SLAB   0x100   // slab_list holds the page
+#define PGF_KMEM_LARGE  0x200   // first page of num_pages kmalloc run
+#define PGF_KMEM_BUDDY  0x400   // carved into 4K buddy blocks
+
+// page cache pages on the reclaim lists, see vm_reclaim.c
+#define PGF_LRU         0x1000  // on the active or inactive list
+#define PGF_ACTIVE      0x2000
+#define PGF_REFERENCED  0x4000  // seen referenced once while inactive
+#define PGF_EVICTING    0x8000  // lookups wait for it to go
+#define PGF_DIRTY       0x10000 // modified since last written back
 
 struct page_cache_t;
+struct slab_list_t;
 
 struct page_desc_t {
-    struct page_desc_t* next_cache;
-    struct page_desc_t** prev_cache;
+    union {
+        struct {    // page cache list
+            struct page_desc_t* next_cache;
+            struct page_desc_t** prev_cache;
+        };
+        struct {    // buddy free list, free 4K blocks only
+            struct page_desc_t* next_buddy;
+            struct page_desc_t** prev_buddy;
+        };
+        struct {    // free extent size tree, first page of an extent
+            uint32_t ext_left;
+            uint32_t ext_right;
+            uint32_t ext_parent;
+        };
+    };
     struct page_desc_t* next_hash;
+    struct page_desc_t* next_lru;
+    struct page_desc_t* prev_lru;
     struct page_cache_t* cache;
     uint64_t cache_offset;
-    uint32_t next_free;
+    uint32_t ext_pages;     // free extent length, on its first and last page
     uint32_t flags;
+    uint32_t pins;          // page cache lookups not done with it yet
     uint64_t vaddr;     // mapped for kernel use, debug
-    uint64_t reserved;
+    union {
+        struct slab_list_t* slab_list;
+        uint64_t num_pages;
+    };
 };
 
+// free pages are kept as runs (extents) tagged on their first and
+// last descriptor, a hierarchical bitmap marks the first page of
+// every extent so finding one, or the one holding a given page,
+// takes a handful of word scans. 4 levels of 64 bit words cover
+// 16M pages. the same extents are also kept in a tree ordered by
+// (length, index) for best fit allocation of runs
+#define PAGE_DB_MAP_LEVELS  4
+#define PAGE_DB_NONE        (~0U)
+
 struct page_db_t {
     uint32_t page_index;    // big page index if we are small page database
     uint32_t num_pages;
     uint32_t num_free;
-    uint32_t free_list;
+    uint32_t map_levels;
     struct spinlock_t lock;
     uint16_t num_reserved;
     uint16_t flags;
+    uint32_t size_root;     // free extent size tree, 0 when empty
+    uint64_t* map[PAGE_DB_MAP_LEVELS];  // bitmap follows pages[]
     struct page_desc_t pages[];
 };
 
@@ -111,6 +195,9 @@ void page_db_init_4k(struct page_db_t* pdb, uint32_t page_index);
 uint32_t page_db_alloc(struct page_db_t* pdb);
 void page_db_free(struct page_db_t* pdb, uint32_t index);
 uintptr_t page_db_alloc_addr(struct page_db_t* pdb);
+uint32_t page_db_alloc_range(struct page_db_t* pdb,
+                             uint32_t num_pages, uint32_t align);
+void page_db_free_range(struct page_db_t* pdb, uint32_t index, uint32_t num_pages);
 void page_db_free_addr(struct page_db_t* pdb, uintptr_t addr);
 uintptr_t page_db_desc2addr(struct page_db_t* pdb, struct page_desc_t* page);
 uintptr_t page_db_index2addr(struct page_db_t* pdb, uint32_t index);
@@ -124,6 +211,8 @@ void page_db_dump_free_list(struct page_db_t* pdb);
 
 void zero_page_4k(uintptr_t addr);
 void zero_page_2m(uintptr_t addr);
+void zero_page_4k_nt(uintptr_t addr);
+void zero_page_2m_nt(uintptr_t addr);
 void copy_page_4k(uintptr_t dst, uintptr_t src);
 void copy_page_2m(uintptr_t dst, uintptr_t src);
 
@@ -0,0 +1,289 @@
+#include "vm_reclaim.h"
+#include "vm_cache.h"
+#include "vm_mmap.h"
+#include "vm_hat.h"
+#include "vm_page.h"
+#include "kernel.h"
+#include "cpu.h"
+#include "thread.h"
+#include "semaphore.h"
+#include "spinlock.h"
+#include "list.h"
+#include "stdio.h"
+
+// two list reclaim of page cache pages
+//
+// new pages go on the inactive list. passes work from the list tails,
+// taking pages off (isolating them) while their page tables are
+// sampled so no lock is held over a hat call:
+//  - inactive and referenced since the last look: the first time it
+//    gets another round on the inactive list, the second it goes active
+//  - inactive and not referenced: evicted. lookups wait on it from
+//    then on, it is unmapped everywhere, written back through
+//    write_page if modified, and freed
+//  - active pages are aged into the inactive list while that is the
+//    shorter one, the ones referenced meanwhile stay active
+// referenced/modified bits come from every area mapping the page's
+// cache. a modified page of a cache without write_page never goes.
+// the reclaim thread is woken below the page_db low watermark and
+// works towards the high one, allocations that find nothing free
+// reclaim directly
+
+// pages scanned per wakeup, freeing 4K pages only returns a 2M one
+// to page_db once all of it is free, so the watermark may not move
+#define RECLAIM_WAKE_PAGES  (VM_RECLAIM_BATCH * 16)
+
+struct page_list_t {
+    struct page_desc_t* head;   // most recent
+    struct page_desc_t* tail;
+    uint32_t num_pages;
+};
+
+static struct {
+    struct spinlock_t lock;
+    struct page_list_t active;
+    struct page_list_t inactive;
+    uint32_t low_water;         // page_db free pages
+    uint32_t high_water;
+    uint32_t wake_pending;
+    bool started;
+    struct semaphore_t wake;
+    struct {
+        uint32_t scanned;
+        uint32_t activated;
+        uint32_t deactivated;
+        uint32_t evicted;
+        uint32_t written;
+        uint32_t busy;          // pinned when it was to go
+        uint32_t wakeups;
+    } stats;
+} vm_reclaim;
+
+static void page_list_push(struct page_list_t* l, struct page_desc_t* page)
+{
+    list_push_front(l->head, l->tail, page, next_lru, prev_lru);
+    l->num_pages++;
+}
+
+static void page_list_remove(struct page_list_t* l, struct page_desc_t* page)
+{
+    list_pop(l->head, l->tail, page, next_lru, prev_lru);
+    page->next_lru = NULL;
+    page->prev_lru = NULL;
+    l->num_pages--;
+}
+
+static inline struct page_list_t* reclaim_list(struct page_desc_t* page)
+{
+    return (page->flags & PGF_ACTIVE) ? &vm_reclaim.active : &vm_reclaim.inactive;
+}
+
+void vm_reclaim_add(struct page_desc_t* page)
+{
+    int s = spinlock_lock_splhi(&vm_reclaim.lock);
+    page->flags &= ~(PGF_ACTIVE | PGF_REFERENCED | PGF_DIRTY);
+    page->flags |= PGF_LRU;
+    page_list_push(&vm_reclaim.inactive, page);
+    spinlock_unlock_splx(&vm_reclaim.lock, s);
+}
+
+// off the lists for good, false while a pass has it isolated
+bool vm_reclaim_take(struct page_desc_t* page)
+{
+    int s = spinlock_lock_splhi(&vm_reclaim.lock);
+    bool taken = page->flags & PGF_LRU;
+    if (taken) {
+        page_list_remove(reclaim_list(page), page);
+        page->flags &= ~(PGF_LRU | PGF_ACTIVE | PGF_REFERENCED | PGF_DIRTY);
+    }
+    spinlock_unlock_splx(&vm_reclaim.lock, s);
+    return taken;
+}
+
+static uint32_t reclaim_isolate(struct page_list_t* l,
+                                struct page_desc_t** pages, uint32_t num_pages)
+{
+    uint32_t n = 0;
+    int s = spinlock_lock_splhi(&vm_reclaim.lock);
+    while (n < num_pages && l->tail) {
+        struct page_desc_t* page = l->tail;
+        page_list_remove(l, page);
+        page->flags &= ~PGF_LRU;
+        pages[n++] = page;
+    }
+    vm_reclaim.stats.scanned += n;
+    spinlock_unlock_splx(&vm_reclaim.lock, s);
+    return n;
+}
+
+// under the cache lock, vm_cache_delete waits on it for the page
+// and may free the cache as soon as it can take it
+static void reclaim_putback(struct page_desc_t* page, bool active)
+{
+    struct page_cache_t* cache = page->cache;
+    int s = spinlock_lock_splhi(&cache->lock);
+    spinlock_lock(&vm_reclaim.lock);
+    if (active) {
+        page->flags |= PGF_ACTIVE;
+        page->flags &= ~PGF_REFERENCED;
+    } else {
+        page->flags &= ~PGF_ACTIVE;
+    }
+    page->flags |= PGF_LRU;
+    page_list_push(reclaim_list(page), page);
+    spinlock_unlock(&vm_reclaim.lock);
+    vm_cache_wakeup_locked(cache);
+    spinlock_unlock_splx(&cache->lock, s);
+}
+
+static inline bool reclaim_keep_dirty(struct page_desc_t* page, uint32_t bits)
+{
+    if (bits & HAT_MODIFIED)
+        page->flags |= PGF_DIRTY;
+    return (page->flags & PGF_DIRTY) && !page->cache->write_page;
+}
+
+static void reclaim_age_active(uint32_t num_pages)
+{
+    int s = spinlock_lock_splhi(&vm_reclaim.lock);
+    bool age = vm_reclaim.active.num_pages > vm_reclaim.inactive.num_pages;
+    spinlock_unlock_splx(&vm_reclaim.lock, s);
+    if (!age)
+        return;
+
+    struct page_desc_t* pages[VM_RECLAIM_BATCH];
+    uint32_t n = reclaim_isolate(&vm_reclaim.active, pages, num_pages);
+    for (uint32_t i = 0; i < n; ++i) {
+        struct page_desc_t* page = pages[i];
+        uint32_t bits = vm_mmap_page_clear(page->cache, page->cache_offset,
+                                           HAT_REFERENCED, false, NULL);
+        bool keep = (bits & HAT_REFERENCED) || reclaim_keep_dirty(page, bits);
+        if (!keep)
+            fetch_and_add_32(&vm_reclaim.stats.deactivated, 1);
+        reclaim_putback(page, keep);
+    }
+}
+
+// one pass over up to num_pages of the inactive tail, pages freed
+uint32_t vm_reclaim_pages(uint32_t num_pages)
+{
+    if (num_pages > VM_RECLAIM_BATCH)
+        num_pages = VM_RECLAIM_BATCH;
+
+    reclaim_age_active(num_pages);
+
+    struct page_desc_t* pages[VM_RECLAIM_BATCH];
+    struct page_desc_t* evict[VM_RECLAIM_BATCH];
+    uint32_t num_evict = 0;
+    uint32_t n = reclaim_isolate(&vm_reclaim.inactive, pages, num_pages);
+    for (uint32_t i = 0; i < n; ++i) {
+        struct page_desc_t* page = pages[i];
+        uint32_t bits = vm_mmap_page_clear(page->cache, page->cache_offset,
+                                           HAT_REFERENCED, false, NULL);
+        if (bits & HAT_REFERENCED) {
+            bool again = page->flags & PGF_REFERENCED;
+            page->flags |= PGF_REFERENCED;
+            if (again)
+                fetch_and_add_32(&vm_reclaim.stats.activated, 1);
+            reclaim_putback(page, again);
+        } else if (reclaim_keep_dirty(page, bits)) {
+            reclaim_putback(page, true);
+        } else if (vm_cache_evict_begin(page)) {
+            evict[num_evict++] = page;
+        } else {
+            fetch_and_add_32(&vm_reclaim.stats.busy, 1);
+            reclaim_putback(page, true);
+        }
+    }
+    if (!num_evict)
+        return 0;
+
+    // unmapped under one flush before anything is written or freed
+    uint32_t bits[VM_RECLAIM_BATCH];
+    struct vm_hat_flush_t f;
+    vm_hat_flush_init(&f, &kernel_hat);
+    for (uint32_t i = 0; i < num_evict; ++i)
+        bits[i] = vm_mmap_page_clear(evict[i]->cache, evict[i]->cache_offset, 0, true, &f);
+    vm_hat_flush(&f);
+
+    uint32_t freed = 0;
+    for (uint32_t i = 0; i < num_evict; ++i) {
+        struct page_desc_t* page = evict[i];
+        struct page_cache_t* cache = page->cache;
+        if (reclaim_keep_dirty(page, bits[i])) {
+            // written to since the look, it stays and faults back in
+            vm_cache_evict_cancel(page);
+            reclaim_putback(page, true);
+            continue;
+        }
+        if (page->flags & PGF_DIRTY) {
+            cache->write_page(page->vaddr, page->cache_offset);
+            fetch_and_add_32(&vm_reclaim.stats.written, 1);
+        }
+        page->flags &= ~PGF_DIRTY;
+        vm_cache_evict_end(page);
+        ++freed;
+    }
+    fetch_and_add_32(&vm_reclaim.stats.evicted, freed);
+    return freed;
+}
+
+static void vm_reclaim_thread()
+{
+    while (1) {
+        sema_wait(&vm_reclaim.wake);
+        vm_reclaim.stats.wakeups++;
+
+        // checks from here on signal again, the fence orders the clear
+        // before our num_free loads like their cas does the other way
+        vm_reclaim.wake_pending = 0;
+        mfence();
+
+        uint32_t scanned = 0;
+        while (page_db->num_free < vm_reclaim.high_water && scanned < RECLAIM_WAKE_PAGES) {
+            uint32_t before = vm_reclaim.stats.scanned;
+            vm_reclaim_pages(VM_RECLAIM_BATCH);
+            if (vm_reclaim.stats.scanned == before)
+                break;
+            scanned += VM_RECLAIM_BATCH;
+        }
+    }
+}
+
+// from page_db allocations, wakes the thread below the low watermark
+void vm_reclaim_check()
+{
+    if (!vm_reclaim.started || page_db->num_free >= vm_reclaim.low_water)
+        return;
+    if (compare_and_swap_32(&vm_reclaim.wake_pending, 0, 1) == 0)
+        sema_signal(&vm_reclaim.wake);
+}
+
+void vm_reclaim_dump()
+{
+    printf("reclaim: active %d inactive %d free %d low %d high %d\n",
+        vm_reclaim.active.num_pages, vm_reclaim.inactive.num_pages,
+        page_db->num_free, vm_reclaim.low_water, vm_reclaim.high_water);
+    printf("scanned %d activated %d deactivated %d evicted %d written %d busy %d wakeups %d\n",
+        vm_reclaim.stats.scanned, vm_reclaim.stats.activated,
+        vm_reclaim.stats.deactivated, vm_reclaim.stats.evicted,
+        vm_reclaim.stats.written, vm_reclaim.stats.busy, vm_reclaim.stats.wakeups);
+}
+
+void vm_reclaim_init()
+{
+    spinlock_init(&vm_reclaim.lock);
+    vm_reclaim.low_water = page_db->num_pages / 32;
+    if (vm_reclaim.low_water < 4)
+        vm_reclaim.low_water = 4;
+    vm_reclaim.high_water = vm_reclaim.low_water * 2;
+}
+
+// needs the scheduler up
+void vm_reclaim_start()
+{
+    sema_init(&vm_reclaim.wake, 0);
+    struct thread_t* t = thread_create(vm_reclaim_thread, 0x1000, get_cpu_id());
+    check(t);
+    vm_reclaim.started = true;
+}
@@ -0,0 +1,20 @@
+#ifndef KERNEL_VM_RECLAIM_H
+#define KERNEL_VM_RECLAIM_H
+
+#include "types.h"
+
+struct page_desc_t;
+
+// pages looked at per pass
+#define VM_RECLAIM_BATCH    32
+
+void vm_reclaim_init(void);
+void vm_reclaim_start(void);
+void vm_reclaim_check(void);
+
+void vm_reclaim_add(struct page_desc_t* page);
+bool vm_reclaim_take(struct page_desc_t* page);
+uint32_t vm_reclaim_pages(uint32_t num_pages);
+void vm_reclaim_dump(void);
+
+#endif // KERNEL_VM_RECLAIM_H
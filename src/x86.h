@@ -18,6 +18,42 @@ static inline uint64_t get_rflags()
     return rflags;
 }
 
+#define CR0_MP          (1<<1)      // wait/fwait honour TS
+#define CR0_EM          (1<<2)      // no x87, everything traps
+#define CR0_TS          (1<<3)      // fpu use traps with #NM
+#define CR0_NE          (1<<5)      // native x87 error reporting
+
+static inline uint64_t get_cr0()
+{
+    uint64_t cr0;
+    asm volatile(
+        "movq %%cr0, %0\n\t"
+        : "=r" (cr0)
+        :
+    );
+    return cr0;
+}
+
+static inline void set_cr0(uint64_t cr0)
+{
+    asm volatile(
+        "movq %0, %%cr0\n\t"
+        :
+        : "r" (cr0)
+        : "memory"
+    );
+}
+
+static inline void clts()
+{
+    asm volatile("clts" ::: "memory");
+}
+
+static inline void stts()
+{
+    set_cr0(get_cr0() | CR0_TS);
+}
+
 static inline uint64_t get_cr3()
 {
     uint64_t cr3;
@@ -29,6 +65,46 @@ static inline uint64_t get_cr3()
     return cr3;
 }
 
+// bit 63 keeps the tlb entries of the pcid being loaded
+#define CR3_NOFLUSH     (1UL<<63)
+
+static inline void set_cr3(uint64_t cr3)
+{
+    asm volatile(
+        "movq %0, %%cr3\n\t"
+        :
+        : "r" (cr3)
+        : "memory"
+    );
+}
+
+#define CR4_PGE         (1<<7)      // global pages
+#define CR4_OSFXSR      (1<<9)      // fxsave/fxrstor and sse
+#define CR4_OSXMMEXCPT  (1<<10)     // simd exceptions as #XM
+#define CR4_PCIDE       (1<<17)     // process context identifiers
+#define CR4_OSXSAVE     (1<<18)     // xsave and xcr0
+
+static inline uint64_t get_cr4()
+{
+    uint64_t cr4;
+    asm volatile(
+        "movq %%cr4, %0\n\t"
+        : "=r" (cr4)
+        :
+    );
+    return cr4;
+}
+
+static inline void set_cr4(uint64_t cr4)
+{
+    asm volatile(
+        "movq %0, %%cr4\n\t"
+        :
+        : "r" (cr4)
+        : "memory"
+    );
+}
+
 static inline uint64_t get_cr2()
 {
     uint64_t cr2;
@@ -40,6 +116,10 @@ static inline uint64_t get_cr2()
     return cr2;
 }
 
+#define MSR_PMC0            0x000000c1      // general purpose counters
+#define MSR_PERFEVTSEL0     0x00000186      // and their event selects
+#define MSR_PERF_GLOBAL_CTRL 0x0000038f
+#define MSR_TSC_DEADLINE    0x000006e0      // tsc deadline timer
 #define MSR_FS_BASE         0xc0000100      // 64-bit FS base
 #define MSR_GS_BASE         0xc0000101      // 64-bit GS base
 #define MSR_KERNEL_GS_BASE  0xc0000102      // swapgs
@@ -66,6 +146,55 @@ static inline void wrmsr(uint32_t msr, uint64_t val)
     );
 }
 
+#define CPUID_1_ECX_PCID            (1<<17)
+#define CPUID_1_ECX_TSC_DEADLINE    (1<<24)
+#define CPUID_1_ECX_XSAVE           (1<<26)
+#define CPUID_1_ECX_AVX             (1<<28)
+#define CPUID_1_EDX_FXSR            (1<<24)
+#define CPUID_D_1_EAX_XSAVEOPT      (1<<0)
+#define CPUID_7_EBX_ERMS            (1<<9)
+#define CPUID_7_EBX_INVPCID         (1<<10)
+#define CPUID_7_EDX_FSRM            (1<<4)
+#define CPUID_80000001_EDX_PDPE1GB  (1<<26)
+
+#define PERFEVTSEL_USR      (1<<16)
+#define PERFEVTSEL_OS       (1<<17)
+#define PERFEVTSEL_EN       (1<<22)
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t* eax, uint32_t* ebx,
+                         uint32_t* ecx, uint32_t* edx)
+{
+    asm volatile(
+        "cpuid"
+        : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+        : "a"(leaf), "c"(subleaf)
+    );
+}
+
+#define XCR0_X87    0x1
+#define XCR0_SSE    0x2
+#define XCR0_AVX    0x4
+
+static inline void xsetbv(uint32_t reg, uint64_t val)
+{
+    asm volatile(
+        "xsetbv"
+        :
+        : "c"(reg), "a"((uint32_t)val), "d"((uint32_t)(val >> 32))
+    );
+}
+
+static inline uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile(
+        "rdtsc"
+        : "=a"(lo), "=d"(hi)
+    );
+    return (uint64_t)lo | ((uint64_t)hi << 32);
+}
+
 static inline void cpu_enable_interrupts()
 {
     asm volatile("sti");
@@ -81,6 +210,14 @@ static inline void cpu_halt()
     asm volatile("hlt");
 }
 
+static inline void cpu_pause()
+{
+    asm volatile("pause" ::: "memory");
+}
+
+#define barrier()   asm volatile("" ::: "memory")
+#define mfence()    asm volatile("mfence" ::: "memory")
+
 static inline int cpu_splhi()
 {
     uint64_t rflags;
@@ -115,6 +252,31 @@ static inline uint32_t compare_and_swap_32(volatile uint32_t* ptr,
     return prev;
 }
 
+static inline uint64_t compare_and_swap_64(volatile uint64_t* ptr,
+                                           uint64_t old_val,
+                                           uint64_t new_val)
+{
+    uint64_t prev;
+    asm volatile(
+        "lock; cmpxchgq %2,%1"
+        : "=a"(prev), "+m"(*ptr)
+        : "r"(new_val), "0"(old_val)
+        : "memory"
+    );
+    return prev;
+}
+
+static inline uint64_t atomic_swap_64(volatile uint64_t* ptr, uint64_t value)
+{
+    asm volatile(
+        "xchgq %0,%1"
+        : "+r"(value), "+m"(*ptr)
+        : // no input only
+        : "memory"
+    );
+    return value;
+}
+
 static inline uint32_t fetch_and_add_32(uint32_t* var, uint32_t value)
 {
     asm volatile(